@@ -1,17 +1,32 @@
 //! メモリアロケータ
 
+mod contiguous;
+mod refcount;
+mod slab;
+
 use core::{
     alloc::{AllocError, Allocator, GlobalAlloc, Layout},
     ptr::NonNull,
+    sync::atomic::{AtomicUsize, Ordering::Relaxed},
 };
 
 use crate::{
+    config::NCPU,
+    cpu, interrupt,
     memory_layout::{symbol_addr, PHYSTOP},
     riscv::paging::{pg_roundup, PGSIZE},
     runtime,
     spinlock::SpinLock,
 };
 
+use self::contiguous::{ContiguousAllocator, CONTIGUOUS_PAGES};
+
+/// 1つのCPUが手元に保持できる空きページの最大数。
+const PAGE_CACHE_CAPACITY: usize = 32;
+
+/// 共有の空きリストとCPUごとのキャッシュの間で一度に受け渡すページ数。
+const PAGE_CACHE_BATCH: usize = PAGE_CACHE_CAPACITY / 2;
+
 /// 空きページ。
 struct UnusedPage {
     /// 次の空きページへのリンク
@@ -72,24 +87,212 @@ impl KernelAllocator {
     }
 }
 
-unsafe impl Allocator for SpinLock<KernelAllocator> {
-    fn allocate(&self, layout: core::alloc::Layout) -> Result<NonNull<[u8]>, AllocError> {
-        if PGSIZE < layout.size() {
-            return Err(AllocError);
+/// CPUごとの空きページのキャッシュ（マガジン）。
+///
+/// 割り当てと解放はまずこのキャッシュで処理され、
+/// 空になったとき・溢れたときにだけ共有の空きリストのロックを取り、
+/// `PAGE_CACHE_BATCH`枚をまとめて受け渡す。
+struct PageCache {
+    pages: [Option<NonNull<u8>>; PAGE_CACHE_CAPACITY],
+    len: usize,
+}
+
+impl PageCache {
+    const fn new() -> Self {
+        Self {
+            pages: [None; _],
+            len: 0,
+        }
+    }
+
+    fn push(&mut self, page: NonNull<u8>) {
+        assert!(self.len < PAGE_CACHE_CAPACITY);
+        self.pages[self.len] = Some(page);
+        self.len += 1;
+    }
+
+    fn pop(&mut self) -> Option<NonNull<u8>> {
+        if self.len == 0 {
+            return None;
+        }
+
+        self.len -= 1;
+        self.pages[self.len].take()
+    }
+
+    /// 共有の空きリストから`PAGE_CACHE_BATCH`枚を補充する。
+    fn refill(&mut self, allocator: &SpinLock<KernelAllocator>) {
+        let mut allocator = allocator.lock();
+        for _ in 0..PAGE_CACHE_BATCH {
+            match allocator.allocate_page() {
+                Some(page) => self.push(page),
+                None => break,
+            }
+        }
+    }
+
+    /// `PAGE_CACHE_BATCH`枚を共有の空きリストへ返却する。
+    fn drain(&mut self, allocator: &SpinLock<KernelAllocator>) {
+        let mut allocator = allocator.lock();
+        for _ in 0..PAGE_CACHE_BATCH {
+            match self.pop() {
+                Some(page) => allocator.deallocate_page(page),
+                None => break,
+            }
         }
+    }
+}
+
+/// CPUごとのページキャッシュのカウンタ。
+/// 他のCPUからも読めるようにアトミックにしている。
+struct PageCacheCounters {
+    hits: AtomicUsize,
+    refills: AtomicUsize,
+    drains: AtomicUsize,
+}
+
+impl PageCacheCounters {
+    const fn new() -> Self {
+        Self {
+            hits: AtomicUsize::new(0),
+            refills: AtomicUsize::new(0),
+            drains: AtomicUsize::new(0),
+        }
+    }
+}
+
+/// ページキャッシュの統計情報。
+#[derive(Debug, Clone, Copy)]
+pub struct PageCacheStatistics {
+    /// 共有の空きリストのロックを取らずに処理できた割り当ての回数
+    pub hits: usize,
+
+    /// 共有の空きリストから補充した回数
+    pub refills: usize,
+
+    /// 共有の空きリストへ返却した回数
+    pub drains: usize,
 
+    /// 現在キャッシュされているページ数
+    pub cached: usize,
+}
+
+static mut PAGE_CACHES: [PageCache; NCPU] = [const { PageCache::new() }; _];
+static PAGE_CACHE_COUNTERS: [PageCacheCounters; NCPU] = [const { PageCacheCounters::new() }; _];
+
+/// 現在のCPUのページキャッシュを割り込みを禁止した状態で操作する。
+fn with_page_cache<R>(f: impl FnOnce(&mut PageCache, &PageCacheCounters) -> R) -> R {
+    interrupt::off(|| {
+        let id = cpu::id();
+        unsafe { f(&mut PAGE_CACHES[id], &PAGE_CACHE_COUNTERS[id]) }
+    })
+}
+
+fn validate_page(page: NonNull<u8>) {
+    let addr = page.addr().get();
+    assert!(addr % PGSIZE == 0);
+    assert!(addr >= symbol_addr!(end));
+    assert!(addr < PHYSTOP);
+}
+
+/// 現在のCPUのキャッシュを経由してページを割り当てる。
+fn allocate_cached(allocator: &SpinLock<KernelAllocator>) -> Option<NonNull<u8>> {
+    with_page_cache(|cache, counters| {
+        if cache.len == 0 {
+            counters.refills.fetch_add(1, Relaxed);
+            cache.refill(allocator);
+        } else {
+            counters.hits.fetch_add(1, Relaxed);
+        }
+
+        cache.pop()
+    })
+}
+
+/// 現在のCPUのキャッシュを経由してページを解放する。
+fn deallocate_cached(allocator: &SpinLock<KernelAllocator>, page: NonNull<u8>) {
+    validate_page(page);
+
+    with_page_cache(|cache, counters| {
+        if cache.len == PAGE_CACHE_CAPACITY {
+            counters.drains.fetch_add(1, Relaxed);
+            cache.drain(allocator);
+        }
+
+        cache.push(page);
+    })
+}
+
+/// ページを1枚割り当て、参照カウントを1にする。
+fn allocate_counted(allocator: &SpinLock<KernelAllocator>) -> Option<NonNull<u8>> {
+    let page = allocate_cached(allocator)?;
+    refcount::reset(page.addr().get());
+    Some(page)
+}
+
+/// ページの参照を1つ手放し、最後の参照であれば解放する。
+fn deallocate_counted(allocator: &SpinLock<KernelAllocator>, page: NonNull<u8>) {
+    if refcount::release(page.addr().get()) {
+        deallocate_cached(allocator, page);
+    }
+}
+
+/// 複数ページにまたがる割り当てに使う連続領域。
+static CONTIGUOUS: SpinLock<ContiguousAllocator> =
+    SpinLock::named("contiguous", ContiguousAllocator::empty());
+
+/// 割り当ての大きさに応じた割り当て方法。
+enum Route {
+    /// スラブのサイズクラス
+    Slab(usize),
+
+    /// ページ1枚
+    Page,
+
+    /// 連続したページ
+    Contiguous(usize),
+}
+
+impl Route {
+    fn of(layout: Layout) -> Option<Self> {
         if PGSIZE % layout.align() != 0 {
-            return Err(AllocError);
+            return None;
         }
 
-        match self.lock().allocate_page() {
-            Some(ptr) => Ok(NonNull::from_raw_parts(ptr.cast(), PGSIZE)),
-            None => Err(AllocError),
+        if let Some(class) = slab::class_of(layout) {
+            return Some(Self::Slab(class));
         }
+
+        if layout.size() <= PGSIZE {
+            return Some(Self::Page);
+        }
+
+        Some(Self::Contiguous(pg_roundup(layout.size()) / PGSIZE))
     }
+}
 
-    unsafe fn deallocate(&self, ptr: NonNull<u8>, _: Layout) {
-        self.lock().deallocate_page(ptr);
+unsafe impl Allocator for SpinLock<KernelAllocator> {
+    fn allocate(&self, layout: core::alloc::Layout) -> Result<NonNull<[u8]>, AllocError> {
+        let allocated = match Route::of(layout).ok_or(AllocError)? {
+            Route::Slab(class) => slab::allocate(class, || allocate_cached(self)),
+            Route::Page => {
+                allocate_counted(self).map(|ptr| NonNull::from_raw_parts(ptr.cast(), PGSIZE))
+            }
+            Route::Contiguous(count) => CONTIGUOUS
+                .lock()
+                .allocate(count)
+                .map(|ptr| NonNull::from_raw_parts(ptr.cast(), count * PGSIZE)),
+        };
+
+        allocated.ok_or(AllocError)
+    }
+
+    unsafe fn deallocate(&self, ptr: NonNull<u8>, layout: Layout) {
+        match Route::of(layout).unwrap() {
+            Route::Slab(class) => slab::deallocate(class, ptr),
+            Route::Page => deallocate_counted(self, ptr),
+            Route::Contiguous(count) => CONTIGUOUS.lock().deallocate(ptr, count),
+        }
     }
 }
 
@@ -110,13 +313,70 @@ pub fn initialize() {
     let mut allocator = get().lock();
     assert!(allocator.head.is_none());
 
+    // 物理メモリの末尾を複数ページの割り当て用に予約する。
+    let contiguous = PHYSTOP - CONTIGUOUS_PAGES * PGSIZE;
+    CONTIGUOUS.lock().register(contiguous);
+
     let start = symbol_addr!(end);
-    let end = PHYSTOP;
+    let end = contiguous;
     allocator.register_pages(start, end);
 }
 
+/// ページを1枚割り当てる。
+pub fn allocate_page() -> Option<NonNull<u8>> {
+    allocate_counted(get())
+}
+
+/// `allocate_page`で割り当てたページの参照を手放す。
+/// 最後の参照であればページを解放する。
+pub fn deallocate_page(page: NonNull<u8>) {
+    deallocate_counted(get(), page);
+}
+
+/// 割り当て済みのページを共有し、参照を1つ増やす。
+/// 共有したページは参照ごとに`deallocate_page`で手放す。
+pub fn share_page(page: usize) {
+    refcount::acquire(page);
+}
+
+/// ページを参照している数を返す。
+pub fn page_references(page: usize) -> u32 {
+    refcount::get(page)
+}
+
+/// 指定したCPUのページキャッシュの統計情報を返す。
+pub fn statistics(cpu: usize) -> PageCacheStatistics {
+    let counters = &PAGE_CACHE_COUNTERS[cpu];
+    PageCacheStatistics {
+        hits: counters.hits.load(Relaxed),
+        refills: counters.refills.load(Relaxed),
+        drains: counters.drains.load(Relaxed),
+        cached: unsafe { core::ptr::addr_of!(PAGE_CACHES[cpu].len).read_volatile() },
+    }
+}
+
+pub fn dump() {
+    for cpu in 0..NCPU {
+        let stat = statistics(cpu);
+        crate::println!(
+            "cpu{}: page cache hits={} refills={} drains={} cached={}",
+            cpu,
+            stat.hits,
+            stat.refills,
+            stat.drains,
+            stat.cached
+        );
+    }
+    slab::dump();
+    crate::println!(
+        "contiguous: used={}/{}",
+        CONTIGUOUS.lock().used_pages(),
+        CONTIGUOUS_PAGES
+    );
+}
+
 pub fn get() -> &'static SpinLock<KernelAllocator> {
     #[global_allocator]
-    static ALLOCATOR: SpinLock<KernelAllocator> = SpinLock::new(KernelAllocator::empty());
+    static ALLOCATOR: SpinLock<KernelAllocator> = SpinLock::named("kmem", KernelAllocator::empty());
     &ALLOCATOR
 }
@@ -0,0 +1,86 @@
+//! 複数ページにまたがるオブジェクト用の連続領域アロケータ
+//!
+//! 起動時に物理メモリの末尾を予約し、ページ単位のビットマップで管理する。
+
+use core::ptr::NonNull;
+
+use crate::{bitmap::Bitmap, riscv::paging::PGSIZE};
+
+/// 連続領域として予約するページ数
+pub const CONTIGUOUS_PAGES: usize = 2048;
+
+/// 連続したページの割り当てを管理する。
+pub struct ContiguousAllocator {
+    /// 領域の先頭アドレス
+    base: usize,
+
+    /// 使用中のページ
+    used: Bitmap<CONTIGUOUS_PAGES>,
+
+    /// 次に探索を始めるページ
+    next: usize,
+}
+
+impl ContiguousAllocator {
+    pub const fn empty() -> Self {
+        Self {
+            base: 0,
+            used: Bitmap::new(),
+            next: 0,
+        }
+    }
+
+    /// `base`から始まる`CONTIGUOUS_PAGES`枚のページを管理の対象にする。
+    pub fn register(&mut self, base: usize) {
+        assert!(self.base == 0);
+        assert!(base % PGSIZE == 0);
+        self.base = base;
+    }
+
+    pub const fn contains(&self, addr: usize) -> bool {
+        self.base <= addr && addr < self.base + CONTIGUOUS_PAGES * PGSIZE
+    }
+
+    fn is_free(&self, start: usize, count: usize) -> bool {
+        (start..start + count).all(|i| self.used.get(i) == Some(false))
+    }
+
+    /// `count`枚の連続したページを割り当てる。
+    pub fn allocate(&mut self, count: usize) -> Option<NonNull<u8>> {
+        if self.base == 0 || count == 0 || count > CONTIGUOUS_PAGES {
+            return None;
+        }
+
+        let last = CONTIGUOUS_PAGES - count;
+        let start = (self.next..=last)
+            .chain(0..self.next.min(last + 1))
+            .find(|start| self.is_free(*start, count))?;
+
+        for i in start..start + count {
+            self.used.set(i, true).unwrap();
+        }
+        self.next = (start + count) % CONTIGUOUS_PAGES;
+
+        let addr = self.base + start * PGSIZE;
+        NonNull::new(core::ptr::from_exposed_addr_mut(addr))
+    }
+
+    /// `allocate`で割り当てたページを解放する。
+    pub fn deallocate(&mut self, ptr: NonNull<u8>, count: usize) {
+        let addr = ptr.addr().get();
+        assert!(self.contains(addr));
+        assert!(addr % PGSIZE == 0);
+
+        let start = (addr - self.base) / PGSIZE;
+        for i in start..start + count {
+            self.used.deallocate(i).unwrap();
+        }
+    }
+
+    /// 使用中のページ数を返す。
+    pub fn used_pages(&self) -> usize {
+        (0..CONTIGUOUS_PAGES)
+            .filter(|i| self.used.get(*i) == Some(true))
+            .count()
+    }
+}
@@ -0,0 +1,46 @@
+//! ページごとの参照カウント
+//!
+//! コピーオンライトで複数のページテーブルから共有されるページは、
+//! 最後の参照がなくなったときに初めてアロケータへ返却する。
+
+use core::sync::atomic::{AtomicU32, Ordering::AcqRel, Ordering::Acquire, Ordering::Release};
+
+use crate::{
+    memory_layout::{KERNBASE, PHYSTOP},
+    riscv::paging::PGSIZE,
+};
+
+/// 参照カウントを持つページ数
+const NPAGES: usize = (PHYSTOP - KERNBASE) / PGSIZE;
+
+static COUNTS: [AtomicU32; NPAGES] = [const { AtomicU32::new(0) }; _];
+
+fn count(page: usize) -> &'static AtomicU32 {
+    assert!(page % PGSIZE == 0);
+    assert!((KERNBASE..PHYSTOP).contains(&page));
+    &COUNTS[(page - KERNBASE) / PGSIZE]
+}
+
+/// 割り当てたばかりのページの参照カウントを1にする。
+pub fn reset(page: usize) {
+    count(page).store(1, Release);
+}
+
+/// ページの参照を1つ増やす。
+pub fn acquire(page: usize) {
+    let previous = count(page).fetch_add(1, AcqRel);
+    assert!(previous > 0);
+}
+
+/// ページの参照を1つ減らす。
+/// 最後の参照であれば`true`を返す。
+pub fn release(page: usize) -> bool {
+    let previous = count(page).fetch_sub(1, AcqRel);
+    assert!(previous > 0);
+    previous == 1
+}
+
+/// ページを参照している数を返す。
+pub fn get(page: usize) -> u32 {
+    count(page).load(Acquire)
+}
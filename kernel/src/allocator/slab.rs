@@ -0,0 +1,128 @@
+//! ページ未満のオブジェクト用のスラブアロケータ
+//!
+//! 2の冪のサイズクラス(32〜2048バイト)ごとに空きオブジェクトのリストを持ち、
+//! リストが空になったらページを1枚取ってきてオブジェクトに切り分ける。
+//! 切り分けたページはページアロケータには返さず、同じサイズクラスで再利用する。
+
+use core::{
+    alloc::Layout,
+    ptr::NonNull,
+    sync::atomic::{AtomicUsize, Ordering::Relaxed},
+};
+
+use crate::{riscv::paging::PGSIZE, spinlock::SpinLock};
+
+/// 最小のサイズクラス
+const MIN_SIZE: usize = 32;
+
+/// 最大のサイズクラス
+pub const MAX_SIZE: usize = 2048;
+
+/// サイズクラスの数
+const NCLASS: usize = (MAX_SIZE / MIN_SIZE).trailing_zeros() as usize + 1;
+
+/// 空きオブジェクト。
+struct FreeObject {
+    /// 次の空きオブジェクトへのリンク
+    next: Option<NonNull<Self>>,
+}
+
+/// 1つのサイズクラスの空きオブジェクトのリスト。
+struct SizeClass {
+    /// 先頭の空きオブジェクト
+    head: Option<NonNull<FreeObject>>,
+}
+
+impl SizeClass {
+    const fn new() -> Self {
+        Self { head: None }
+    }
+
+    fn pop(&mut self) -> Option<NonNull<u8>> {
+        let object = self.head?;
+        self.head = unsafe { object.as_ref().next };
+        Some(object.cast())
+    }
+
+    fn push(&mut self, object: NonNull<u8>) {
+        let mut object = object.cast::<FreeObject>();
+        unsafe { object.as_mut().next = self.head };
+        self.head = Some(object);
+    }
+
+    /// ページを`size`バイトのオブジェクトに切り分けて登録する。
+    fn carve(&mut self, page: NonNull<u8>, size: usize) {
+        for offset in (0..PGSIZE).step_by(size).rev() {
+            self.push(page.map_addr(|addr| addr.saturating_add(offset)));
+        }
+    }
+}
+
+/// サイズクラスごとのカウンタ。
+struct SizeClassCounters {
+    pages: AtomicUsize,
+    in_use: AtomicUsize,
+}
+
+impl SizeClassCounters {
+    const fn new() -> Self {
+        Self {
+            pages: AtomicUsize::new(0),
+            in_use: AtomicUsize::new(0),
+        }
+    }
+}
+
+static CLASSES: [SpinLock<SizeClass>; NCLASS] = [const { SpinLock::new(SizeClass::new()) }; _];
+static COUNTERS: [SizeClassCounters; NCLASS] = [const { SizeClassCounters::new() }; _];
+
+const fn class_size(class: usize) -> usize {
+    MIN_SIZE << class
+}
+
+/// レイアウトを満たすサイズクラスを返す。
+/// スラブで扱えない大きさであれば`None`を返す。
+pub fn class_of(layout: Layout) -> Option<usize> {
+    let size = layout.size().max(layout.align()).max(MIN_SIZE);
+    if size > MAX_SIZE {
+        return None;
+    }
+
+    let size = size.next_power_of_two();
+    Some((size / MIN_SIZE).trailing_zeros() as usize)
+}
+
+/// サイズクラス`class`のオブジェクトを割り当てる。
+/// 空きがなければ`page`で取得したページを切り分けて補充する。
+pub fn allocate(class: usize, page: impl FnOnce() -> Option<NonNull<u8>>) -> Option<NonNull<[u8]>> {
+    let size = class_size(class);
+
+    let mut list = CLASSES[class].lock();
+    if list.head.is_none() {
+        list.carve(page()?, size);
+        COUNTERS[class].pages.fetch_add(1, Relaxed);
+    }
+
+    let object = list.pop()?;
+    COUNTERS[class].in_use.fetch_add(1, Relaxed);
+    Some(NonNull::from_raw_parts(object.cast(), size))
+}
+
+/// `allocate`で割り当てたオブジェクトを解放する。
+pub fn deallocate(class: usize, object: NonNull<u8>) {
+    assert!(object.addr().get() % class_size(class) == 0);
+
+    CLASSES[class].lock().push(object);
+    COUNTERS[class].in_use.fetch_sub(1, Relaxed);
+}
+
+pub fn dump() {
+    for (class, counters) in COUNTERS.iter().enumerate() {
+        crate::println!(
+            "slab {}: pages={} in use={}",
+            class_size(class),
+            counters.pages.load(Relaxed),
+            counters.in_use.load(Relaxed)
+        );
+    }
+}
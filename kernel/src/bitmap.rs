@@ -42,15 +42,45 @@ where
     }
 
     pub fn allocate(&mut self) -> Option<usize> {
-        for i in 0..self.bits() {
-            if self.get(i) == Some(false) {
-                self.set(i, true).unwrap();
-                return Some(i);
+        let index = self.find_free(0)?;
+        self.set(index, true).unwrap();
+        Some(index)
+    }
+
+    /// `start`番目以降で最初に空いているビットを返す。
+    /// 64ビット単位で調べるため、埋まっている範囲はまとめて読み飛ばす。
+    pub fn find_free(&self, start: usize) -> Option<usize> {
+        const WORD_BYTES: usize = core::mem::size_of::<u64>();
+
+        let mut index = start;
+        while index < BITS {
+            let byte = byte_index(index);
+            if index % u64::BITS as usize == 0 && byte + WORD_BYTES <= self.bytes() {
+                let word =
+                    u64::from_le_bytes(self.bitmap[byte..(byte + WORD_BYTES)].try_into().unwrap());
+                if word == u64::MAX {
+                    index += u64::BITS as usize;
+                    continue;
+                }
+                index += word.trailing_ones() as usize;
+                return (index < BITS).then_some(index);
             }
+
+            if self.get(index) == Some(false) {
+                return Some(index);
+            }
+            index += 1;
         }
         None
     }
 
+    /// `start`番目から連続して空いているビットの数を、`max`を上限として返す。
+    pub fn count_free(&self, start: usize, max: usize) -> usize {
+        (start..BITS.min(start.saturating_add(max)))
+            .take_while(|&i| self.get(i) == Some(false))
+            .count()
+    }
+
     pub const fn deallocate(&mut self, index: usize) -> Result<(), ()> {
         match self.get(index) {
             Some(true) => self.set(index, false),
@@ -1,4 +1,10 @@
-use crate::const_for;
+use core::cell::UnsafeCell;
+use core::hash::{Hash, Hasher};
+use core::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+
+use alloc::{boxed::Box, vec::Vec};
+
+use crate::{const_for, spinlock::SpinLock};
 
 struct Link<Key> {
     index: usize,
@@ -191,3 +197,258 @@ impl<Key, const N: usize> RcCache<Key, N> {
         self.counts.get(index).cloned()
     }
 }
+
+/// FNV-1aハッシュ関数
+pub struct Fnv1a(u64);
+
+impl Fnv1a {
+    const OFFSET_BASIS: u64 = 0xcbf29ce484222325;
+    const PRIME: u64 = 0x100000001b3;
+
+    pub const fn new() -> Self {
+        Self(Self::OFFSET_BASIS)
+    }
+}
+
+impl Hasher for Fnv1a {
+    fn finish(&self) -> u64 {
+        self.0
+    }
+
+    fn write(&mut self, bytes: &[u8]) {
+        for byte in bytes {
+            self.0 ^= *byte as u64;
+            self.0 = self.0.wrapping_mul(Self::PRIME);
+        }
+    }
+}
+
+/// スロットがどのバケットにも属していないことを表す。
+const NO_BUCKET: usize = usize::MAX;
+
+/// スロットの状態。所属するバケットのロックで保護される。
+struct SlotState<Key> {
+    key: Option<Key>,
+
+    /// 同じバケットの次のスロット
+    next: Option<usize>,
+
+    /// 参照カウント
+    count: usize,
+}
+
+struct Slot<Key> {
+    state: UnsafeCell<SlotState<Key>>,
+
+    /// 所属するバケット。
+    /// 追い出しのロックと両方のバケットのロックを保持して書き換える。
+    bucket: AtomicUsize,
+
+    /// 最近参照されたかどうか(クロックアルゴリズム用)
+    referenced: AtomicBool,
+}
+
+/// ハッシュで索引付けされた参照カウント付きキャッシュ。
+///
+/// バケットごとのロックで検索するため、異なるキーの検索は互いに待たない。
+/// 参照されていないスロットはクロックアルゴリズムで追い出して再利用する。
+/// 容量は起動時に決める。
+pub struct HashCache<Key> {
+    slots: Box<[Slot<Key>]>,
+
+    /// 各バケットの先頭のスロット
+    buckets: Box<[SpinLock<Option<usize>>]>,
+
+    /// 追い出しのロックとクロックの針
+    hand: SpinLock<usize>,
+}
+
+unsafe impl<Key: Send> Sync for HashCache<Key> {}
+
+impl<Key> HashCache<Key> {
+    /// `capacity`個のスロットを持つキャッシュを作成する。
+    pub fn new(capacity: usize) -> Result<Self, ()> {
+        assert!(capacity > 0);
+
+        let mut slots = Vec::new();
+        slots.try_reserve_exact(capacity).map_err(|_| ())?;
+        for _ in 0..capacity {
+            slots.push(Slot {
+                state: UnsafeCell::new(SlotState {
+                    key: None,
+                    next: None,
+                    count: 0,
+                }),
+                bucket: AtomicUsize::new(NO_BUCKET),
+                referenced: AtomicBool::new(false),
+            });
+        }
+
+        let nbucket = capacity.next_power_of_two();
+        let mut buckets = Vec::new();
+        buckets.try_reserve_exact(nbucket).map_err(|_| ())?;
+        for _ in 0..nbucket {
+            buckets.push(SpinLock::new(None));
+        }
+
+        Ok(Self {
+            slots: slots.into_boxed_slice(),
+            buckets: buckets.into_boxed_slice(),
+            hand: SpinLock::new(0),
+        })
+    }
+
+    /// スロットの状態を参照する。
+    /// 呼び出し側はスロットが所属するバケットのロックを保持していなければならない。
+    #[allow(clippy::mut_from_ref)]
+    unsafe fn state(&self, index: usize) -> &mut SlotState<Key> {
+        &mut *self.slots[index].state.get()
+    }
+
+    fn bucket_of(&self, key: &Key) -> usize
+    where
+        Key: Hash,
+    {
+        let mut hasher = Fnv1a::new();
+        key.hash(&mut hasher);
+        hasher.finish() as usize & (self.buckets.len() - 1)
+    }
+
+    fn chain(&self, head: Option<usize>) -> impl '_ + Iterator<Item = usize> {
+        core::iter::successors(head, |index| unsafe { self.state(*index).next })
+    }
+
+    /// バケットのロックを保持した状態でキーを検索し、見つかれば参照を増やす。
+    fn lookup(&self, head: Option<usize>, key: &Key) -> Option<usize>
+    where
+        Key: PartialEq,
+    {
+        let index = self
+            .chain(head)
+            .find(|index| unsafe { self.state(*index).key.as_ref() } == Some(key))?;
+
+        unsafe { self.state(index).count += 1 };
+        self.slots[index].referenced.store(true, Ordering::Relaxed);
+        Some(index)
+    }
+
+    /// `head`から始まるバケットからスロットを外す。
+    /// 参照されているか、最近参照されたスロットであれば外さない。
+    fn unlink(&self, index: usize, head: &mut Option<usize>) -> bool {
+        let state = unsafe { self.state(index) };
+        if state.count != 0 || self.slots[index].referenced.swap(false, Ordering::Relaxed) {
+            return false;
+        }
+
+        let next = state.next.take();
+        if *head == Some(index) {
+            *head = next;
+        } else {
+            let prev = self
+                .chain(*head)
+                .find(|prev| unsafe { self.state(*prev).next } == Some(index))
+                .unwrap();
+            unsafe { self.state(prev).next = next };
+        }
+
+        state.key = None;
+        self.slots[index].bucket.store(NO_BUCKET, Ordering::Release);
+        true
+    }
+
+    /// 追い出しのロックと`bucket`のロックを保持した状態で、
+    /// 再利用できるスロットを探す。
+    fn evict(&self, hand: &mut usize, bucket: usize, head: &mut Option<usize>) -> Option<usize> {
+        // 2周すれば参照ビットはすべて一度は落とされる。
+        for _ in 0..(2 * self.slots.len()) {
+            let index = *hand;
+            *hand = (index + 1) % self.slots.len();
+
+            let found = match self.slots[index].bucket.load(Ordering::Acquire) {
+                NO_BUCKET => true,
+                other if other == bucket => self.unlink(index, head),
+                other => self.unlink(index, &mut self.buckets[other].lock()),
+            };
+
+            if found {
+                return Some(index);
+            }
+        }
+
+        None
+    }
+
+    /// キーに対応するスロットを取得し、参照を1つ増やす。
+    /// キャッシュになければ空いているスロットを割り当て、
+    /// 他から見つかるようになる前にバケットのロックを保持したまま`insert`を呼ぶ。
+    /// すべてのスロットが参照されていれば`None`を返す。
+    pub fn get(&self, key: Key, insert: impl FnOnce(usize)) -> Option<usize>
+    where
+        Key: Hash + PartialEq,
+    {
+        let bucket = self.bucket_of(&key);
+
+        if let Some(index) = self.lookup(*self.buckets[bucket].lock(), &key) {
+            return Some(index);
+        }
+
+        // 追い出しは1つずつ行う。
+        // ロックを取り直す間に他のCPUが同じキーを登録しているかもしれない。
+        let mut hand = self.hand.lock();
+        let mut head = self.buckets[bucket].lock();
+        if let Some(index) = self.lookup(*head, &key) {
+            return Some(index);
+        }
+
+        let index = self.evict(&mut hand, bucket, &mut head)?;
+
+        let state = unsafe { self.state(index) };
+        state.key = Some(key);
+        state.next = head.replace(index);
+        state.count = 1;
+        self.slots[index].bucket.store(bucket, Ordering::Release);
+        self.slots[index].referenced.store(true, Ordering::Relaxed);
+
+        insert(index);
+        Some(index)
+    }
+
+    /// 参照を1つ増やす。
+    pub fn duplicate(&self, index: usize) {
+        let bucket = self.slots[index].bucket.load(Ordering::Acquire);
+        let _head = self.buckets[bucket].lock();
+
+        let state = unsafe { self.state(index) };
+        assert!(state.count > 0);
+        state.count += 1;
+    }
+
+    /// 他にも参照があれば参照を1つ減らして`true`を返す。
+    /// 呼び出し側が唯一の参照を保持していれば何もせず`false`を返す。
+    /// 判定と減算は同じバケットのロックの下で行うため、
+    /// 同時に手放した参照のどちらも最後とみなされないことはない。
+    pub fn release_shared(&self, index: usize) -> bool {
+        let bucket = self.slots[index].bucket.load(Ordering::Acquire);
+        let _head = self.buckets[bucket].lock();
+
+        let state = unsafe { self.state(index) };
+        assert!(state.count > 0);
+        if state.count == 1 {
+            return false;
+        }
+        state.count -= 1;
+        true
+    }
+
+    /// 参照を1つ減らし、参照がなくなったかどうかを返す。
+    /// 参照のなくなったスロットも追い出されるまではキャッシュに残る。
+    pub fn release(&self, index: usize) -> bool {
+        let bucket = self.slots[index].bucket.load(Ordering::Acquire);
+        let _head = self.buckets[bucket].lock();
+
+        let state = unsafe { self.state(index) };
+        assert!(state.count > 0);
+        state.count -= 1;
+        state.count == 0
+    }
+}
@@ -1,28 +1,60 @@
-use crate::{process, spinlock::SpinLock};
+// the tick counter and sleeping for a number of ticks.
+//
+// sleepers are kept in a hashed timer wheel: a process that
+// sleeps until tick t waits in slot t % NTIMERSLOT, and each
+// tick only wakes the slot of the new tick. a sleeper whose
+// deadline is a full turn of the wheel or more away goes back
+// to sleep.
 
-static TICKS: SpinLock<u64> = SpinLock::new(0);
+use core::sync::atomic::{AtomicU64, Ordering::*};
+
+use crate::{
+    config::{NTIMERSLOT, TIMEBASE},
+    process, riscv,
+    spinlock::SpinLock,
+};
+
+static TICKS: AtomicU64 = AtomicU64::new(0);
+
+static WHEEL: [SpinLock<()>; NTIMERSLOT] = [const { SpinLock::new(()) }; _];
+
+fn slot(tick: u64) -> &'static SpinLock<()> {
+    &WHEEL[(tick % NTIMERSLOT as u64) as usize]
+}
 
 pub fn get() -> u64 {
-    *TICKS.lock()
+    TICKS.load(Acquire)
 }
 
 pub fn tick() {
-    let mut ticks = TICKS.lock();
-    *ticks = (*ticks).wrapping_add(1);
-    process::wakeup(core::ptr::addr_of!(TICKS).addr());
+    let now = TICKS.fetch_add(1, AcqRel).wrapping_add(1);
+
+    // a sleeper checks the tick count with the slot held,
+    // so this can't slip in between its check and its sleep.
+    let slot = slot(now);
+    let _guard = slot.lock();
+    process::wakeup(core::ptr::addr_of!(*slot).addr());
 }
 
 #[must_use]
 pub fn sleep(time: u64) -> bool {
-    let mut current = TICKS.lock();
+    let start = get();
 
-    let start = *current;
-    while (*current - start) < time {
+    let slot = slot(start.wrapping_add(time));
+    let mut guard = slot.lock();
+    while get().wrapping_sub(start) < time {
         if process::is_killed() == Some(true) {
             return false;
         }
-        process::sleep(core::ptr::addr_of!(TICKS).addr(), &mut current);
+        process::sleep(core::ptr::addr_of!(*slot).addr(), &mut guard);
     }
 
     true
 }
+
+// Nanoseconds since boot, from the time CSR, which
+// counts much faster than the timer interrupt ticks.
+pub fn nanoseconds() -> u64 {
+    let time = unsafe { riscv::read_csr!(time) };
+    (time as u128 * 1_000_000_000 / TIMEBASE as u128) as u64
+}
@@ -1,6 +1,25 @@
 // maximum number of processes
 pub const NPROC: usize = 64;
 
+// number of wait channel buckets
+pub const NCHANNEL: usize = 64;
+
+// slots of the timer wheel that sleep() waits in
+pub const NTIMERSLOT: usize = 32;
+
+// frequency of the time CSR, in Hz (qemu's virt machine)
+pub const TIMEBASE: u64 = 10_000_000;
+
+// max named spinlocks whose statistics procdump shows
+pub const NLOCKSTAT: usize = 16;
+
+// trace events kept per CPU
+pub const NTRACE: usize = 256;
+
+// profiler samples kept per CPU, and pcs in each
+pub const NPROF: usize = 512;
+pub const NPROFDEPTH: usize = 8;
+
 // maximum number of CPUs
 pub const NCPU: usize = 8;
 
@@ -11,7 +30,7 @@ pub const NOFILE: usize = 16;
 pub const NFILE: usize = 100;
 
 // maximum number of active i-nodes
-pub const NINODE: usize = 50;
+pub const NINODE: usize = 512;
 
 // maximum major device number
 pub const NDEV: usize = 10;
@@ -19,20 +38,46 @@ pub const NDEV: usize = 10;
 // device number of file system root disk
 pub const ROOTDEV: usize = 1;
 
+// maximum number of disks, numbered from ROOTDEV
+pub const NDISK: usize = 4;
+
 // max exec arguments
 pub const MAXARG: usize = 32;
 
+// max buffers in one readv or writev
+pub const MAXIOV: usize = 64;
+
+// max loadable segments of an executable
+pub const MAXSEGMENT: usize = 8;
+
 // max # of blocks any FS op writes
 pub const MAXOPBLOCKS: usize = 10;
 
-// max data blocks in on-disk log
-pub const LOGSIZE: usize = MAXOPBLOCKS * 3;
+// max times a commit gives up the CPU waiting for
+// other FS system calls to join its transaction
+pub const GROUPCOMMIT: usize = 4;
+
+// size of disk block cache, allocated at boot.
+// must be larger than the log.
+pub const NBUF: usize = 1024;
+
+// blocks reserved ahead of a file being appended to
+pub const NPREALLOC: usize = 8;
+
+// default capacity of a pipe, in bytes
+pub const PIPESIZE: usize = 4096;
+
+// max capacity pipesize() can give a pipe
+pub const MAXPIPESIZE: usize = 16 * 4096;
+
+// entries of the directory name cache
+pub const NDCACHE: usize = 256;
 
-// size of disk block cache
-pub const NBUF: usize = MAXOPBLOCKS * 3;
+// max blocks read ahead of a sequential reader
+pub const NREADAHEAD: usize = 8;
 
 // size of file system in blocks
-pub const FSSIZE: usize = 2000;
+pub const FSSIZE: usize = 200000;
 
 // maximum file path name
 pub const MAXPATH: usize = 128;
@@ -30,6 +30,9 @@ pub struct Console {
 impl Console {
     const INPUT_BUF_LEN: usize = 128;
 
+    // bytes copied in from write() at a time.
+    const OUTPUT_CHUNK_LEN: usize = 256;
+
     pub const fn new() -> Self {
         Self {
             buf: [0; _],
@@ -49,7 +52,8 @@ impl Console {
     //
     // send one character to the uart.
     // called by printf, and to echo input characters,
-    // but not from write().
+    // but not from write(), which goes through the
+    // uart's output buffer.
     //
     pub fn putc(c: u8) {
         uart::get().putc_blocking(c);
@@ -57,15 +61,21 @@ impl Console {
 
     //
     // user write()s to the console go here.
+    // user_src indicates whether src is a user
+    // or kernel address.
     //
-    pub fn write(src: usize, n: usize) -> usize {
-        for i in 0..n {
-            match process::read_memory(src + i) {
-                Some(ch) => Self::putc(ch),
-                None => return i,
+    pub fn write(user_src: bool, src: usize, n: usize) -> usize {
+        let mut chunk = [0u8; Self::OUTPUT_CHUNK_LEN];
+        let mut i = 0;
+        while i < n {
+            let m = (n - i).min(chunk.len());
+            if !unsafe { process::copyin_either(&mut chunk[..m], user_src, src + i) } {
+                break;
             }
+            uart::get().write(&chunk[..m]);
+            i += m;
         }
-        n
+        i
     }
 
     //
@@ -129,10 +139,10 @@ impl SpinLockGuard<'static, Console> {
     //
     // user read()s from the console go here.
     // copy (up to) a whole input line to dst.
-    // user_dist indicates whether dst is a user
+    // user_dst indicates whether dst is a user
     // or kernel address.
     //
-    pub fn read(&mut self, mut dst: usize, mut n: usize) -> i32 {
+    pub fn read(&mut self, user_dst: bool, mut dst: usize, mut n: usize) -> i32 {
         let target = n;
         while n > 0 {
             // wait until interrupt handler has put some
@@ -157,7 +167,7 @@ impl SpinLockGuard<'static, Console> {
                 break;
             }
 
-            if !process::write_memory(dst, c) {
+            if !unsafe { process::copyout_either(user_dst, dst, &c) } {
                 break;
             }
 
@@ -185,7 +195,7 @@ impl core::fmt::Write for Console {
     }
 }
 
-pub static CONSOLE: SpinLock<Console> = SpinLock::new(Console::new());
+pub static CONSOLE: SpinLock<Console> = SpinLock::named("cons", Console::new());
 
 pub fn consoleintr(c: i32) {
     CONSOLE.lock().handle_interrupt(c as u8);
@@ -202,10 +212,10 @@ pub unsafe fn initialize() {
     });
 }
 
-fn consolewrite(src: usize, n: usize) -> i32 {
-    Console::write(src, n) as i32
+fn consolewrite(user_src: bool, src: usize, n: usize) -> i32 {
+    Console::write(user_src, src, n) as i32
 }
 
-fn consoleread(dst: usize, n: usize) -> i32 {
-    CONSOLE.lock().read(dst, n)
+fn consoleread(user_dst: bool, dst: usize, n: usize) -> i32 {
+    CONSOLE.lock().read(user_dst, dst, n)
 }
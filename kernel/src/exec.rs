@@ -1,12 +1,14 @@
+use core::mem::ManuallyDrop;
+
 use alloc::ffi::CString;
+use arrayvec::ArrayVec;
 
-use crate::vm::PageTable;
 use crate::{
     config::MAXARG,
     elf::{ELFHeader, ProgramHeader},
     filesystem::log,
-    fs::{self, InodeGuard},
-    process,
+    fs::{self, InodeReference},
+    process::{self, Segment},
     riscv::paging::{pg_roundup, PGSIZE, PTE},
 };
 
@@ -21,30 +23,13 @@ fn flags2perm(flags: u32) -> u64 {
     perm
 }
 
-fn load_segment(
-    pagetable: &mut PageTable,
-    va: usize,
-    inode: &mut InodeGuard,
-    offset: usize,
-    size: usize,
-) -> bool {
-    for i in (0..size).step_by(PGSIZE) {
-        let pa = pagetable.virtual_to_physical(va + i).unwrap();
-        let n = (size - i).min(PGSIZE);
-        if inode.copy_to::<u8>(false, pa, offset + i, n) != Ok(n) {
-            return false;
-        }
-    }
-    true
-}
-
 pub unsafe fn execute(path: &str, argv: &[CString]) -> Result<usize, ()> {
     let bad = |mut pagetable, size| {
         process::free_pagetable(&mut pagetable, size);
         Err(())
     };
 
-    let (elf, context, size, mut pagetable) = log::with(|| {
+    let (elf, context, size, mut pagetable, segments, executable) = log::with(|| {
         let Some(inode_ref) = fs::search_inode(path) else {
             return Err(());
         };
@@ -66,8 +51,10 @@ pub unsafe fn execute(path: &str, argv: &[CString]) -> Result<usize, ()> {
             return Err(());
         };
 
-        // Load program into memory.
+        // Record the program's segments. Their pages are
+        // read from the executable when first touched.
         let mut size = 0;
+        let mut segments = ArrayVec::new();
         for offset in (elf.phoff..)
             .step_by(core::mem::size_of::<ProgramHeader>())
             .take(elf.phnum as usize)
@@ -92,26 +79,33 @@ pub unsafe fn execute(path: &str, argv: &[CString]) -> Result<usize, ()> {
                 return bad(pagetable, size);
             }
 
-            match pagetable.grow(size, header.vaddr + header.memsz, flags2perm(header.flags)) {
-                Ok(new_size) => size = new_size,
-                Err(_) => return bad(pagetable, size),
+            match header.off.checked_add(header.filesz) {
+                Some(end) if end <= inode.size() => {}
+                _ => return bad(pagetable, size),
             }
 
-            if !load_segment(
-                &mut pagetable,
-                header.vaddr,
-                &mut inode,
-                header.off,
-                header.filesz,
-            ) {
+            let segment = Segment {
+                va: header.vaddr,
+                memsz: header.memsz,
+                offset: header.off,
+                filesz: header.filesz,
+                perm: flags2perm(header.flags),
+            };
+            if segments.try_push(segment).is_err() {
                 return bad(pagetable, size);
             }
+
+            size = size.max(header.vaddr + header.memsz);
         }
-        Ok((elf, context, size, pagetable))
+
+        Ok((elf, context, size, pagetable, segments, inode_ref))
     })?;
 
-    let bad = |mut pagetable, size| {
+    // the executable must be released inside a transaction.
+    let executable = ManuallyDrop::new(executable);
+    let bad = |mut pagetable, size, mut executable: ManuallyDrop<InodeReference>| {
         process::free_pagetable(&mut pagetable, size);
+        log::with(|| unsafe { ManuallyDrop::drop(&mut executable) });
         Err(())
     };
 
@@ -121,7 +115,7 @@ pub unsafe fn execute(path: &str, argv: &[CString]) -> Result<usize, ()> {
     // Use the second as the user stack.
     let size = pg_roundup(size);
     let Ok(size) = pagetable.grow(size, size + 2 * PGSIZE, PTE::W) else {
-        return bad(pagetable, size);
+        return bad(pagetable, size, executable);
     };
 
     pagetable
@@ -136,7 +130,7 @@ pub unsafe fn execute(path: &str, argv: &[CString]) -> Result<usize, ()> {
     let mut ustack = [0usize; MAXARG];
     for (i, arg) in argv.iter().enumerate() {
         if i >= MAXARG {
-            return bad(pagetable, size);
+            return bad(pagetable, size, executable);
         }
 
         let len = arg.to_bytes().len() + 1;
@@ -145,11 +139,11 @@ pub unsafe fn execute(path: &str, argv: &[CString]) -> Result<usize, ()> {
         sp -= sp % 16; // riscv sp must be 16-byte aligned
 
         if sp < stackbase {
-            return bad(pagetable, size);
+            return bad(pagetable, size, executable);
         }
 
         if pagetable.write(sp, arg.to_bytes_with_nul()).is_err() {
-            return bad(pagetable, size);
+            return bad(pagetable, size, executable);
         }
 
         ustack[i] = sp;
@@ -160,12 +154,12 @@ pub unsafe fn execute(path: &str, argv: &[CString]) -> Result<usize, ()> {
     sp -= sp % 16;
 
     if sp < stackbase {
-        return bad(pagetable, size);
+        return bad(pagetable, size, executable);
     }
 
     let ustack_with_nul = &ustack[..(argv.len() + 1)];
     if pagetable.write(sp, ustack_with_nul).is_err() {
-        return bad(pagetable, size);
+        return bad(pagetable, size, executable);
     }
 
     // arguments to user main(argc, argv)
@@ -175,6 +169,11 @@ pub unsafe fn execute(path: &str, argv: &[CString]) -> Result<usize, ()> {
 
     let mut old_pagetable = core::mem::replace(&mut context.pagetable, pagetable);
     context.sz = size;
+    context.segments = segments;
+    let old_executable = context.executable.replace(executable);
+    if let Some(mut inode) = old_executable {
+        log::with(|| unsafe { ManuallyDrop::drop(&mut inode) });
+    }
     context.trapframe.epc = elf.entry as u64;
     context.trapframe.sp = sp as u64;
     process::free_pagetable(&mut old_pagetable, old_size);
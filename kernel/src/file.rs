@@ -4,24 +4,25 @@ use core::sync::atomic::{AtomicUsize, Ordering::*};
 use crate::filesystem::stat::Stat;
 use crate::fs::InodeReference;
 use crate::{
-    config::{MAXOPBLOCKS, NDEV},
+    allocator,
+    config::{MAXOPBLOCKS, NDEV, NREADAHEAD},
     filesystem::buffer::BSIZE,
     filesystem::log,
     pipe::Pipe,
+    riscv::paging::PGSIZE,
 };
 
-pub const PIPESIZE: usize = 512;
-
 #[derive(Debug)]
 pub enum File {
     Pipe {
-        pipe: Pipe<PIPESIZE>,
+        pipe: Pipe,
     },
     Inode {
         inode: ManuallyDrop<InodeReference>,
         offset: AtomicUsize,
         readable: bool,
         writable: bool,
+        sequential: AtomicUsize, // where a sequential read would continue
     },
     Device {
         inode: ManuallyDrop<InodeReference>,
@@ -32,7 +33,7 @@ pub enum File {
 }
 
 impl File {
-    pub const fn new_pipe(pipe: Pipe<PIPESIZE>) -> Self {
+    pub const fn new_pipe(pipe: Pipe) -> Self {
         Self::Pipe { pipe }
     }
 
@@ -42,6 +43,7 @@ impl File {
             offset: AtomicUsize::new(0),
             readable,
             writable,
+            sequential: AtomicUsize::new(0),
         }
     }
 
@@ -66,23 +68,70 @@ impl File {
         }
     }
 
+    // Read from file f.
+    // addr is a user virtual address.
     pub fn read(&'static self, addr: usize, n: usize) -> Result<usize, ()> {
+        self.read_either(true, addr, n)
+    }
+
+    // Write to file f.
+    // addr is a user virtual address.
+    pub fn write(&'static self, addr: usize, n: usize) -> Result<usize, ()> {
+        self.write_either(true, addr, n)
+    }
+
+    // Read from file f at the given offset, neither using nor
+    // moving the file's own offset. Only i-nodes have offsets.
+    // addr is a user virtual address.
+    pub fn read_at(&'static self, addr: usize, n: usize, position: usize) -> Result<usize, ()> {
         match self {
-            Self::Pipe { pipe } => pipe.read(addr, n),
+            Self::Inode {
+                inode, readable, ..
+            } if *readable => inode.lock().copy_to::<u8>(true, addr, position, n),
+            _ => Err(()),
+        }
+    }
+
+    // Write to file f at the given offset, like read_at.
+    // addr is a user virtual address.
+    pub fn write_at(&'static self, addr: usize, n: usize, position: usize) -> Result<usize, ()> {
+        match self {
+            Self::Inode {
+                inode, writable, ..
+            } if *writable => write_inode(inode, true, addr, n, &AtomicUsize::new(position)),
+            _ => Err(()),
+        }
+    }
+
+    // user_dst indicates whether addr is a user
+    // or kernel address.
+    fn read_either(&'static self, user_dst: bool, addr: usize, n: usize) -> Result<usize, ()> {
+        match self {
+            Self::Pipe { pipe } => pipe.read(user_dst, addr, n),
             Self::Inode {
                 inode,
                 offset,
                 readable,
+                sequential,
                 ..
             } => {
                 if !*readable {
                     return Err(());
                 }
 
-                let read = inode
-                    .lock()
-                    .copy_to::<u8>(true, addr, offset.load(Acquire), n)?;
+                let start = offset.load(Acquire);
+                let mut inode = inode.lock();
+                let read = inode.copy_to::<u8>(user_dst, addr, start, n)?;
                 offset.fetch_add(read, Release);
+
+                // a read that picks up where the previous one
+                // ended is likely to be followed by the next one,
+                // so start fetching the blocks after it.
+                let end = start + read;
+                if read > 0 && sequential.swap(end, Relaxed) == start {
+                    inode.readahead(end, NREADAHEAD);
+                }
+
                 Ok(read)
             }
             Self::Device {
@@ -93,7 +142,7 @@ impl File {
                 }
 
                 let device = unsafe { DEVICEFILES.get(*major).ok_or(())? };
-                let result = (device.as_ref().unwrap().read)(addr, n);
+                let result = (device.as_ref().unwrap().read)(user_dst, addr, n);
                 if result < 0 {
                     Err(())
                 } else {
@@ -103,9 +152,11 @@ impl File {
         }
     }
 
-    pub fn write(&'static self, addr: usize, n: usize) -> Result<usize, ()> {
+    // user_src indicates whether addr is a user
+    // or kernel address.
+    fn write_either(&'static self, user_src: bool, addr: usize, n: usize) -> Result<usize, ()> {
         match self {
-            Self::Pipe { pipe } => pipe.write(addr, n),
+            Self::Pipe { pipe } => pipe.write(user_src, addr, n),
             Self::Inode {
                 inode,
                 offset,
@@ -115,38 +166,7 @@ impl File {
                 if !*writable {
                     return Err(());
                 }
-
-                // write a few blocks at a time to avoid exceeding
-                // the maximum log transaction size, including
-                // i-node, indirect block, allocation blocks,
-                // and 2 blocks of slop for non-aligned writes.
-                // this really belongs lower down, since writei()
-                // might be writing a device like the console.
-                let max = ((MAXOPBLOCKS - 1 - 1 - 2) / 2) * BSIZE;
-                let mut i = 0;
-                while i < n {
-                    let n = (n - i).min(max);
-
-                    let wrote = log::with(|| {
-                        let wrote = inode
-                            .lock()
-                            .copy_from::<u8>(true, addr + i, offset.load(Acquire), n)
-                            .unwrap_or(0);
-                        offset.fetch_add(wrote, Release);
-                        wrote
-                    });
-
-                    if wrote != n {
-                        break;
-                    }
-                    i += n;
-                }
-
-                if i == n {
-                    Ok(n)
-                } else {
-                    Err(())
-                }
+                write_inode(inode, user_src, addr, n, offset)
             }
             Self::Device {
                 major, writable, ..
@@ -155,7 +175,7 @@ impl File {
                     return Err(());
                 }
                 let device = unsafe { DEVICEFILES.get(*major).ok_or(())? };
-                let result = (device.as_ref().unwrap().write)(addr, n);
+                let result = (device.as_ref().unwrap().write)(user_src, addr, n);
                 if result < 0 {
                     Err(())
                 } else {
@@ -164,6 +184,132 @@ impl File {
             }
         }
     }
+
+    // Write n bytes at kernel address addr, retrying short
+    // writes, and return how many were written before one
+    // failed, counting those of a partial i-node write.
+    fn write_all(&'static self, addr: usize, n: usize) -> usize {
+        let mut written = 0;
+        while written < n {
+            let wrote = match self {
+                Self::Inode {
+                    inode,
+                    offset,
+                    writable: true,
+                    ..
+                } => write_inode_partial(inode, false, addr + written, n - written, offset),
+                _ => self
+                    .write_either(false, addr + written, n - written)
+                    .unwrap_or(0),
+            };
+            if wrote == 0 {
+                break;
+            }
+            written += wrote;
+        }
+        written
+    }
+
+    // Move up to n bytes from file f to out without copying them
+    // through user memory. A pipe on either side is read or
+    // written in place, straight from or into its ring buffer;
+    // between other files the data goes through one kernel page.
+    // Returns the number of bytes moved, 0 at the end of f.
+    pub fn splice(&'static self, out: &'static File, n: usize) -> Result<usize, ()> {
+        match (self, out) {
+            (Self::Pipe { pipe: from }, Self::Pipe { pipe: to }) if from.is_same(to) => Err(()),
+            (_, Self::Pipe { pipe }) => {
+                pipe.fill(n, |addr, len| self.read_either(false, addr, len))
+            }
+            (Self::Pipe { pipe }, _) => {
+                // a partial write must count, or the pipe would
+                // hand the bytes it wrote out again.
+                pipe.drain(n, |addr, len| match out.write_all(addr, len) {
+                    0 if len > 0 => Err(()),
+                    written => Ok(written),
+                })
+            }
+            _ => {
+                let page = allocator::allocate_page().ok_or(())?;
+                let addr = page.as_ptr().addr();
+
+                let result = self
+                    .read_either(false, addr, n.min(PGSIZE))
+                    .and_then(|read| {
+                        let written = out.write_all(addr, read);
+                        // give back what couldn't be written, so that it
+                        // can be read again. devices can't take it back.
+                        if let Self::Inode { offset, .. } = self {
+                            offset.fetch_sub(read - written, Release);
+                        }
+                        if written == 0 && read > 0 {
+                            Err(())
+                        } else {
+                            Ok(written)
+                        }
+                    });
+
+                allocator::deallocate_page(page);
+                result
+            }
+        }
+    }
+}
+
+// Write n bytes from addr to an i-node at offset, and advance
+// offset past what was written. Fails unless all of it was.
+fn write_inode(
+    inode: &InodeReference,
+    user_src: bool,
+    addr: usize,
+    n: usize,
+    offset: &AtomicUsize,
+) -> Result<usize, ()> {
+    if write_inode_partial(inode, user_src, addr, n, offset) == n {
+        Ok(n)
+    } else {
+        Err(())
+    }
+}
+
+// Like write_inode, but return how much was written.
+fn write_inode_partial(
+    inode: &InodeReference,
+    user_src: bool,
+    addr: usize,
+    n: usize,
+    offset: &AtomicUsize,
+) -> usize {
+    // write a few blocks at a time to avoid exceeding
+    // the maximum log transaction size, including
+    // i-node, two levels of indirect blocks,
+    // allocation blocks, and 2 blocks of slop
+    // for non-aligned writes.
+    // each transaction reserves a quarter of the log,
+    // so that big writes still share commits.
+    // this really belongs lower down, since writei()
+    // might be writing a device like the console.
+    let reservation = (log::capacity() / 4).max(MAXOPBLOCKS);
+    let max = ((reservation - 1 - 2 - 2) / 2) * BSIZE;
+    let mut i = 0;
+    while i < n {
+        let n = (n - i).min(max);
+
+        let wrote = log::with_reserved(reservation, || {
+            let wrote = inode
+                .lock()
+                .copy_from::<u8>(user_src, addr + i, offset.load(Acquire), n)
+                .unwrap_or(0);
+            offset.fetch_add(wrote, Release);
+            wrote
+        });
+
+        i += wrote;
+        if wrote != n {
+            break;
+        }
+    }
+    i
 }
 
 impl Drop for File {
@@ -179,8 +325,8 @@ impl Drop for File {
 
 #[repr(C)]
 pub struct DeviceFile {
-    pub read: fn(usize, usize) -> i32,
-    pub write: fn(usize, usize) -> i32,
+    pub read: fn(bool, usize, usize) -> i32,
+    pub write: fn(bool, usize, usize) -> i32,
 }
 
 pub static mut DEVICEFILES: [Option<DeviceFile>; NDEV] = [const { None }; _];
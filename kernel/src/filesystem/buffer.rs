@@ -1,14 +1,22 @@
 use core::marker::PhantomData;
+use core::mem::MaybeUninit;
 use core::ops::{Deref, DerefMut};
+use core::sync::atomic::{AtomicBool, Ordering};
+
+use alloc::{boxed::Box, vec::Vec};
+use arrayvec::ArrayVec;
 
 use crate::{
-    cache::RcCache,
-    config::NBUF,
+    cache::HashCache,
     sleeplock::{SleepLock, SleepLockGuard},
-    spinlock::SpinLock,
-    virtio,
+    virtio::{
+        self,
+        disk::{Ticket, MAX_SEGMENTS},
+    },
 };
 
+use crate::filesystem::log;
+
 pub const BSIZE: usize = 1024;
 
 const fn check_convertibility<T, const SIZE: usize>() {
@@ -16,38 +24,69 @@ const fn check_convertibility<T, const SIZE: usize>() {
     assert!(!core::mem::needs_drop::<T>());
 }
 
-#[derive(PartialEq, Eq)]
+#[derive(PartialEq, Eq, Hash)]
 struct BufferKey {
     device: usize,
     block: usize,
 }
 
-pub struct Buffer<'a, T, const BSIZE: usize, const CSIZE: usize> {
-    cache: &'a BufferCache<BSIZE, CSIZE>,
-    buffer: SleepLockGuard<[u8; BSIZE]>,
+/// バッファの中身。
+struct BufferData {
+    data: [u8; BSIZE],
+
+    /// 先読みで発行したまま、完了を待っていない読み込み
+    pending: Option<Ticket>,
+}
+
+impl BufferData {
+    /// 先読みの完了を待ちます。
+    /// バッファの中身に触れる前に必ず呼び出します。
+    fn complete(&mut self) {
+        if let Some(ticket) = self.pending.take() {
+            unsafe { virtio::disk::wait(ticket) };
+        }
+    }
+}
+
+pub struct Buffer<'a, T> {
+    cache: &'a BufferCache,
+    buffer: SleepLockGuard<BufferData>,
+    device: usize,
     block_number: usize,
     cache_index: usize,
     phantom: PhantomData<T>,
 }
 
-impl<'a, T, const BSIZE: usize, const CSIZE: usize> Buffer<'a, T, BSIZE, CSIZE> {
+impl<'a, T> Buffer<'a, T> {
     pub const fn block_number(this: &Self) -> usize {
         this.block_number
     }
+
+    pub const fn device(this: &Self) -> usize {
+        this.device
+    }
 }
 
-impl<'a, T, const BSIZE: usize, const CSIZE: usize> Deref for Buffer<'a, T, BSIZE, CSIZE> {
+impl<'a, T> Deref for Buffer<'a, T> {
     type Target = T;
 
     fn deref(&self) -> &Self::Target {
-        unsafe { self.buffer.as_ptr().cast::<T>().as_ref().unwrap_unchecked() }
+        unsafe {
+            self.buffer
+                .data
+                .as_ptr()
+                .cast::<T>()
+                .as_ref()
+                .unwrap_unchecked()
+        }
     }
 }
 
-impl<'a, T, const BSIZE: usize, const CSIZE: usize> DerefMut for Buffer<'a, T, BSIZE, CSIZE> {
+impl<'a, T> DerefMut for Buffer<'a, T> {
     fn deref_mut(&mut self) -> &mut Self::Target {
         unsafe {
             self.buffer
+                .data
                 .as_mut_ptr()
                 .cast::<T>()
                 .as_mut()
@@ -56,26 +95,50 @@ impl<'a, T, const BSIZE: usize, const CSIZE: usize> DerefMut for Buffer<'a, T, B
     }
 }
 
-impl<'a, T, const BSIZE: usize, const CSIZE: usize> Drop for Buffer<'a, T, BSIZE, CSIZE> {
+impl<'a, T> Drop for Buffer<'a, T> {
     fn drop(&mut self) {
         self.cache.release(self.cache_index);
     }
 }
 
-pub struct BufferCache<const BSIZE: usize, const CSIZE: usize> {
-    buffers: [SleepLock<[u8; BSIZE]>; CSIZE],
-    cache: SpinLock<RcCache<BufferKey, CSIZE>>,
+pub struct BufferCache {
+    buffers: Box<[SleepLock<BufferData>]>,
+
+    /// バッファがディスクの内容を保持しているかどうか
+    valid: Box<[AtomicBool]>,
+
+    cache: HashCache<BufferKey>,
 }
 
-impl<const BSIZE: usize, const CSIZE: usize> BufferCache<BSIZE, CSIZE> {
-    pub const fn new() -> Self {
-        Self {
-            // TODO:
-            //buffers: [const { SleepLock::new([0; _]) }; _],
-            buffers: [const { SleepLock::new(unsafe { core::mem::MaybeUninit::zeroed().assume_init() }) };
-                _],
-            cache: SpinLock::new(RcCache::new()),
-        }
+impl BufferCache {
+    fn new(capacity: usize) -> Result<Self, ()> {
+        let mut buffers = Vec::new();
+        buffers.try_reserve_exact(capacity).map_err(|_| ())?;
+        buffers.resize_with(capacity, || {
+            SleepLock::new(BufferData {
+                data: [0; BSIZE],
+                pending: None,
+            })
+        });
+
+        let mut valid = Vec::new();
+        valid.try_reserve_exact(capacity).map_err(|_| ())?;
+        valid.resize_with(capacity, || AtomicBool::new(false));
+
+        Ok(Self {
+            buffers: buffers.into_boxed_slice(),
+            valid: valid.into_boxed_slice(),
+            cache: HashCache::new(capacity)?,
+        })
+    }
+
+    /// キャッシュのスロットを取得し、参照を1つ増やします。
+    fn slot(&self, device: usize, block: usize) -> Option<usize> {
+        // 別のブロックから再利用されたバッファは、
+        // 他から見つかるようになる前に無効にしておきます
+        self.cache.get(BufferKey { device, block }, |index| {
+            self.valid[index].store(false, Ordering::Release);
+        })
     }
 
     /// バッファを取得します。
@@ -85,43 +148,35 @@ impl<const BSIZE: usize, const CSIZE: usize> BufferCache<BSIZE, CSIZE> {
         &'static self,
         device: usize,
         block: usize,
-    ) -> Option<(usize, SleepLockGuard<[u8; BSIZE]>, bool)> {
-        // キャッシュのロックを保持しておきます
-        let mut cache = self.cache.lock();
+    ) -> Option<(usize, SleepLockGuard<BufferData>)> {
+        let index = self.slot(device, block)?;
 
-        // index: 目的のバッファのインデックス
-        // is_new: それが新規のバッファであるかどうか
-        let (index, is_new) = cache.get(BufferKey { device, block })?;
+        // キャッシュのロックは外れているので、スリープして待機できます
+        let mut buffer = self.buffers[index].lock();
+        buffer.complete();
 
-        // ロックを外せるようになったので外します
-        // ここで外し忘れると（値の破棄順序によっては）、キャッシュをロックしたまま
-        // バッファのロックをスリープで待機し、デッドロックが起こる危険があります
-        // （🔒の箇所）
-        SpinLock::unlock(cache);
-
-        Some((
-            index,
-            self.buffers[index].lock(), // 🔒
-            is_new,
-        ))
+        Some((index, buffer))
     }
 
     unsafe fn with_read<T>(
         &'static self,
         device: usize,
         block: usize,
-    ) -> Option<Buffer<'static, T, BSIZE, CSIZE>> {
+    ) -> Option<Buffer<'static, T>> {
         const { check_convertibility::<T, BSIZE>() };
 
-        let (index, mut buffer, is_uninit) = self.get(device, block)?;
+        let (index, mut buffer) = self.get(device, block)?;
 
-        if is_uninit {
-            unsafe { virtio::disk::read(buffer.as_mut_ptr().addr(), block, BSIZE) };
+        if !self.valid[index].load(Ordering::Acquire) {
+            let addr = buffer.data.as_mut_ptr().addr();
+            unsafe { virtio::disk::read(device, addr, block, BSIZE) };
+            self.valid[index].store(true, Ordering::Release);
         }
 
         Some(Buffer {
             cache: self,
             buffer,
+            device,
             block_number: block,
             cache_index: index,
             phantom: PhantomData,
@@ -133,64 +188,190 @@ impl<const BSIZE: usize, const CSIZE: usize> BufferCache<BSIZE, CSIZE> {
         device: usize,
         block: usize,
         src: &T,
-    ) -> Option<Buffer<'static, T, BSIZE, CSIZE>> {
+    ) -> Option<Buffer<'static, T>> {
         const { check_convertibility::<T, BSIZE>() };
 
-        let (index, mut buffer, _) = self.get(device, block)?;
+        let (index, mut buffer) = self.get(device, block)?;
+
+        // ブロックの一部だけを書き換える場合は、残りをディスクから読んでおきます
+        if core::mem::size_of::<T>() < BSIZE && !self.valid[index].load(Ordering::Acquire) {
+            let addr = buffer.data.as_mut_ptr().addr();
+            unsafe { virtio::disk::read(device, addr, block, BSIZE) };
+        }
 
         unsafe {
-            buffer.as_mut_ptr().cast::<T>().copy_from(src, 1);
+            buffer.data.as_mut_ptr().cast::<T>().copy_from(src, 1);
         }
+        self.valid[index].store(true, Ordering::Release);
 
         Some(Buffer {
             cache: self,
             buffer,
+            device,
             block_number: block,
             cache_index: index,
             phantom: PhantomData,
         })
     }
 
+    fn prefetch(&'static self, device: usize, blocks: &[usize]) {
+        // 連続するブロックは1つの要求にまとめて読み込みます
+        let mut run = ArrayVec::<_, MAX_SEGMENTS>::new();
+        let mut first = 0;
+
+        for &block in blocks {
+            if !run.is_empty() && (block != first + run.len() || run.is_full()) {
+                self.read_run(device, first, &mut run);
+            }
+
+            let Some(index) = self.slot(device, block) else {
+                break;
+            };
+
+            // 使用中のバッファは読み込み済みか、読み込み中のはずです
+            if !self.valid[index].load(Ordering::Acquire) {
+                if let Some(mut buffer) = self.buffers[index].try_lock() {
+                    // 再利用されたバッファでは前の先読みがまだ終わっていないことがあるので、
+                    // 同じページに2つの読み込みが重ならないよう待ちます
+                    buffer.complete();
+                    if !self.valid[index].load(Ordering::Acquire) {
+                        if run.is_empty() {
+                            first = block;
+                        }
+                        run.push((index, buffer));
+                        continue;
+                    }
+                }
+            }
+
+            self.release(index);
+        }
+
+        if !run.is_empty() {
+            self.read_run(device, first, &mut run);
+        }
+        unsafe { virtio::disk::notify(device) };
+    }
+
+    /// `first`から連続するブロックを、ロックしたバッファに読み込む要求を出します。
+    /// バッファはすべて同じ要求の完了を待ちます。
+    fn read_run(
+        &self,
+        device: usize,
+        first: usize,
+        run: &mut ArrayVec<(usize, SleepLockGuard<BufferData>), MAX_SEGMENTS>,
+    ) {
+        let addrs = run
+            .iter_mut()
+            .map(|(_, buffer)| buffer.data.as_mut_ptr().addr())
+            .collect::<ArrayVec<_, MAX_SEGMENTS>>();
+        let ticket = unsafe { virtio::disk::submit(device, &addrs, first, BSIZE, false) };
+
+        for (index, mut buffer) in run.drain(..) {
+            buffer.pending = Some(ticket.clone());
+            self.valid[index].store(true, Ordering::Release);
+            drop(buffer);
+            self.release(index);
+        }
+    }
+
     fn release(&self, index: usize) {
-        self.cache.lock().release(index).unwrap();
+        self.cache.release(index);
     }
 
     fn pin(&self, index: usize) {
-        self.cache.lock().duplicate(index).unwrap();
+        self.cache.duplicate(index);
     }
 
     fn unpin(&self, index: usize) {
-        let is_released = self.cache.lock().release(index).unwrap();
+        let is_released = self.cache.release(index);
         assert!(!is_released)
     }
 }
 
-static CACHE: BufferCache<BSIZE, NBUF> = BufferCache::new();
+static mut CACHE: MaybeUninit<BufferCache> = MaybeUninit::uninit();
 
-pub unsafe fn with_read<T>(device: usize, block: usize) -> Option<Buffer<'static, T, BSIZE, NBUF>> {
-    CACHE.with_read(device, block)
+fn cache() -> &'static BufferCache {
+    unsafe { CACHE.assume_init_ref() }
 }
 
-pub fn with_write<T>(
-    device: usize,
-    block: usize,
-    src: &T,
-) -> Option<Buffer<'static, T, BSIZE, NBUF>> {
-    CACHE.with_write(device, block, src)
+/// `capacity`個のバッファを持つキャッシュを作成します。
+/// ファイルシステムを使い始める前に一度だけ呼び出します。
+pub fn initialize(capacity: usize) {
+    // ログに書き込み中のブロックはすべてキャッシュに固定されます
+    assert!(capacity > log::CAPACITY);
+
+    let cache = BufferCache::new(capacity).unwrap();
+    unsafe { CACHE.write(cache) };
+}
+
+pub unsafe fn with_read<T>(device: usize, block: usize) -> Option<Buffer<'static, T>> {
+    cache().with_read(device, block)
+}
+
+pub fn with_write<T>(device: usize, block: usize, src: &T) -> Option<Buffer<'static, T>> {
+    cache().with_write(device, block, src)
 }
 
-pub unsafe fn flush<T: 'static>(mut buffer: Buffer<'static, T, BSIZE, NBUF>) {
+/// ブロックをまとめて非同期に読み込み始めます。
+/// 完了は待たず、次にバッファを取得したときに待ちます。
+/// キャッシュに空きがなくなった場合、残りのブロックは読み込みません。
+pub fn prefetch(device: usize, blocks: &[usize]) {
+    cache().prefetch(device, blocks);
+}
+
+pub unsafe fn flush<T: 'static>(mut buffer: Buffer<'static, T>) {
     virtio::disk::write(
-        buffer.buffer.as_mut_ptr().addr(),
+        buffer.device,
+        buffer.buffer.data.as_mut_ptr().addr(),
         buffer.block_number,
         BSIZE,
     );
 }
 
-pub fn pin<T>(buffer: &Buffer<T, BSIZE, NBUF>) {
-    CACHE.pin(buffer.cache_index);
+/// 複数のバッファをまとめてディスクに書き込みます。
+/// 同じデバイスで連続するブロックは1つの要求にまとめ、
+/// 要求をすべてキューに入れてからデバイスに一度だけ通知し、
+/// それぞれの完了を待ちます。
+pub unsafe fn flush_all<T: 'static, const N: usize>(mut buffers: ArrayVec<Buffer<'static, T>, N>) {
+    buffers.sort_unstable_by_key(|buffer| (buffer.device, buffer.block_number));
+
+    let mut tickets = ArrayVec::<_, N>::new();
+    let mut rest = &mut buffers[..];
+    while let Some(first) = rest.first() {
+        let (device, block) = (first.device, first.block_number);
+        let n = rest
+            .iter()
+            .take(MAX_SEGMENTS)
+            .enumerate()
+            .take_while(|(i, buffer)| buffer.device == device && buffer.block_number == block + i)
+            .count();
+
+        let (run, tail) = core::mem::take(&mut rest).split_at_mut(n);
+        let addrs = run
+            .iter_mut()
+            .map(|buffer| buffer.buffer.data.as_mut_ptr().addr())
+            .collect::<ArrayVec<_, MAX_SEGMENTS>>();
+        tickets.push(virtio::disk::submit(device, &addrs, block, BSIZE, true));
+        rest = tail;
+    }
+
+    // 並べ替えたので、デバイスが変わるたびに通知します
+    for (i, buffer) in buffers.iter().enumerate() {
+        if i == 0 || buffers[i - 1].device != buffer.device {
+            virtio::disk::notify(buffer.device);
+        }
+    }
+
+    for ticket in tickets {
+        virtio::disk::wait(ticket);
+    }
+}
+
+pub fn pin<T>(buffer: &Buffer<T>) {
+    cache().pin(buffer.cache_index);
 }
 
-pub fn unpin<T>(buffer: &Buffer<T, BSIZE, NBUF>) {
-    CACHE.unpin(buffer.cache_index);
+pub fn unpin<T>(buffer: &Buffer<T>) {
+    cache().unpin(buffer.cache_index);
 }
@@ -0,0 +1,121 @@
+//! ディレクトリの名前検索のキャッシュ
+//!
+//! (デバイス, ディレクトリのi-node番号, 名前)から、エントリが指すi-node番号と
+//! ディレクトリ内のオフセットを引く。見つからなかったことも記録しておくため、
+//! 存在しないパスの検索もディレクトリを読まずに済む。
+//!
+//! エントリはディレクトリのスリープロックを保持したまま読み書きするので、
+//! ディレクトリの内容とは常に一致している。
+
+use core::hash::{Hash, Hasher};
+
+use crate::{
+    cache::Fnv1a, config::NDCACHE, filesystem::directory_entry::DirectoryEntry, spinlock::SpinLock,
+};
+
+/// 1つのセットに入るエントリ数
+const WAYS: usize = 4;
+
+const NSETS: usize = NDCACHE / WAYS;
+
+type Name = [u8; DirectoryEntry::NAME_LENGTH];
+
+#[derive(Clone, Copy)]
+struct Entry {
+    device: usize,
+    directory: usize,
+    name: Name,
+
+    /// 名前が指すi-node番号とオフセット。`None`は名前が存在しないことを表す。
+    target: Option<(usize, usize)>,
+}
+
+impl Entry {
+    fn is(&self, device: usize, directory: usize, name: &Name) -> bool {
+        self.device == device && self.directory == directory && self.name == *name
+    }
+}
+
+struct Set {
+    entries: [Option<Entry>; WAYS],
+
+    /// 次に追い出すエントリ
+    victim: usize,
+}
+
+static SETS: [SpinLock<Set>; NSETS] = [const {
+    SpinLock::new(Set {
+        entries: [None; WAYS],
+        victim: 0,
+    })
+}; _];
+
+/// ディレクトリエントリと同じく、長すぎる名前は切り詰めて比較する。
+fn normalize(name: &str) -> Name {
+    let mut normalized = [0; DirectoryEntry::NAME_LENGTH];
+    let len = name.len().min(DirectoryEntry::NAME_LENGTH);
+    normalized[..len].copy_from_slice(&name.as_bytes()[..len]);
+    normalized
+}
+
+fn set(device: usize, directory: usize, name: &Name) -> &'static SpinLock<Set> {
+    let mut hasher = Fnv1a::new();
+    (device, directory, name).hash(&mut hasher);
+    &SETS[hasher.finish() as usize % NSETS]
+}
+
+/// 名前を検索する。
+/// キャッシュにない場合は`None`を、名前が存在しないと分かっている場合は`Some(None)`を返す。
+pub fn get(device: usize, directory: usize, name: &str) -> Option<Option<(usize, usize)>> {
+    let name = normalize(name);
+    let set = set(device, directory, &name).lock();
+
+    set.entries
+        .iter()
+        .flatten()
+        .find(|entry| entry.is(device, directory, &name))
+        .map(|entry| entry.target)
+}
+
+/// 名前の検索結果を記録する。`target`が`None`なら名前が存在しないことを記録する。
+pub fn insert(device: usize, directory: usize, name: &str, target: Option<(usize, usize)>) {
+    let name = normalize(name);
+    let mut set = set(device, directory, &name).lock();
+
+    let entry = Entry {
+        device,
+        directory,
+        name,
+        target,
+    };
+
+    let way = match set
+        .entries
+        .iter()
+        .position(|e| e.map_or(false, |e| e.is(device, directory, &name)))
+    {
+        Some(way) => way,
+        None => match set.entries.iter().position(Option::is_none) {
+            Some(way) => way,
+            None => {
+                let way = set.victim;
+                set.victim = (way + 1) % WAYS;
+                way
+            }
+        },
+    };
+    set.entries[way] = Some(entry);
+}
+
+/// ディレクトリのエントリをすべて捨てる。
+/// ディレクトリのi-nodeを解放するときに呼ぶ。
+pub fn forget(device: usize, directory: usize) {
+    for set in SETS.iter() {
+        let mut set = set.lock();
+        for slot in set.entries.iter_mut() {
+            if slot.map_or(false, |e| e.device == device && e.directory == directory) {
+                *slot = None;
+            }
+        }
+    }
+}
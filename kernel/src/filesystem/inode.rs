@@ -19,6 +19,7 @@ pub struct Inode {
     pub size: u32,
     pub addrs: [u32; NDIRECT],
     pub chain: u32,
+    pub double_chain: u32,
 }
 
 impl Inode {
@@ -31,6 +32,7 @@ impl Inode {
             size: 0,
             addrs: [0; _],
             chain: 0,
+            double_chain: 0,
         }
     }
 }
@@ -19,16 +19,38 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// Log appends are synchronous, but the blocks of a commit are
+// handed to the disk in batches.
+//
+// The size of the log comes from the superblock, and a commit
+// waits briefly for other system calls so that their updates
+// share it (see linger()).
+//
+// Each device with a file system has its own log. An FS
+// operation is part of the current transaction of every log,
+// so that it can write to whichever device its path leads to.
+
+use arrayvec::ArrayVec;
 
 use crate::filesystem::buffer::{self, Buffer, BSIZE};
 use crate::filesystem::superblock::SuperBlock;
+use crate::virtio::disk::MAX_SEGMENTS;
 use crate::{
-    config::{LOGSIZE, MAXOPBLOCKS, NBUF},
-    process,
+    config::{GROUPCOMMIT, MAXOPBLOCKS, NDISK, ROOTDEV},
+    interrupt, process,
     spinlock::{SpinLock, SpinLockGuard},
 };
 
+// max data blocks the header block can describe.
+// the usable size is the smaller of this and the
+// log size recorded in the superblock.
+pub const CAPACITY: usize = BSIZE / 4 - 1;
+
+// blocks handed to the disk at once while writing
+// or installing a commit. the log blocks of a batch are
+// contiguous, so they move in a single disk request.
+const BATCH: usize = MAX_SEGMENTS;
+
 const _: () = {
     assert!(core::mem::size_of::<LogHeader>() <= BSIZE);
 };
@@ -37,7 +59,7 @@ const _: () = {
 #[derive(Debug, Clone)]
 struct LogHeader {
     n: u32,
-    block: [u32; LOGSIZE],
+    block: [u32; CAPACITY],
 }
 
 impl LogHeader {
@@ -52,9 +74,14 @@ impl LogHeader {
 #[derive(Debug)]
 pub struct Log {
     start: usize,
-    size: usize,
-    outstanding: usize,
-    committing: bool,
+    capacity: usize,    // usable data blocks of the on-disk log
+    outstanding: usize, // how many FS sys calls are executing.
+    reserved: usize,    // blocks reserved by the executing sys calls
+    started: usize,     // transactions started so far, for group commit
+    lingering: bool,    // a commit is waiting for others to join
+    draining: bool,     // no new transactions until the commit
+    paused: bool,       // no new transactions, see between_operations()
+    committing: bool,   // in commit(), please wait.
     device: usize,
     header: LogHeader,
 }
@@ -63,24 +90,38 @@ impl Log {
     const fn new() -> Self {
         Self {
             start: 0,
-            size: 0,
+            capacity: 0,
             outstanding: 0,
+            reserved: 0,
+            started: 0,
+            lingering: false,
+            draining: false,
+            paused: false,
             committing: false,
             device: 0,
             header: LogHeader::empty(),
         }
     }
 
-    const fn is_full(&self) -> bool {
-        self.header.n as usize + (self.outstanding + 1) * MAXOPBLOCKS > LOGSIZE
+    const fn is_full(&self, blocks: usize) -> bool {
+        self.header.n as usize + self.reserved + blocks > self.capacity
+    }
+
+    fn token(&self) -> usize {
+        core::ptr::addr_of!(*self).addr()
     }
 
-    fn start(mut self: SpinLockGuard<'static, Self>) {
-        while self.committing || self.is_full() {
-            process::sleep(core::ptr::addr_of!(*self).addr(), &mut self);
+    fn start(mut self: SpinLockGuard<'static, Self>, blocks: usize) {
+        assert!(blocks <= self.capacity);
+
+        while self.committing || self.draining || self.paused || self.is_full(blocks) {
+            let token = self.token();
+            process::sleep(token, &mut self);
         }
 
         self.outstanding += 1;
+        self.reserved += blocks;
+        self.started = self.started.wrapping_add(1);
     }
 
     fn commit(self: &mut SpinLockGuard<Self>) {
@@ -94,21 +135,73 @@ impl Log {
         self.committing = false;
     }
 
-    fn end(self: &mut SpinLockGuard<Self>) {
+    // Group commit: rather than committing as soon as the last
+    // outstanding operation ends, give up the CPU a few times so
+    // that other processes can add their operations to the same
+    // transaction. Stop waiting once nobody joins or the log is
+    // nearly full, then let the operations that joined finish.
+    fn linger(self: &mut SpinLockGuard<'static, Self>) {
+        self.lingering = true;
+
+        for _ in 0..GROUPCOMMIT {
+            let started = self.started;
+            SpinLock::unlock_temporarily(self, process::pause);
+            if self.started == started || self.is_full(MAXOPBLOCKS) {
+                break;
+            }
+        }
+
+        self.draining = true;
+        while self.outstanding > 0 {
+            let token = self.token();
+            process::sleep(token, self);
+        }
+        self.draining = false;
+
+        self.lingering = false;
+    }
+
+    // Returns whether the caller must still linger and commit,
+    // with linger_and_commit(), once it has left every log:
+    // an operation lingering while it holds a reservation in
+    // another log could wait for one asleep on that log.
+    fn end(self: &mut SpinLockGuard<'static, Self>, blocks: usize) -> bool {
         assert!(!self.committing);
 
         self.outstanding -= 1;
-
-        if self.outstanding == 0 {
-            self.commit();
+        self.reserved -= blocks;
+
+        // while a commit is lingering, it commits
+        // the operations that joined it.
+        let mut linger = false;
+        if self.outstanding == 0 && !self.lingering {
+            // pausing is only possible when the log lock is
+            // the only spinlock held by a running process.
+            if self.header.n > 0 && interrupt::get_depth() == 1 && process::is_running() {
+                // claim the commit, so that operations
+                // joining meanwhile leave it to us.
+                self.lingering = true;
+                linger = true;
+            } else {
+                self.commit();
+            }
         }
 
-        process::wakeup(core::ptr::addr_of!(**self).addr());
+        let token = self.token();
+        process::wakeup(token);
+        linger
+    }
+
+    fn linger_and_commit(self: &mut SpinLockGuard<'static, Self>) {
+        self.linger();
+        self.commit();
+
+        let token = self.token();
+        process::wakeup(token);
     }
 
-    fn write<T>(&mut self, buf: &Buffer<T, BSIZE, NBUF>) {
-        assert!((self.header.n as usize) < LOGSIZE);
-        assert!((self.header.n as usize) < self.size - 1);
+    fn write<T>(&mut self, buf: &Buffer<T>) {
+        assert!((self.header.n as usize) < self.capacity);
         assert!(self.outstanding > 0);
 
         let len = self.header.n as usize;
@@ -121,86 +214,212 @@ impl Log {
     }
 }
 
-static LOG: SpinLock<Log> = SpinLock::new(Log::new());
+// the log of device ROOTDEV + i, with no capacity
+// until its file system is initialized.
+static LOGS: [SpinLock<Log>; NDISK] = [const { SpinLock::named("log", Log::new()) }; _];
 
+fn log(device: usize) -> &'static SpinLock<Log> {
+    &LOGS[device - ROOTDEV]
+}
+
+// Run f as one FS operation, which writes at most
+// MAXOPBLOCKS distinct blocks.
 pub fn with<R, F: FnOnce() -> R>(f: F) -> R {
-    LOG.lock().start();
+    with_reserved(MAXOPBLOCKS, f)
+}
+
+// Run f as one FS operation that writes at most `blocks`
+// distinct blocks to each device, which must not exceed
+// capacity(). The logs are always entered in the same order.
+pub fn with_reserved<R, F: FnOnce() -> R>(blocks: usize, f: F) -> R {
+    // remember which logs the operation started in, in case
+    // a file system is initialized meanwhile.
+    let mut started = [false; NDISK];
+    for (log, started) in LOGS.iter().zip(started.iter_mut()) {
+        let log = log.lock();
+        if log.capacity > 0 {
+            log.start(blocks);
+            *started = true;
+        }
+    }
+
+    let ret = f();
+
+    // leave every log before waiting for others to join a commit.
+    let mut linger = [false; NDISK];
+    for ((log, started), linger) in LOGS.iter().zip(started).zip(linger.iter_mut()) {
+        if started {
+            *linger = log.lock().end(blocks);
+        }
+    }
+    for (log, linger) in LOGS.iter().zip(linger) {
+        if linger {
+            log.lock().linger_and_commit();
+        }
+    }
+    ret
+}
+
+// Run f, which must not sleep, while no FS operation is in
+// progress, and keep new ones from starting until it returns.
+// Every operation joins the root log, so waiting for it to
+// be idle waits for all of them. mount() uses this so that
+// no operation sees a new mount without having joined its log.
+pub fn between_operations<R, F: FnOnce() -> R>(f: F) -> R {
+    let mut log = log(ROOTDEV).lock();
+    let token = log.token();
+    while log.paused {
+        process::sleep(token, &mut log);
+    }
+
+    log.paused = true;
+    while log.outstanding > 0 || log.lingering || log.committing {
+        process::sleep(token, &mut log);
+    }
+
     let ret = f();
-    LOG.lock().end();
+
+    log.paused = false;
+    process::wakeup(token);
     ret
 }
 
+// Usable data blocks of the smallest log.
+pub fn capacity() -> usize {
+    LOGS.iter()
+        .map(|log| log.lock().capacity)
+        .filter(|&capacity| capacity > 0)
+        .min()
+        .unwrap_or(0)
+}
+
 fn read_header(log: &mut SpinLockGuard<Log>) -> Option<()> {
     let device = log.device;
     let inode = log.start;
 
-    log.header = SpinLock::unlock_temporarily(log, move || unsafe {
-        let header = buffer::with_read::<LogHeader>(device, inode).unwrap();
-        (*header).clone()
+    let header = SpinLock::unlock_temporarily(log, move || unsafe {
+        buffer::with_read::<LogHeader>(device, inode).unwrap()
     });
+    log.header = (*header).clone();
 
     Some(())
 }
 
+// The header is not modified while committing or recovering,
+// so the log lock can be released while it is read from
+// in place instead of copying it to the kernel stack.
+fn header(log: &SpinLockGuard<Log>) -> &'static LogHeader {
+    assert!(log.committing || log.outstanding == 0);
+    unsafe { &*core::ptr::addr_of!(log.header) }
+}
+
 fn write_header(log: &mut SpinLockGuard<Log>) -> Option<()> {
-    let header = log.header.clone();
+    let header = header(log);
     let device = log.device;
     let inode = log.start;
 
     SpinLock::unlock_temporarily(log, move || unsafe {
-        let buf = buffer::with_write(device, inode, &header).unwrap();
+        let buf = buffer::with_write(device, inode, header).unwrap();
         buffer::flush(buf);
     });
 
     Some(())
 }
 
+// Copy committed blocks from log to their home location.
+// The writes are queued a batch at a time and waited for together.
 fn install_blocks(log: &mut SpinLockGuard<Log>, recovering: bool) {
-    for tail in 0..(log.header.n as usize) {
-        let device = log.device;
-        let inode_in = log.start + tail + 1;
-        let inode_out = log.header.block[tail] as usize;
+    let device = log.device;
+    let start = log.start;
+    let header = header(log);
 
-        SpinLock::unlock_temporarily(log, move || unsafe {
-            let from = buffer::with_read::<[u8; BSIZE]>(device, inode_in).unwrap();
-            let to = buffer::with_write(device, inode_out, &*from).unwrap();
+    SpinLock::unlock_temporarily(log, move || unsafe {
+        let blocks = &header.block[..(header.n as usize)];
+
+        // read the log a batch ahead of the one being installed,
+        // each batch in one request.
+        let prefetch = |batch: usize| {
+            let first = batch * BATCH;
+            let last = blocks.len().min(first + BATCH);
+            let tails = (first..last)
+                .map(|tail| start + tail + 1)
+                .collect::<ArrayVec<_, BATCH>>();
+            buffer::prefetch(device, &tails);
+        };
+        if recovering {
+            prefetch(0);
+        }
 
-            if !recovering {
-                buffer::unpin(&to);
+        for (batch, blocks) in blocks.chunks(BATCH).enumerate() {
+            if recovering {
+                prefetch(batch + 1);
             }
 
-            buffer::flush(to);
-        });
-    }
+            let mut buffers = ArrayVec::<_, BATCH>::new();
+            for (i, &block) in blocks.iter().enumerate() {
+                let tail = batch * BATCH + i;
+                let to = if recovering {
+                    let from = buffer::with_read::<[u8; BSIZE]>(device, start + tail + 1).unwrap();
+                    buffer::with_write(device, block as usize, &*from).unwrap()
+                } else {
+                    // the cached copy is still pinned, and holds
+                    // the same contents as the log.
+                    let to = buffer::with_read::<[u8; BSIZE]>(device, block as usize).unwrap();
+                    buffer::unpin(&to);
+                    to
+                };
+                buffers.push(to);
+            }
+
+            buffer::flush_all(buffers);
+        }
+    });
 
     log.header.n = 0;
 }
 
+// Copy modified blocks from cache to log.
 fn write_log(log: &mut SpinLockGuard<Log>) {
-    for tail in 0..(log.header.n as usize) {
-        let device = log.device;
-        let inode_in = log.header.block[tail] as usize;
-        let inode_out = log.start + tail + 1;
+    let device = log.device;
+    let start = log.start;
+    let header = header(log);
 
-        SpinLock::unlock_temporarily(log, move || unsafe {
-            let from = buffer::with_read::<[u8; BSIZE]>(device, inode_in).unwrap();
-            let to = buffer::with_write(device, inode_out, &*from).unwrap();
-            buffer::flush(to);
-        });
-    }
+    SpinLock::unlock_temporarily(log, move || unsafe {
+        let blocks = &header.block[..(header.n as usize)];
+        for (batch, blocks) in blocks.chunks(BATCH).enumerate() {
+            let mut buffers = ArrayVec::<_, BATCH>::new();
+            for (i, &block) in blocks.iter().enumerate() {
+                let tail = batch * BATCH + i;
+                let from = buffer::with_read::<[u8; BSIZE]>(device, block as usize).unwrap();
+                let to = buffer::with_write(device, start + tail + 1, &*from).unwrap();
+                buffers.push(to);
+            }
+
+            buffer::flush_all(buffers);
+        }
+    });
 }
 
+// Recover the log of device's file system and start using it.
 pub fn initialize(device: usize, sb: &SuperBlock) {
-    let mut log = LOG.lock();
+    let mut log = log(device).lock();
+    assert!(log.capacity == 0);
     log.start = sb.logstart as usize;
-    log.size = sb.nlog as usize;
     log.device = device;
 
+    // a clean log needs no writes.
     read_header(&mut log).unwrap();
-    install_blocks(&mut log, true);
-    write_header(&mut log).unwrap();
+    if log.header.n > 0 {
+        install_blocks(&mut log, true);
+        write_header(&mut log).unwrap();
+    }
+
+    // FS operations start joining this log from now on.
+    // the first block of the log holds the header.
+    log.capacity = (sb.nlog as usize).saturating_sub(1).min(CAPACITY);
+    assert!(log.capacity >= MAXOPBLOCKS);
 }
 
-pub fn write<T>(buf: &Buffer<T, BSIZE, NBUF>) {
-    LOG.lock().write(buf);
+pub fn write<T>(buf: &Buffer<T>) {
+    log(Buffer::device(buf)).lock().write(buf);
 }
@@ -1,34 +1,65 @@
 use core::mem::{ManuallyDrop, MaybeUninit};
-use core::ops::{Deref, DerefMut};
+use core::ops::{Deref, DerefMut, Range};
+use core::sync::atomic::{AtomicUsize, Ordering::Relaxed};
+
+use alloc::{boxed::Box, vec::Vec};
+use arrayvec::ArrayVec;
 
 use crate::bitmap::Bitmap;
-use crate::cache::RcCache;
-use crate::config::{NINODE, ROOTDEV};
+use crate::cache::HashCache;
+use crate::config::{NDISK, NPREALLOC, NREADAHEAD, ROOTDEV};
 use crate::filesystem::buffer::{self, BSIZE};
+use crate::filesystem::directory_cache;
 use crate::filesystem::directory_entry::DirectoryEntry;
 use crate::filesystem::inode::{Inode, InodeKind};
 use crate::filesystem::log::{self};
 use crate::filesystem::stat::Stat;
 use crate::filesystem::superblock::SuperBlock;
 use crate::filesystem::{
-    BITMAP_BITS, FSMAGIC, INODES_PER_BLOCK, MAXFILE, NDIRECT, NINDIRECT, ROOTINO,
+    BITMAP_BITS, FSMAGIC, INODES_PER_BLOCK, MAXFILE, NDINDIRECT, NDIRECT, NINDIRECT, ROOTINO,
 };
 use crate::process::{self, copyin_either, copyout_either};
 use crate::sleeplock::{SleepLock, SleepLockGuard};
 use crate::spinlock::SpinLock;
+use crate::virtio;
 
-#[derive(Debug, PartialEq, Eq)]
+#[derive(Debug, PartialEq, Eq, Hash)]
 pub struct InodeKey {
     device: usize,
     index: usize,
 }
 
+// A run of file blocks that are contiguous on disk,
+// remembered from the last walk of the block map.
+#[derive(Debug, Clone)]
+struct Extent {
+    blocks: Range<usize>, // file block numbers
+    start: usize,         // disk block of blocks.start
+}
+
+impl Extent {
+    const fn empty() -> Self {
+        Self {
+            blocks: 0..0,
+            start: 0,
+        }
+    }
+
+    fn get(&self, index: usize) -> Option<usize> {
+        self.blocks
+            .contains(&index)
+            .then(|| self.start + (index - self.blocks.start))
+    }
+}
+
 #[derive(Debug)]
 pub struct CachedInode {
     inode: Inode,
     device: usize,
     inode_number: usize,
     is_initialized: bool,
+    reservation: Range<usize>, // free blocks set aside for appending
+    extent: Extent,            // cached part of the block map
 }
 
 impl CachedInode {
@@ -38,6 +69,8 @@ impl CachedInode {
             device: 0,
             inode_number: 0,
             is_initialized: false,
+            reservation: 0..0,
+            extent: Extent::empty(),
         }
     }
 
@@ -96,7 +129,7 @@ impl CachedInode {
     }
 
     fn initialize(&mut self) {
-        let inode_start = unsafe { SUPERBLOCK.inodestart as usize };
+        let inode_start = superblock(self.device).inodestart as usize;
 
         let block_index = inode_start + self.inode_number / INODES_PER_BLOCK;
         let in_block_index = self.inode_number % INODES_PER_BLOCK;
@@ -110,39 +143,130 @@ impl CachedInode {
         assert!(!matches!(self.inode.kind, InodeKind::Unused));
     }
 
-    fn offset_to_block(&mut self, offset: usize) -> Option<usize> {
-        let index = offset / BSIZE;
-
-        if let Some(addr) = self.inode.addrs.get_mut(index) {
-            if *addr == 0 {
-                *addr = unsafe { allocate_block(&SUPERBLOCK, self.device)? as u32 };
+    // Allocate a zeroed disk block for the inode.
+    // A file being appended to takes blocks from a run reserved
+    // right after its last allocation, so that it is laid out
+    // contiguously even while other files grow. The run is only
+    // remembered in memory; a block in it is claimed in the bitmap
+    // when it is used, unless another inode took it first.
+    fn allocate_block(&mut self, append: bool) -> Option<usize> {
+        while let Some(block) = self.reservation.next() {
+            if unsafe { claim_block(superblock(self.device), self.device, block) } {
+                return Some(block);
             }
-            return Some(*addr as usize);
         }
 
-        if (NDIRECT..NDIRECT + NINDIRECT).contains(&index) {
-            let index = index - NDIRECT;
+        let run = if append { NPREALLOC } else { 1 };
+        let (block, run) = unsafe { allocate_run(superblock(self.device), self.device, run)? };
+        self.reservation = (block + 1)..(block + run);
+        Some(block)
+    }
+
+    // Remember the run of contiguous disk blocks that starts
+    // at addrs[0], which holds file block first.
+    fn remember(&mut self, first: usize, addrs: &[u32]) {
+        let start = addrs[0] as usize;
+        let run = addrs
+            .iter()
+            .enumerate()
+            .take_while(|(i, addr)| **addr as usize == start + i)
+            .count();
+
+        self.extent = Extent {
+            blocks: first..(first + run),
+            start,
+        };
+    }
+
+    // Return entry index of the indirect block table, allocating
+    // a block for it if it is missing and alloc is Some(append).
+    // If the table holds data blocks, first is the file block
+    // of the entry, and the run of blocks from it is remembered.
+    fn entry(
+        &mut self,
+        table: usize,
+        index: usize,
+        first: Option<usize>,
+        alloc: Option<bool>,
+    ) -> Option<usize> {
+        let mut addrs = unsafe { buffer::with_read::<[u32; NINDIRECT]>(self.device, table)? };
+        if addrs[index] == 0 {
+            addrs[index] = self.allocate_block(alloc?)? as u32;
+            log::write(&addrs);
+        }
+
+        if let Some(first) = first {
+            self.remember(first, &addrs[index..]);
+        }
+        Some(addrs[index] as usize)
+    }
+
+    // Find the disk block holding file block index.
+    // Missing blocks are allocated if alloc is Some(append),
+    // and make the lookup fail if it is None.
+    fn map(&mut self, index: usize, alloc: Option<bool>) -> Option<usize> {
+        if let Some(block) = self.extent.get(index) {
+            return Some(block);
+        }
+
+        if index < NDIRECT {
+            if self.inode.addrs[index] == 0 {
+                self.inode.addrs[index] = self.allocate_block(alloc?)? as u32;
+            }
+            let addrs = self.inode.addrs;
+            self.remember(index, &addrs[index..]);
+            return Some(addrs[index] as usize);
+        }
 
+        let i = index - NDIRECT;
+        if i < NINDIRECT {
             if self.inode.chain == 0 {
-                self.inode.chain = unsafe { allocate_block(&SUPERBLOCK, self.device)? as u32 };
+                self.inode.chain = self.allocate_block(alloc?)? as u32;
             }
+            return self.entry(self.inode.chain as usize, i, Some(index), alloc);
+        }
 
-            let mut addrs = unsafe {
-                buffer::with_read::<[u32; NINDIRECT]>(self.device, self.inode.chain as usize)?
-            };
-            let addr = if addrs[index] == 0 {
-                let allocated = unsafe { allocate_block(&SUPERBLOCK, self.device)? };
-                addrs[index] = allocated as u32;
-                log::write(&addrs);
-                allocated
-            } else {
-                addrs[index] as usize
-            };
-            return Some(addr);
+        let i = i - NINDIRECT;
+        if i < NDINDIRECT {
+            if self.inode.double_chain == 0 {
+                self.inode.double_chain = self.allocate_block(alloc?)? as u32;
+            }
+            let table = self.entry(self.inode.double_chain as usize, i / NINDIRECT, None, alloc)?;
+            return self.entry(table, i % NINDIRECT, Some(index), alloc);
         }
+
         None
     }
 
+    fn offset_to_block(&mut self, offset: usize) -> Option<usize> {
+        let append = offset >= self.size();
+        self.map(offset / BSIZE, Some(append))
+    }
+
+    // Like offset_to_block, but never allocates:
+    // returns None for holes and offsets beyond the block map.
+    fn lookup_block(&mut self, offset: usize) -> Option<usize> {
+        self.map(offset / BSIZE, None)
+    }
+
+    // Start reading up to count blocks from offset into the
+    // buffer cache without waiting, for a sequential reader.
+    pub fn readahead(&mut self, offset: usize, count: usize) {
+        let mut blocks = ArrayVec::<usize, NREADAHEAD>::new();
+
+        let end = self.size().min(offset.saturating_add(count * BSIZE));
+        for offset in (offset - offset % BSIZE..end).step_by(BSIZE) {
+            let Some(block) = self.lookup_block(offset) else {
+                continue;
+            };
+            if blocks.try_push(block).is_err() {
+                break;
+            }
+        }
+
+        buffer::prefetch(self.device, &blocks);
+    }
+
     pub fn copy_to<T>(
         &mut self,
         is_dst_user: bool,
@@ -201,6 +325,26 @@ impl CachedInode {
             return None;
         }
 
+        // the caller holds the directory's lock, so the name
+        // cache cannot change underneath us.
+        let target = match directory_cache::get(self.device, self.inode_number, name) {
+            Some(target) => target,
+            None => {
+                let target = self.scan(name);
+                directory_cache::insert(self.device, self.inode_number, name, target);
+                target
+            }
+        };
+
+        let (inode_number, offset) = target?;
+        inodes()
+            .get(self.device, inode_number)
+            .map(|inode| (inode, offset))
+    }
+
+    // Search the directory's entries for name and
+    // return its inode number and offset.
+    fn scan(&mut self, name: &str) -> Option<(usize, usize)> {
         for offset in (0..self.size()).step_by(core::mem::size_of::<DirectoryEntry>()) {
             let entry = self.read::<DirectoryEntry>(offset).unwrap();
             if entry.inode_number() == 0 {
@@ -208,9 +352,7 @@ impl CachedInode {
             }
 
             if entry.is(name) {
-                return INODE_ALLOC
-                    .get(self.device, entry.inode_number())
-                    .map(|inode| (inode, offset));
+                return Some((entry.inode_number(), offset));
             }
         }
 
@@ -299,20 +441,20 @@ impl CachedInode {
         let new_entry = DirectoryEntry::new(inode_number, name);
 
         let entry_size = core::mem::size_of::<DirectoryEntry>();
-        for offset in (0..self.size()).step_by(entry_size) {
-            let entry = self.read::<DirectoryEntry>(offset).unwrap();
-            if entry.inode_number() == 0 {
-                self.write(new_entry, offset).unwrap();
-                return Ok(());
-            }
-        }
+        let free = (0..self.size())
+            .step_by(entry_size)
+            .find(|&offset| self.read::<DirectoryEntry>(offset).unwrap().inode_number() == 0);
+
+        let offset = free.unwrap_or(self.size() - self.size() % entry_size);
+        self.write(new_entry, offset)?;
 
-        let insert_offset = self.size() - self.size() % entry_size;
-        self.write(new_entry, insert_offset).or(Err(()))
+        let target = Some((inode_number, offset));
+        directory_cache::insert(self.device, self.inode_number, name, target);
+        Ok(())
     }
 
     pub fn update(&mut self) {
-        let inode_start = unsafe { SUPERBLOCK.inodestart as usize };
+        let inode_start = superblock(self.device).inodestart as usize;
 
         let block_index = inode_start + self.inode_number / INODES_PER_BLOCK;
         let in_block_index = self.inode_number % INODES_PER_BLOCK;
@@ -324,28 +466,47 @@ impl CachedInode {
         log::write(&inodes);
     }
 
+    // Free an indirect block table and the blocks it refers to,
+    // which are tables themselves down to the given depth.
+    fn free_table(&self, table: usize, depth: usize) {
+        let addrs = unsafe { buffer::with_read::<[u32; NINDIRECT]>(self.device, table).unwrap() };
+        for addr in addrs.iter().filter(|addr| **addr != 0) {
+            if depth > 1 {
+                self.free_table(*addr as usize, depth - 1);
+            } else {
+                unsafe { deallocate_block(superblock(self.device), self.device, *addr as usize) };
+            }
+        }
+        drop(addrs);
+
+        unsafe { deallocate_block(superblock(self.device), self.device, table) };
+    }
+
     pub fn truncate(&mut self) {
         for addr in self.inode.addrs {
             if addr != 0 {
-                unsafe { deallocate_block(&SUPERBLOCK, self.device, addr as usize) };
+                unsafe { deallocate_block(superblock(self.device), self.device, addr as usize) };
             }
         }
         self.inode.addrs.fill(0);
 
         if self.inode.chain != 0 {
-            let addrs = unsafe {
-                buffer::with_read::<[u32; NINDIRECT]>(self.device, self.inode.chain as usize)
-                    .unwrap()
-            };
-            for addr in addrs.iter() {
-                if *addr != 0 {
-                    unsafe { deallocate_block(&SUPERBLOCK, self.device, *addr as usize) };
-                }
-            }
-            unsafe { deallocate_block(&SUPERBLOCK, self.device, self.inode.chain as usize) };
+            self.free_table(self.inode.chain as usize, 1);
             self.inode.chain = 0;
         }
 
+        if self.inode.double_chain != 0 {
+            self.free_table(self.inode.double_chain as usize, 2);
+            self.inode.double_chain = 0;
+        }
+        self.extent = Extent::empty();
+
+        // the inode number may be reused for another directory.
+        if self.is_directory() {
+            directory_cache::forget(self.device, self.inode_number);
+        }
+
+        self.reservation = 0..0;
         self.inode.size = 0;
         self.update();
     }
@@ -364,7 +525,7 @@ impl InodeReference {
             entry: ManuallyDrop::new(self.entry.lock()),
         };
 
-        INODE_ALLOC.duplicate(self.cache_index);
+        inodes().duplicate(self.cache_index);
 
         if !guard.is_initialized {
             guard.initialize();
@@ -377,14 +538,14 @@ impl InodeReference {
 
 impl Clone for InodeReference {
     fn clone(&self) -> Self {
-        INODE_ALLOC.duplicate(self.cache_index);
+        inodes().duplicate(self.cache_index);
         Self { ..*self }
     }
 }
 
 impl Drop for InodeReference {
     fn drop(&mut self) {
-        INODE_ALLOC.release(self.cache_index);
+        inodes().release(self.cache_index);
     }
 }
 
@@ -396,7 +557,7 @@ pub struct InodeGuard {
 
 impl InodeGuard {
     pub fn as_ref(this: &Self) -> InodeReference {
-        INODE_ALLOC
+        inodes()
             .get(this.entry.device, this.entry.inode_number)
             .unwrap()
     }
@@ -419,35 +580,72 @@ impl DerefMut for InodeGuard {
 impl Drop for InodeGuard {
     fn drop(&mut self) {
         unsafe { ManuallyDrop::drop(&mut self.entry) };
-        INODE_ALLOC.release(self.cache_index);
+        inodes().release(self.cache_index);
     }
 }
 
-unsafe fn allocate_block(superblock: &SuperBlock, device: usize) -> Option<usize> {
-    for bi in (0..(superblock.size as usize)).step_by(BITMAP_BITS) {
+// Where the last search for a free block of each device stopped.
+// Searches start here rather than at block 0, so that
+// allocation does not rescan the full part of the disk.
+static NEXT_BLOCK: [AtomicUsize; NDISK] = [const { AtomicUsize::new(0) }; _];
+
+// Allocate a zeroed disk block, and find how many free
+// blocks follow it, up to max.
+// Returns the block and the length of the free run.
+unsafe fn allocate_run(
+    superblock: &SuperBlock,
+    device: usize,
+    max: usize,
+) -> Option<(usize, usize)> {
+    let size = superblock.size as usize;
+    let end = size.next_multiple_of(BITMAP_BITS);
+    let next = &NEXT_BLOCK[device - ROOTDEV];
+    let hint = next.load(Relaxed) % size;
+
+    // visit every bitmap block once, starting at the hint,
+    // and the first one again from its beginning.
+    let first = hint - hint % BITMAP_BITS;
+    for i in 0..=(end / BITMAP_BITS) {
+        let bi = (first + i * BITMAP_BITS) % end;
+        let from = if i == 0 { hint % BITMAP_BITS } else { 0 };
+
         let mut bitmap =
             buffer::with_read::<Bitmap<{ BITMAP_BITS }>>(device, superblock.bitmap_at(bi)).unwrap();
 
-        match bitmap.allocate() {
-            Some(index) if (bi + index) < superblock.size as usize => {
-                log::write(&bitmap);
-
-                let block = bi + index;
-                write_zeros_to_block(device, block);
-                return Some(block);
-            }
-            Some(index) => {
-                bitmap.deallocate(index).unwrap();
-                return None;
-            }
-            None => {
-                continue;
-            }
+        let Some(index) = bitmap.find_free(from) else {
+            continue;
+        };
+        let block = bi + index;
+        if block >= size {
+            continue;
         }
+
+        let run = bitmap.count_free(index, max.min(size - block));
+        bitmap.set(index, true).unwrap();
+        log::write(&bitmap);
+        next.store(block + run, Relaxed);
+
+        write_zeros_to_block(device, block);
+        return Some((block, run));
     }
     None
 }
 
+// Allocate the given block if it is still free.
+unsafe fn claim_block(superblock: &SuperBlock, device: usize, block: usize) -> bool {
+    let mut bitmap =
+        buffer::with_read::<Bitmap<{ BITMAP_BITS }>>(device, superblock.bitmap_at(block)).unwrap();
+
+    if bitmap.get(block % BITMAP_BITS) != Some(false) {
+        return false;
+    }
+    bitmap.set(block % BITMAP_BITS, true).unwrap();
+    log::write(&bitmap);
+
+    write_zeros_to_block(device, block);
+    true
+}
+
 unsafe fn deallocate_block(superblock: &SuperBlock, device: usize, block: usize) {
     let mut bitmap =
         buffer::with_read::<Bitmap<{ BITMAP_BITS }>>(device, superblock.bitmap_at(block)).unwrap();
@@ -478,35 +676,40 @@ fn allocate_inode(superblock: &SuperBlock, device: usize, kind: InodeKind) -> Re
     Err(())
 }
 
-pub struct InodeCache<const N: usize> {
-    cache: SpinLock<RcCache<InodeKey, N>>,
-    inodes: [SleepLock<CachedInode>; N],
+pub struct InodeCache {
+    cache: HashCache<InodeKey>,
+    inodes: Box<[SleepLock<CachedInode>]>,
 }
 
-impl<const N: usize> InodeCache<N> {
-    pub const fn new() -> Self {
-        Self {
-            cache: SpinLock::new(RcCache::new()),
-            inodes: [const { SleepLock::new(CachedInode::zeroed()) }; _],
-        }
+impl InodeCache {
+    fn new(capacity: usize) -> Result<Self, ()> {
+        let mut inodes = Vec::new();
+        inodes.try_reserve_exact(capacity).map_err(|_| ())?;
+        inodes.resize_with(capacity, || SleepLock::new(CachedInode::zeroed()));
+
+        Ok(Self {
+            cache: HashCache::new(capacity)?,
+            inodes: inodes.into_boxed_slice(),
+        })
     }
 
     pub fn get(&'static self, device: usize, inode_number: usize) -> Option<InodeReference> {
-        let mut cache = self.cache.lock();
-
-        let (cache_index, is_new) = cache.get(InodeKey {
+        let key = InodeKey {
             device,
             index: inode_number,
-        })?;
+        };
 
-        if is_new {
-            let mut entry = self.inodes[cache_index].lock();
+        let cache_index = self.cache.get(key, |index| {
+            // a recycled slot has no references, so nobody
+            // holds its lock, and nobody can find it until
+            // its bucket is unlocked.
+            let mut entry = self.inodes[index].try_lock().unwrap();
             entry.device = device;
             entry.inode_number = inode_number;
             entry.is_initialized = false;
-        }
-
-        SpinLock::unlock(cache);
+            entry.reservation = 0..0;
+            entry.extent = Extent::empty();
+        })?;
 
         Some(InodeReference {
             cache_index,
@@ -515,33 +718,51 @@ impl<const N: usize> InodeCache<N> {
     }
 
     pub fn duplicate(&self, index: usize) {
-        self.cache.lock().duplicate(index);
+        self.cache.duplicate(index);
     }
 
     pub fn release(&'static self, index: usize) {
-        let mut cache = self.cache.lock();
-
-        let reference = cache.reference_count(index).unwrap();
-        if reference == 1 {
-            let mut entry = self.inodes[index].lock();
-            if entry.inode.nlink == 0 && entry.is_initialized {
-                SpinLock::unlock_temporarily(&mut cache, move || {
-                    assert!(entry.inode.nlink == 0);
-                    entry.truncate();
-                    entry.inode.kind = InodeKind::Unused;
-                    entry.update();
-                    entry.is_initialized = false;
-                });
-            }
+        // drop the reference unless it is the last one.
+        if self.cache.release_shared(index) {
+            return;
+        }
+
+        // this is the last reference. if the inode has no links,
+        // nobody else can find it, so it is safe to sleep here
+        // while freeing its blocks.
+        let mut entry = self.inodes[index].lock();
+        if entry.inode.nlink == 0 && entry.is_initialized {
+            entry.truncate();
+            entry.inode.kind = InodeKind::Unused;
+            entry.update();
+            entry.is_initialized = false;
         }
+        drop(entry);
 
-        cache.release(index).unwrap();
+        // the inode stays cached until its slot is reclaimed.
+        self.cache.release(index);
     }
 }
 
-static mut SUPERBLOCK: SuperBlock = SuperBlock::zeroed();
+// the superblock of device ROOTDEV + i.
+static mut SUPERBLOCKS: [SuperBlock; NDISK] = [const { SuperBlock::zeroed() }; _];
+
+fn superblock(device: usize) -> &'static SuperBlock {
+    unsafe { &SUPERBLOCKS[device - ROOTDEV] }
+}
+
+static mut INODE_ALLOC: MaybeUninit<InodeCache> = MaybeUninit::uninit();
+
+fn inodes() -> &'static InodeCache {
+    unsafe { INODE_ALLOC.assume_init_ref() }
+}
 
-static INODE_ALLOC: InodeCache<NINODE> = InodeCache::new();
+// Create the inode cache with room for capacity inodes.
+// Call once before the file system is first used.
+pub fn initialize_cache(capacity: usize) {
+    let cache = InodeCache::new(capacity).unwrap();
+    unsafe { INODE_ALLOC.write(cache) };
+}
 
 fn write_zeros_to_block(device: usize, block: usize) {
     let buf = buffer::with_write::<[u8; BSIZE]>(device, block, &[0; _]).unwrap();
@@ -551,8 +772,8 @@ fn write_zeros_to_block(device: usize, block: usize) {
 pub fn initialize(device: usize) {
     let superblock = unsafe { buffer::with_read::<SuperBlock>(device, 1).unwrap() };
     assert!(superblock.magic == FSMAGIC);
+    unsafe { SUPERBLOCKS[device - ROOTDEV] = (*superblock).clone() };
     log::initialize(device, &superblock);
-    unsafe { SUPERBLOCK = (*superblock).clone() };
 }
 
 pub fn create(path: &str, kind: InodeKind, major: u16, minor: u16) -> Result<InodeGuard, ()> {
@@ -570,7 +791,7 @@ pub fn create(path: &str, kind: InodeKind, major: u16, minor: u16) -> Result<Ino
             }
         }
         None => {
-            let inode_number = unsafe { allocate_inode(&SUPERBLOCK, dir.device, kind)? };
+            let inode_number = allocate_inode(superblock(dir.device), dir.device, kind)?;
             let inode_ref = get(dir.device, inode_number).ok_or(())?;
             let mut inode = inode_ref.lock();
             inode.inode.major = major;
@@ -655,6 +876,9 @@ pub fn unlink(path: &str) -> Result<(), ()> {
         }
 
         let (ip_ref, offset) = dir.lookup(name).ok_or(())?;
+        if is_mount_point(&ip_ref) {
+            return Err(());
+        }
         let mut ip = ip_ref.lock();
         assert!(ip.counf_of_link() > 0);
 
@@ -664,6 +888,7 @@ pub fn unlink(path: &str) -> Result<(), ()> {
 
         let entry = DirectoryEntry::unused();
         dir.write(entry, offset).unwrap();
+        directory_cache::insert(dir.device, dir.inode_number, name, None);
 
         if ip.is_directory() {
             dir.decrement_link();
@@ -692,7 +917,99 @@ pub fn make_special_file(path: &str, major: u16, minor: u16) -> Result<(), ()> {
 }
 
 pub fn get(device: usize, inode: usize) -> Option<InodeReference> {
-    INODE_ALLOC.get(device, inode)
+    inodes().get(device, inode)
+}
+
+// A file system mounted on a directory of another.
+struct Mount {
+    device: usize,
+    point: InodeReference, // keeps the directory in the cache
+}
+
+static MOUNTS: SpinLock<ArrayVec<Mount, NDISK>> = SpinLock::new(ArrayVec::new_const());
+
+// The root of the file system mounted on inode, if any.
+fn enter(inode: InodeReference) -> InodeReference {
+    let mounts = MOUNTS.lock();
+    match mounts
+        .iter()
+        .find(|m| m.point.cache_index == inode.cache_index)
+    {
+        Some(m) => get(m.device, ROOTINO).unwrap(),
+        None => inode,
+    }
+}
+
+fn is_mount_point(inode: &InodeReference) -> bool {
+    let mounts = MOUNTS.lock();
+    mounts
+        .iter()
+        .any(|m| m.point.cache_index == inode.cache_index)
+}
+
+// The directory that the root of device is mounted on.
+fn mounted_on(device: usize, inode_number: usize) -> Option<InodeReference> {
+    if inode_number != ROOTINO {
+        return None;
+    }
+    let mounts = MOUNTS.lock();
+    let m = mounts.iter().find(|m| m.device == device)?;
+    Some(m.point.clone())
+}
+
+// Mount the file system of device on the directory at path.
+// There is no unmount.
+pub fn mount(device: usize, path: &str) -> Result<(), ()> {
+    if device == ROOTDEV || !virtio::disk::exists(device) {
+        return Err(());
+    }
+
+    // the last reference to an inode may free it,
+    // which has to happen inside an FS operation.
+    let point = log::with(|| {
+        let point = search_inode(path).ok_or(())?;
+        let inode = point.lock();
+        if !inode.is_directory() || inode.inode_number == ROOTINO {
+            return Err(());
+        }
+        drop(inode);
+        Ok(point)
+    })?;
+    let fail = |point: InodeReference| {
+        log::with(|| drop(point));
+        Err(())
+    };
+
+    // mounts run one at a time, since the first mount of a
+    // device reads its superblock and recovers its log.
+    static INITIALIZED: SleepLock<[bool; NDISK]> = SleepLock::new([false; NDISK]);
+    let mut initialized = INITIALIZED.lock();
+
+    let is_taken = MOUNTS
+        .lock()
+        .iter()
+        .any(|m| m.device == device || m.point.cache_index == point.cache_index);
+    if is_taken {
+        return fail(point);
+    }
+
+    if !initialized[device - ROOTDEV] {
+        let Some(superblock) = (unsafe { buffer::with_read::<SuperBlock>(device, 1) }) else {
+            return fail(point);
+        };
+        if superblock.magic != FSMAGIC {
+            return fail(point);
+        }
+        drop(superblock);
+        initialize(device);
+        initialized[device - ROOTDEV] = true;
+    }
+
+    // operations that started before the device's log was
+    // initialized haven't joined it, so they must not find
+    // the mount.
+    log::between_operations(|| MOUNTS.lock().push(Mount { device, point }));
+    Ok(())
 }
 
 pub fn search_inode(path: &str) -> Option<InodeReference> {
@@ -714,10 +1031,20 @@ pub fn search_inode(path: &str) -> Option<InodeReference> {
             return None;
         }
 
+        // ".." of a mounted root is looked up in the directory
+        // it is mounted on.
+        if element == ".." {
+            if let Some(point) = mounted_on(inode.device, inode.inode_number) {
+                drop(inode);
+                inode_ref = point;
+                inode = inode_ref.lock();
+            }
+        }
+
         match inode.lookup(element) {
             Some((next, _)) => {
                 drop(inode);
-                inode_ref = next;
+                inode_ref = enter(next);
             }
             _ => return None,
         }
@@ -746,6 +1073,16 @@ fn search_parent_inode(path: &str) -> Option<(InodeReference, &str)> {
             return None;
         }
 
+        // ".." of a mounted root is looked up in the directory
+        // it is mounted on.
+        if element == ".." {
+            if let Some(point) = mounted_on(inode.device, inode.inode_number) {
+                drop(inode);
+                inode_ref = point;
+                inode = inode_ref.lock();
+            }
+        }
+
         if iter.peek().is_none() {
             return Some((inode_ref, element));
         }
@@ -753,7 +1090,7 @@ fn search_parent_inode(path: &str) -> Option<(InodeReference, &str)> {
         match inode.lookup(element) {
             Some((next, _)) => {
                 drop(inode);
-                inode_ref = next;
+                inode_ref = enter(next);
             }
             _ => return None,
         }
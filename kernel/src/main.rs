@@ -28,6 +28,7 @@
 #![feature(inline_const)]
 #![feature(inline_const_pat)]
 #![feature(maybe_uninit_uninit_array)]
+#![feature(new_uninit)]
 #![feature(ptr_metadata)]
 #![feature(slice_ptr_get)]
 #![feature(stdsimd)]
@@ -55,11 +56,13 @@ pub mod memory_layout;
 pub mod pipe;
 pub mod plic;
 pub mod process;
+pub mod profile;
 pub mod riscv;
 pub mod sleeplock;
 pub mod spinlock;
 pub mod start;
 pub mod syscall;
+pub mod trace;
 pub mod trampoline;
 pub mod trap;
 pub mod uart;
@@ -136,11 +139,14 @@ pub unsafe extern "C" fn main() {
         println!("xv6 kernel is booting");
         println!();
         allocator::initialize(); // physical page allocator
+        filesystem::buffer::initialize(config::NBUF); // buffer cache
+        fs::initialize_cache(config::NINODE); // inode cache
         vm::initialize(); // create kernel page table
         vm::initialize_for_core(); // turn on paging
         trap::initialize(); // install kernel trap vector
         plic::initialize(); // set up interrupt controller
         plic::initialize_for_core(); // ask PLIC for device interrupts
+        virtio::disk::initialize(); // emulated hard disks
         process::setup_init_process(); // first user process
         STARTED.store(true, Ordering::SeqCst);
     } else {
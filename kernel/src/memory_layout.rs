@@ -7,7 +7,7 @@
 // 02000000 -- CLINT
 // 0C000000 -- PLIC
 // 10000000 -- uart0
-// 10001000 -- virtio disk
+// 10001000 -- virtio mmio slots, one page each
 // 80000000 -- boot ROM jumps here in machine mode
 //             -kernel loads the kernel here
 // unused RAM after 80000000.
@@ -25,9 +25,14 @@ use crate::riscv::paging::{MAXVA, PGSIZE};
 pub const UART0: NonNull<u8> = NonNull::new(0x10000000 as *mut u8).unwrap();
 pub const UART0_IRQ: usize = 10;
 
-// virtio mmio interface
+// virtio mmio interface. qemu provides NVIRTIO slots,
+// a page apart, with consecutive irqs.
 pub const VIRTIO0: usize = 0x10001000;
 pub const VIRTIO0_IRQ: usize = 1;
+pub const NVIRTIO: usize = 8;
+pub const fn virtio(slot: usize) -> usize {
+    VIRTIO0 + slot * 0x1000
+}
 
 // core local interruptor (CLINT), which contains the timer.
 pub const CLINT: usize = 0x2000000;
@@ -1,4 +1,4 @@
-use alloc::sync::Arc;
+use alloc::{boxed::Box, sync::Arc, vec::Vec};
 
 use crate::{
     process,
@@ -6,35 +6,138 @@ use crate::{
 };
 
 #[derive(Debug)]
-pub enum Pipe<const SIZE: usize> {
-    Read(Arc<SpinLock<PipeInner<SIZE>>>),
-    Write(Arc<SpinLock<PipeInner<SIZE>>>),
+pub enum Pipe {
+    Read(Arc<SpinLock<PipeInner>>),
+    Write(Arc<SpinLock<PipeInner>>),
 }
 
-impl<const SIZE: usize> Pipe<SIZE> {
-    pub fn allocate() -> Option<(Self, Self)> {
-        let inner = Arc::new(SpinLock::new(PipeInner::<SIZE>::new()));
+impl Pipe {
+    pub fn allocate(size: usize) -> Option<(Self, Self)> {
+        let inner = Arc::new(SpinLock::new(PipeInner::new(size).ok()?));
         let read = Self::Read(inner.clone());
         let write = Self::Write(inner);
         Some((read, write))
     }
 
-    pub fn write(&'static self, addr: usize, n: usize) -> Result<usize, ()> {
+    pub fn write(&'static self, user_src: bool, addr: usize, n: usize) -> Result<usize, ()> {
         match self {
             Self::Read(_) => Err(()),
-            Self::Write(inner) => inner.lock().write(addr, n),
+            Self::Write(inner) => inner.lock().write(user_src, addr, n),
         }
     }
 
-    pub fn read(&'static self, addr: usize, n: usize) -> Result<usize, ()> {
+    pub fn read(&'static self, user_dst: bool, addr: usize, n: usize) -> Result<usize, ()> {
         match self {
-            Self::Read(inner) => inner.lock().read(addr, n),
+            Self::Read(inner) => inner.lock().read(user_dst, addr, n),
             Self::Write(_) => Err(()),
         }
     }
+
+    // Do both ends belong to the same pipe?
+    pub fn is_same(&self, other: &Self) -> bool {
+        let (Self::Read(inner) | Self::Write(inner)) = self;
+        let (Self::Read(other) | Self::Write(other)) = other;
+        Arc::ptr_eq(inner, other)
+    }
+
+    // Let f write up to n bytes straight into the ring, for splice.
+    // f is called with the kernel address and length of a free span,
+    // and returns how much of it it filled. It runs without the
+    // pipe lock, so it may sleep; other writers wait until it is done.
+    pub fn fill(
+        &'static self,
+        n: usize,
+        f: impl FnOnce(usize, usize) -> Result<usize, ()>,
+    ) -> Result<usize, ()> {
+        let Self::Write(inner) = self else {
+            return Err(());
+        };
+
+        let mut pipe = inner.lock();
+        while pipe.filling || pipe.write == pipe.read + pipe.size() {
+            if !pipe.read_open || process::is_killed() == Some(true) {
+                return Err(());
+            }
+            process::wakeup(core::ptr::addr_of!(pipe.read).addr());
+            process::sleep(core::ptr::addr_of!(pipe.write).addr(), &mut pipe);
+        }
+        if !pipe.read_open {
+            return Err(());
+        }
+
+        let size = pipe.size();
+        let start = pipe.write % size;
+        let len = n.min(size - (pipe.write - pipe.read)).min(size - start);
+        let addr = pipe.data[start..].as_mut_ptr().addr();
+
+        pipe.filling = true;
+        let result = SpinLock::unlock_temporarily(&mut pipe, || f(addr, len));
+        pipe.filling = false;
+
+        if let Ok(filled) = result {
+            assert!(filled <= len);
+            pipe.write += filled;
+        }
+        process::wakeup(core::ptr::addr_of!(pipe.read).addr());
+        process::wakeup(core::ptr::addr_of!(pipe.write).addr());
+
+        result
+    }
+
+    // Let f consume up to n bytes straight from the ring, for splice.
+    // Like fill, but f is called with a span of buffered data, and
+    // returns how much of it it used. Returns 0 at end of file.
+    pub fn drain(
+        &'static self,
+        n: usize,
+        f: impl FnOnce(usize, usize) -> Result<usize, ()>,
+    ) -> Result<usize, ()> {
+        let Self::Read(inner) = self else {
+            return Err(());
+        };
+
+        let mut pipe = inner.lock();
+        while pipe.draining || (pipe.read == pipe.write && pipe.write_open) {
+            if process::is_killed() == Some(true) {
+                return Err(());
+            }
+            process::sleep(core::ptr::addr_of!(pipe.read).addr(), &mut pipe);
+        }
+        if pipe.read == pipe.write {
+            return Ok(0);
+        }
+
+        let size = pipe.size();
+        let start = pipe.read % size;
+        let len = n.min(pipe.write - pipe.read).min(size - start);
+        let addr = pipe.data[start..].as_ptr().addr();
+
+        pipe.draining = true;
+        let result = SpinLock::unlock_temporarily(&mut pipe, || f(addr, len));
+        pipe.draining = false;
+
+        if let Ok(drained) = result {
+            assert!(drained <= len);
+            pipe.read += drained;
+        }
+        process::wakeup(core::ptr::addr_of!(pipe.read).addr());
+        process::wakeup(core::ptr::addr_of!(pipe.write).addr());
+
+        result
+    }
+
+    // Change the capacity of the pipe to size bytes.
+    // Fails if the data already in the pipe does not fit.
+    pub fn resize(&self, size: usize) -> Result<(), ()> {
+        let (Self::Read(inner) | Self::Write(inner)) = self;
+
+        // allocate without holding the pipe lock.
+        let data = allocate_buffer(size)?;
+        inner.lock().resize(data)
+    }
 }
 
-impl<const SIZE: usize> Drop for Pipe<SIZE> {
+impl Drop for Pipe {
     fn drop(&mut self) {
         match self {
             Self::Read(inner) => inner.lock().close_read(),
@@ -43,24 +146,62 @@ impl<const SIZE: usize> Drop for Pipe<SIZE> {
     }
 }
 
+fn allocate_buffer(size: usize) -> Result<Box<[u8]>, ()> {
+    if size == 0 {
+        return Err(());
+    }
+
+    let mut data = Vec::new();
+    data.try_reserve_exact(size).map_err(|_| ())?;
+    data.resize(size, 0);
+    Ok(data.into_boxed_slice())
+}
+
 #[derive(Debug)]
-pub struct PipeInner<const SIZE: usize> {
-    data: [u8; SIZE],
-    read: usize,
-    write: usize,
+pub struct PipeInner {
+    data: Box<[u8]>,
+    read: usize,  // number of bytes read
+    write: usize, // number of bytes written
     read_open: bool,
     write_open: bool,
+    filling: bool,  // splice is writing into the ring
+    draining: bool, // splice is reading from the ring
 }
 
-impl<const SIZE: usize> PipeInner<SIZE> {
-    const fn new() -> Self {
-        Self {
-            data: [0; _],
+impl PipeInner {
+    fn new(size: usize) -> Result<Self, ()> {
+        Ok(Self {
+            data: allocate_buffer(size)?,
             read: 0,
             write: 0,
             read_open: true,
             write_open: true,
+            filling: false,
+            draining: false,
+        })
+    }
+
+    const fn size(&self) -> usize {
+        self.data.len()
+    }
+
+    fn resize(&mut self, mut data: Box<[u8]>) -> Result<(), ()> {
+        let len = self.write - self.read;
+        if len > data.len() || self.filling || self.draining {
+            return Err(());
         }
+
+        // copy the contents to the start of the new buffer.
+        for (i, byte) in data[..len].iter_mut().enumerate() {
+            *byte = self.data[(self.read + i) % self.size()];
+        }
+        self.data = data;
+        self.read = 0;
+        self.write = len;
+
+        // there may be room for a sleeping writer now.
+        process::wakeup(core::ptr::addr_of!(self.write).addr());
+        Ok(())
     }
 
     fn close_read(&mut self) {
@@ -75,24 +216,56 @@ impl<const SIZE: usize> PipeInner<SIZE> {
         process::wakeup(core::ptr::addr_of!(self.read).addr());
     }
 
-    fn write(self: &mut SpinLockGuard<'static, Self>, addr: usize, n: usize) -> Result<usize, ()> {
+    // Copy as much of [addr, addr+n) into the pipe as fits in
+    // one contiguous span of the ring, and return how much was
+    // copied, or None if the memory can't be read.
+    fn copy_in(&mut self, user_src: bool, addr: usize, n: usize) -> Option<usize> {
+        let size = self.size();
+        let start = self.write % size;
+        let len = n.min(size - (self.write - self.read)).min(size - start);
+
+        let dst = &mut self.data[start..(start + len)];
+        if !unsafe { process::copyin_either(dst, user_src, addr) } {
+            return None;
+        }
+        self.write += len;
+        Some(len)
+    }
+
+    // Copy up to n bytes of one contiguous span of the ring
+    // out to addr, like copy_in.
+    fn copy_out(&mut self, user_dst: bool, addr: usize, n: usize) -> Option<usize> {
+        let size = self.size();
+        let start = self.read % size;
+        let len = n.min(self.write - self.read).min(size - start);
+
+        let src = &self.data[start..(start + len)];
+        if !unsafe { process::copyout_either(user_dst, addr, src) } {
+            return None;
+        }
+        self.read += len;
+        Some(len)
+    }
+
+    fn write(
+        self: &mut SpinLockGuard<'static, Self>,
+        user_src: bool,
+        addr: usize,
+        n: usize,
+    ) -> Result<usize, ()> {
         let mut i = 0;
         while i < n {
             if !self.read_open || process::is_killed() == Some(true) {
                 return Err(());
             }
 
-            if self.write == self.read + SIZE {
+            // a splice owns the free span until it is done.
+            if self.filling || self.write == self.read + self.size() {
                 process::wakeup(core::ptr::addr_of!(self.read).addr());
                 process::sleep(core::ptr::addr_of!(self.write).addr(), self);
             } else {
-                match process::read_memory(addr + i) {
-                    Some(ch) => {
-                        let index = self.write % SIZE;
-                        self.data[index] = ch;
-                        self.write += 1;
-                        i += 1;
-                    }
+                match self.copy_in(user_src, addr + i, n - i) {
+                    Some(copied) => i += copied,
                     None => break,
                 }
             }
@@ -102,28 +275,28 @@ impl<const SIZE: usize> PipeInner<SIZE> {
         Ok(i)
     }
 
-    fn read(self: &mut SpinLockGuard<'static, Self>, addr: usize, n: usize) -> Result<usize, ()> {
-        while self.read == self.write && self.write_open {
+    fn read(
+        self: &mut SpinLockGuard<'static, Self>,
+        user_dst: bool,
+        addr: usize,
+        n: usize,
+    ) -> Result<usize, ()> {
+        // a splice owns the buffered data until it is done.
+        while self.draining || (self.read == self.write && self.write_open) {
             if process::is_killed() == Some(true) {
                 return Err(());
             }
             process::sleep(core::ptr::addr_of!(self.read).addr(), self);
         }
 
+        // the data may wrap around the end of the ring,
+        // so it takes up to two copies.
         let mut total_read = 0;
-        for i in 0..n {
-            if self.read == self.write {
-                break;
-            }
-
-            let ch = self.data[self.read % SIZE];
-            self.read += 1;
-
-            if !process::write_memory(addr + i, ch) {
-                break;
+        while total_read < n && self.read != self.write {
+            match self.copy_out(user_dst, addr + total_read, n - total_read) {
+                Some(copied) => total_read += copied,
+                None => break,
             }
-
-            total_read += 1;
         }
 
         process::wakeup(core::ptr::addr_of!(self.write).addr());
@@ -1,22 +1,26 @@
 //! the riscv Platform Level Interrupt Controller (PLIC).
 
 use crate::{
-    memory_layout::{plic_sclaim, plic_senable, plic_spriority, PLIC, UART0_IRQ, VIRTIO0_IRQ},
+    memory_layout::{
+        plic_sclaim, plic_senable, plic_spriority, NVIRTIO, PLIC, UART0_IRQ, VIRTIO0_IRQ,
+    },
     riscv::read_reg,
 };
 
 pub unsafe fn initialize() {
     // set desired IRQ priorities non-zero (otherwise disabled).
     core::ptr::from_exposed_addr_mut::<u32>(PLIC + UART0_IRQ * 4).write(1);
-    core::ptr::from_exposed_addr_mut::<u32>(PLIC + VIRTIO0_IRQ * 4).write(1);
+    for irq in VIRTIO0_IRQ..VIRTIO0_IRQ + NVIRTIO {
+        core::ptr::from_exposed_addr_mut::<u32>(PLIC + irq * 4).write(1);
+    }
 }
 
 pub unsafe fn initialize_for_core() {
     let hart = read_reg!(tp);
 
-    // set uart's enable bit for this hart's S-mode.
-    core::ptr::from_exposed_addr_mut::<u32>(plic_senable(hart))
-        .write((1 << UART0_IRQ) | (1 << VIRTIO0_IRQ));
+    // set uart's and the virtio slots' enable bits for this hart's S-mode.
+    let virtio = ((1 << NVIRTIO) - 1) << VIRTIO0_IRQ;
+    core::ptr::from_exposed_addr_mut::<u32>(plic_senable(hart)).write((1 << UART0_IRQ) | virtio);
 
     // set this hart's S-mode priority threshold to 0.
     core::ptr::from_exposed_addr_mut::<u32>(plic_spriority(hart)).write(0);
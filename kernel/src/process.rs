@@ -1,8 +1,12 @@
+mod channel;
+mod fault;
 mod process;
 mod scheduler;
 mod table;
 mod trapframe;
 
+pub use fault::Segment;
+
 use core::mem::{ManuallyDrop, MaybeUninit};
 
 use crate::allocator;
@@ -11,11 +15,11 @@ use crate::config::{NCPU, NPROC, ROOTDEV};
 use crate::filesystem::log;
 use crate::memory_layout::{kstack, kstack_index};
 use crate::process::process::ProcessContext;
-use crate::riscv::enable_interrupt;
-use crate::spinlock::{SpinLock, SpinLockGuard};
+use crate::riscv::{enable_interrupt, wait_for_interrupt};
+use crate::spinlock::{self, SpinLock, SpinLockGuard};
 use crate::trap::usertrapret;
 use crate::vm::PageTable;
-use crate::{cpu, fs, interrupt};
+use crate::{cpu, fs, interrupt, trace};
 
 use crate::{
     memory_layout::{TRAMPOLINE, TRAPFRAME},
@@ -75,7 +79,7 @@ pub fn read_memory<T>(addr: usize) -> Option<T> {
     }
 
     let mut dst = MaybeUninit::uninit();
-    if unsafe { process.pagetable.read(&mut dst, addr).is_err() } {
+    if unsafe { process.copy_in(&mut dst, addr).is_err() } {
         return None;
     }
 
@@ -85,7 +89,7 @@ pub fn read_memory<T>(addr: usize) -> Option<T> {
 #[must_use]
 pub fn write_memory<T: 'static>(addr: usize, value: T) -> bool {
     let process = context().unwrap();
-    unsafe { process.pagetable.write(addr, &value).is_ok() }
+    unsafe { process.copy_out(addr, &value).is_ok() }
 }
 
 // Copy from either a user address, or kernel address,
@@ -98,7 +102,7 @@ pub unsafe fn copyin_either<T: ?Sized>(dst: &mut T, user_src: bool, src: usize)
         .context()
         .unwrap();
     if user_src {
-        proc_context.pagetable.read(dst, src).is_ok()
+        proc_context.copy_in(dst, src).is_ok()
     } else {
         core::ptr::copy(
             core::ptr::from_exposed_addr::<u8>(src),
@@ -120,7 +124,7 @@ pub unsafe fn copyout_either<T: ?Sized>(user_dst: bool, dst: usize, src: &T) ->
         .unwrap();
 
     if user_dst {
-        proc_context.pagetable.write(dst, src).is_ok()
+        proc_context.copy_out(dst, src).is_ok()
     } else {
         core::ptr::copy(
             <*const T>::cast::<u8>(src),
@@ -161,11 +165,11 @@ pub fn is_running() -> bool {
     }
 }
 
-static KSTACK_USED: SpinLock<Bitmap<NPROC>> = SpinLock::new(Bitmap::new());
+static KSTACK_USED: SpinLock<Bitmap<NPROC>> = SpinLock::named("kstack", Bitmap::new());
 
 pub fn initialize_kstack(pagetable: &mut PageTable) {
     for i in 0..NPROC {
-        let memory = allocator::get().lock().allocate_page().unwrap();
+        let memory = allocator::allocate_page().unwrap();
         let pa = memory.addr().get();
         let va = kstack(i);
         pagetable.map(va, pa, PGSIZE, PTE::R | PTE::W).unwrap();
@@ -201,7 +205,7 @@ extern "C" fn finish_dispatch() {
 unsafe fn uvminit(pagetable: &mut PageTable, src: *const u8, size: usize) {
     assert!(size < PGSIZE);
 
-    let mem = allocator::get().lock().allocate_page().unwrap();
+    let mem = allocator::allocate_page().unwrap();
     core::ptr::write_bytes(mem.as_ptr(), 0, PGSIZE);
 
     pagetable
@@ -237,6 +241,7 @@ pub unsafe fn setup_init_process() {
     assert!(process.pid == 1);
 
     process.state = ProcessState::Runnable(context);
+    scheduler::enqueue(&process);
 }
 
 pub fn allocate_pagetable(trapframe: usize) -> Result<PageTable, ()> {
@@ -274,6 +279,13 @@ pub fn free_pagetable(pagetable: &mut PageTable, size: usize) {
 }
 
 pub fn sleep<T>(token: usize, guard: &mut SpinLockGuard<'static, T>) {
+    let current = map_assigned(Assigned::get).unwrap();
+    let index = table::get().index_of(unsafe { current.get() });
+
+    // Join the wait channel before taking p->lock,
+    // while guard still keeps wakeup from running.
+    channel::register(token, index);
+
     // Must acquire p->lock in order to
     // change p->state and then call sched.
     // Once we hold p->lock, we can be
@@ -281,16 +293,20 @@ pub fn sleep<T>(token: usize, guard: &mut SpinLockGuard<'static, T>) {
     // (wakeup locks p->lock),
     // so it's okay to release lk.
 
-    let mut process = map_assigned(Assigned::get).unwrap().lock();
+    let mut process = current.lock();
     SpinLock::unlock_temporarily(guard, || {
         // Go to sleep.
         process.state.sleep(token).unwrap();
         return_to_scheduler(process);
+
+        // kill wakes a process without
+        // taking it off the channel.
+        channel::unregister(token, index);
     })
 }
 
 pub fn wakeup(token: usize) {
-    table::get().wakeup(token, map_assigned(Assigned::get));
+    channel::wakeup(token, map_assigned(Assigned::get));
 }
 
 pub unsafe fn fork() -> Option<usize> {
@@ -309,6 +325,7 @@ pub unsafe fn fork() -> Option<usize> {
     });
 
     process_new.state.setup(context_new).unwrap();
+    scheduler::enqueue(&process_new);
 
     Some(pid)
 }
@@ -325,6 +342,11 @@ pub unsafe fn exit(status: i32) {
     if let Some(ref mut cwd) = context.cwd.take() {
         log::with(|| unsafe { ManuallyDrop::drop(cwd) });
     }
+    // the executable too: releasing it may sleep on the log, which
+    // wait() can't do when it frees the context under its locks.
+    if let Some(ref mut executable) = context.executable.take() {
+        log::with(|| unsafe { ManuallyDrop::drop(executable) });
+    }
 
     let _guard = (*table::wait_lock()).lock();
     //table::table().remove_parent(process.pid as usize);
@@ -348,21 +370,30 @@ pub unsafe fn exit(status: i32) {
 }
 
 pub fn scheduler() {
+    let id = interrupt::off(cpu::id);
+
     loop {
+        // Avoid deadlock by ensuring that devices can interrupt.
         unsafe { enable_interrupt() };
 
-        for process in table::get().iter() {
-            let mut process = process.lock();
-            if process.state.is_runnable() {
-                process.state.run().unwrap();
+        let Some(index) = scheduler::dequeue(id) else {
+            // nothing to run; stop until an interrupt,
+            // which may have made a process runnable.
+            unsafe { wait_for_interrupt() };
+            continue;
+        };
 
-                let process_context = &process.context().unwrap().context as *const _;
-                map_assigned_mut(|slot| slot.switch(process));
+        let mut process = table::get().get(index).lock();
+        if process.state.is_runnable() {
+            process.state.run().unwrap();
+            trace::switch(process.pid);
 
-                unsafe { cpu::dispatch(&*process_context) };
+            let process_context = &process.context().unwrap().context as *const _;
+            map_assigned_mut(|slot| slot.switch(process));
 
-                map_assigned_mut(Assigned::release);
-            }
+            unsafe { cpu::dispatch(&*process_context) };
+
+            map_assigned_mut(Assigned::release);
         }
     }
 }
@@ -385,6 +416,7 @@ fn return_to_scheduler(mut process: SpinLockGuard<'static, Process>) {
 pub fn pause() {
     let mut process = map_assigned(Assigned::get).unwrap().lock();
     process.state.pause().unwrap();
+    scheduler::enqueue(&process);
     return_to_scheduler(process);
 }
 
@@ -401,12 +433,7 @@ pub unsafe fn wait(addr: Option<usize>) -> Option<usize> {
                 if let ProcessState::Zombie(_, exit_status) = process.state {
                     let pid = process.pid;
                     if let Some(addr) = addr {
-                        if context()
-                            .unwrap()
-                            .pagetable
-                            .write(addr, &exit_status)
-                            .is_err()
-                        {
+                        if context().unwrap().copy_out(addr, &exit_status).is_err() {
                             return None;
                         }
                     }
@@ -433,4 +460,6 @@ pub fn procdump() {
     for process in table::get().iter() {
         unsafe { process.get().dump() };
     }
+    allocator::dump();
+    spinlock::dump();
 }
@@ -0,0 +1,68 @@
+// wait channels.
+//
+// a sleeping process is recorded in the bucket its token
+// hashes to, so wakeup(token) only looks at the processes
+// sleeping on tokens in that bucket instead of the whole
+// process table.
+//
+// a sleeper adds itself to the bucket while it still holds
+// the condition lock, and only then takes p->lock, so buckets
+// are always locked before p->lock. wakeup removes the
+// processes it wakes; a process woken in some other way
+// (kill) removes itself once it runs again.
+
+use arrayvec::ArrayVec;
+
+use crate::{config::NCHANNEL, config::NPROC, spinlock::SpinLock};
+
+use super::{scheduler, table, Process};
+
+// indices into the process table.
+type Bucket = ArrayVec<usize, NPROC>;
+
+static BUCKETS: [SpinLock<Bucket>; NCHANNEL] = [const { SpinLock::new(ArrayVec::new_const()) }; _];
+
+fn bucket(token: usize) -> &'static SpinLock<Bucket> {
+    // tokens are addresses; mix the bits above the alignment.
+    let hash = (token >> 3).wrapping_mul(0x9E37_79B9_7F4A_7C15);
+    &BUCKETS[(hash >> 32) % NCHANNEL]
+}
+
+// Record that the process at index is about to sleep on token.
+pub fn register(token: usize, index: usize) {
+    bucket(token).lock().push(index);
+}
+
+// Forget the process at index, if wakeup has not already.
+pub fn unregister(token: usize, index: usize) {
+    let mut bucket = bucket(token).lock();
+    if let Some(i) = bucket.iter().position(|&p| p == index) {
+        bucket.swap_remove(i);
+    }
+}
+
+// Wake up all processes sleeping on token,
+// except for current.
+pub fn wakeup(token: usize, current: Option<&SpinLock<Process>>) {
+    let mut bucket = bucket(token).lock();
+
+    let mut i = 0;
+    while i < bucket.len() {
+        let process = table::get().get(bucket[i]);
+        if current.is_some_and(|current| core::ptr::eq(process, current)) {
+            i += 1;
+            continue;
+        }
+
+        // a process on another token, or one that has not
+        // finished going to sleep yet, stays in the bucket.
+        let mut process = process.lock();
+        if process.state.is_sleeping_on(token) {
+            process.state.wakeup().unwrap();
+            scheduler::enqueue(&process);
+            bucket.swap_remove(i);
+        } else {
+            i += 1;
+        }
+    }
+}
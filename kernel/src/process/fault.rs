@@ -0,0 +1,131 @@
+// demand paging of user memory.
+//
+// sbrk only moves p->sz, and exec only records where each
+// segment of the program lives in the executable. pages are
+// mapped the first time they are touched, either by the
+// process itself (a page fault in usertrap) or by the kernel
+// copying to or from user memory.
+
+use crate::{
+    interrupt,
+    riscv::paging::{pg_rounddown, PGSIZE, PTE},
+};
+
+use super::process::ProcessContext;
+
+// a loadable segment of the running program, read from the
+// executable on first touch.
+#[derive(Debug, Clone, Copy)]
+pub struct Segment {
+    pub va: usize,     // page-aligned start address
+    pub memsz: usize,  // size in memory
+    pub offset: usize, // offset of the contents in the executable
+    pub filesz: usize, // size of the contents in the executable
+    pub perm: u64,     // PTE permission bits
+}
+
+impl Segment {
+    const fn contains(&self, va: usize) -> bool {
+        self.va <= va && va - self.va < self.memsz
+    }
+}
+
+impl ProcessContext {
+    // Map the page containing va, which must be
+    // below p->sz and not mapped yet.
+    // Program pages are read from the executable, and
+    // any other page is zero-filled.
+    pub fn handle_page_fault(&mut self, va: usize) -> Result<(), ()> {
+        if va >= self.sz {
+            return Err(());
+        }
+
+        let va = pg_rounddown(va);
+        if let Ok(pte) = self.pagetable.search_entry(va, false) {
+            if pte.is_valid() {
+                return Err(());
+            }
+        }
+
+        let segment = self.segments.iter().find(|s| s.contains(va)).copied();
+
+        // reading the executable may sleep, which is not
+        // allowed while a spinlock is held.
+        if segment.is_some() && !interrupt::is_enabled() {
+            return Err(());
+        }
+
+        let perm = segment.map_or(PTE::W, |s| s.perm);
+        self.pagetable.grow(va, va + PGSIZE, perm)?;
+
+        let Some(segment) = segment else {
+            return Ok(());
+        };
+
+        let file_end = segment.va + segment.filesz;
+        if va < file_end {
+            let pa = self.pagetable.virtual_to_physical(va).unwrap();
+            let n = (file_end - va).min(PGSIZE);
+            let offset = segment.offset + (va - segment.va);
+
+            let executable = self.executable.as_ref().unwrap();
+            if executable.lock().copy_to::<u8>(false, pa, offset, n) != Ok(n) {
+                self.pagetable.unmap(va, 1, true);
+                return Err(());
+            }
+        }
+
+        Ok(())
+    }
+
+    // Fault in every page of [addr, addr+len) ahead of time,
+    // for system calls that copy user memory while holding locks.
+    pub fn populate(&mut self, addr: usize, len: usize) -> Result<(), ()> {
+        let end = addr.checked_add(len).ok_or(())?;
+        if end > self.sz {
+            return Err(());
+        }
+
+        for va in (pg_rounddown(addr)..end).step_by(PGSIZE) {
+            if self.pagetable.virtual_to_physical(va).is_none() {
+                self.handle_page_fault(va)?;
+            }
+        }
+
+        Ok(())
+    }
+
+    // Copy from user virtual address src to dst,
+    // faulting in pages that are not mapped yet.
+    pub unsafe fn copy_in<T: ?Sized>(&mut self, dst: &mut T, src: usize) -> Result<(), ()> {
+        loop {
+            match self.pagetable.read(dst, src) {
+                Ok(()) => return Ok(()),
+                Err(copied) => self.handle_page_fault(src + copied)?,
+            }
+        }
+    }
+
+    // Copy src to user virtual address dst,
+    // faulting in pages that are not mapped yet.
+    pub unsafe fn copy_out<T: ?Sized>(&mut self, dst: usize, src: &T) -> Result<(), ()> {
+        loop {
+            match self.pagetable.write(dst, src) {
+                Ok(()) => return Ok(()),
+                Err(copied) => self.handle_page_fault(dst + copied)?,
+            }
+        }
+    }
+
+    // Copy a null-terminated string from user virtual address src,
+    // faulting in pages that are not mapped yet.
+    pub unsafe fn copy_in_str(&mut self, dst: &mut [u8], src: usize) -> Result<usize, ()> {
+        loop {
+            match self.pagetable.read_cstr(dst, src) {
+                Ok(len) => return Ok(len),
+                Err(read) if read < dst.len() => self.handle_page_fault(src + read)?,
+                Err(_) => return Err(()),
+            }
+        }
+    }
+}
@@ -2,15 +2,20 @@ use core::ffi::c_char;
 use core::mem::ManuallyDrop;
 
 use alloc::{boxed::Box, sync::Arc};
+use arrayvec::ArrayVec;
 
 use crate::filesystem::log;
 use crate::vm::PageTable;
 use crate::{
-    config::NOFILE, context::Context as CPUContext, file::File, fs::InodeReference, process,
+    config::{MAXSEGMENT, NOFILE},
+    context::Context as CPUContext,
+    file::File,
+    fs::InodeReference,
+    process,
     riscv::paging::PGSIZE,
 };
 
-use super::{free_pagetable, trapframe::TrapFrame};
+use super::{fault::Segment, free_pagetable, trapframe::TrapFrame};
 
 #[derive(Debug)]
 pub enum ProcessState {
@@ -193,6 +198,8 @@ pub struct ProcessContext {
     pub context: CPUContext,                       // swtch() here to run process
     pub ofile: [Option<Arc<File>>; NOFILE],        // Open files
     pub cwd: Option<ManuallyDrop<InodeReference>>, // Current directory
+    pub segments: ArrayVec<Segment, MAXSEGMENT>,   // Demand-paged program segments
+    pub executable: Option<ManuallyDrop<InodeReference>>, // Backing file of segments
 }
 
 impl ProcessContext {
@@ -213,6 +220,8 @@ impl ProcessContext {
             context,
             ofile: [const { None }; _],
             cwd: None,
+            segments: ArrayVec::new(),
+            executable: None,
         })
     }
 
@@ -222,6 +231,8 @@ impl ProcessContext {
         let mut pagetable = process::allocate_pagetable(core::ptr::addr_of!(*trapframe).addr())?;
         let ofile = self.ofile.clone();
         let cwd = self.cwd.clone();
+        let segments = self.segments.clone();
+        let executable = self.executable.clone();
         trapframe.a0 = 0;
 
         self.pagetable.copy(&mut pagetable, self.sz)?;
@@ -238,6 +249,8 @@ impl ProcessContext {
             context,
             ofile,
             cwd,
+            segments,
+            executable,
         })
     }
 }
@@ -250,5 +263,9 @@ impl Drop for ProcessContext {
         if let Some(ref mut inode) = self.cwd {
             log::with(|| unsafe { ManuallyDrop::drop(inode) });
         }
+
+        if let Some(ref mut inode) = self.executable {
+            log::with(|| unsafe { ManuallyDrop::drop(inode) });
+        }
     }
 }
@@ -1 +1,64 @@
+// per-CPU run queues.
+//
+// a process is on exactly one run queue while it is RUNNABLE.
+// it is queued, with its p->lock held, by whoever makes it
+// runnable: fork, wakeup, kill and yield put it on the queue
+// of the CPU they run on. a scheduler takes processes from
+// its own queue first, and steals from the other CPUs' queues
+// when its own is empty.
 
+use crate::{config::NCPU, config::NPROC, cpu, spinlock::SpinLock};
+
+use super::{table, Process};
+
+// a FIFO of indices into the process table.
+struct RunQueue {
+    procs: [usize; NPROC],
+    head: usize,
+    len: usize,
+}
+
+impl RunQueue {
+    const fn new() -> Self {
+        Self {
+            procs: [0; _],
+            head: 0,
+            len: 0,
+        }
+    }
+
+    fn push(&mut self, index: usize) {
+        assert!(self.len < NPROC);
+        self.procs[(self.head + self.len) % NPROC] = index;
+        self.len += 1;
+    }
+
+    fn pop(&mut self) -> Option<usize> {
+        if self.len == 0 {
+            return None;
+        }
+
+        let index = self.procs[self.head];
+        self.head = (self.head + 1) % NPROC;
+        self.len -= 1;
+        Some(index)
+    }
+}
+
+static QUEUES: [SpinLock<RunQueue>; NCPU] = [const { SpinLock::new(RunQueue::new()) }; _];
+
+// Queue a process that has just become RUNNABLE.
+// Caller must hold p->lock, so interrupts are off.
+pub fn enqueue(process: &Process) {
+    let index = table::get().index_of(process);
+    QUEUES[cpu::id()].lock().push(index);
+}
+
+// Take the next process to run: the oldest one on this
+// CPU's queue, or else one stolen from another CPU.
+// Returns an index into the process table.
+pub fn dequeue(id: usize) -> Option<usize> {
+    (0..NCPU)
+        .map(|i| (id + i) % NCPU)
+        .find_map(|cpu| QUEUES[cpu].lock().pop())
+}
@@ -7,7 +7,7 @@ use crate::{
     spinlock::{SpinLock, SpinLockGuard},
 };
 
-use super::Process;
+use super::{scheduler, Process};
 
 #[derive(Debug)]
 struct Parent {
@@ -27,7 +27,7 @@ impl ProcessTable {
     pub const fn new() -> Self {
         Self {
             procs: [const { SpinLock::new(Process::unused()) }; _],
-            parent_maps: SpinLock::new(ArrayVec::new_const()),
+            parent_maps: SpinLock::named("wait", ArrayVec::new_const()),
             next_pid: AtomicUsize::new(1),
         }
     }
@@ -49,21 +49,6 @@ impl ProcessTable {
         None
     }
 
-    pub fn wakeup(&self, token: usize, current: Option<&SpinLock<Process>>) {
-        for process in self.procs.iter() {
-            if let Some(current) = current {
-                if core::ptr::eq(process, current) {
-                    continue;
-                }
-            }
-
-            let mut process = process.lock();
-            if process.state.is_sleeping_on(token) {
-                process.state.wakeup().unwrap();
-            }
-        }
-    }
-
     pub fn kill(&self, pid: usize) -> bool {
         for process in self.procs.iter() {
             let mut process = process.lock();
@@ -71,6 +56,7 @@ impl ProcessTable {
                 process.killed = true;
                 if process.state.is_sleeping() {
                     process.state.wakeup().unwrap();
+                    scheduler::enqueue(&process);
                 }
                 return true;
             }
@@ -78,6 +64,19 @@ impl ProcessTable {
         false
     }
 
+    // The index in the table of the process, which
+    // must be one of the table's entries.
+    pub fn index_of(&self, process: &Process) -> usize {
+        let offset = (process as *const Process).addr() - self.procs.as_ptr().addr();
+        let index = offset / core::mem::size_of::<SpinLock<Process>>();
+        assert!(index < NPROC);
+        index
+    }
+
+    pub fn get(&self, index: usize) -> &SpinLock<Process> {
+        &self.procs[index]
+    }
+
     pub fn iter(&self) -> impl Iterator<Item = &SpinLock<Process>> {
         self.procs.iter()
     }
@@ -12,7 +12,9 @@ use core::mem::MaybeUninit;
 // the trapframe includes callee-saved user registers like s0-s11 because the
 // return-to-user path via usertrapret() doesn't return through
 // the entire kernel call stack.
-#[repr(C)]
+// the trapframe is mapped into user space on its own page,
+// so it must not share that page with other allocations.
+#[repr(C, align(4096))]
 #[derive(Debug, Clone)]
 pub struct TrapFrame {
     pub kernel_satp: u64,   // kernel page table
@@ -0,0 +1,136 @@
+// sampling profiler.
+//
+// while profiling is on, each timer interrupt records what the
+// CPU was doing into that CPU's sample buffer: the user pc for
+// a trap from user space, or the kernel pc and a backtrace
+// along the frame pointers for a trap from the kernel. the
+// profile() system call turns sampling on and off and copies
+// the samples out. samples that don't fit are dropped.
+
+use core::sync::atomic::{AtomicBool, Ordering::*};
+
+use arrayvec::ArrayVec;
+
+use crate::{
+    config::{NCPU, NPROF, NPROFDEPTH},
+    cpu, process,
+    riscv::paging::{pg_rounddown, PGSIZE},
+    spinlock::SpinLock,
+};
+
+// operations of profile().
+pub const START: usize = 0; // discard old samples and start sampling
+pub const STOP: usize = 1; // stop sampling
+pub const READ: usize = 2; // copy out the samples
+
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub struct Sample {
+    pub pid: u64,              // 0 if no process was running
+    pub user: u64,             // 1 if pc[0] is a user address
+    pub depth: u64,            // valid entries of pc
+    pub pc: [u64; NPROFDEPTH], // interrupted pc, then return addresses
+}
+
+static ENABLED: AtomicBool = AtomicBool::new(false);
+
+static BUFFERS: [SpinLock<ArrayVec<Sample, NPROF>>; NCPU] =
+    [const { SpinLock::new(ArrayVec::new_const()) }; _];
+
+fn sample(user: bool) -> Sample {
+    Sample {
+        pid: process::id().unwrap_or(0) as u64,
+        user: user as u64,
+        depth: 0,
+        pc: [0; _],
+    }
+}
+
+fn record(sample: Sample) {
+    let _ = BUFFERS[cpu::id()].lock().try_push(sample);
+}
+
+// A timer interrupt arrived from user space at pc.
+pub fn sample_user(pc: usize) {
+    if !ENABLED.load(Relaxed) {
+        return;
+    }
+
+    let mut sample = sample(true);
+    sample.pc[0] = pc as u64;
+    sample.depth = 1;
+    record(sample);
+}
+
+// A timer interrupt arrived from the kernel at pc.
+// fp is kerneltrap's frame pointer. kernelvec leaves s0
+// alone, so the frame kerneltrap saved is the interrupted
+// function's.
+pub fn sample_kernel(pc: usize, fp: usize) {
+    if !ENABLED.load(Relaxed) {
+        return;
+    }
+
+    let mut sample = sample(false);
+    sample.pc[0] = pc as u64;
+    sample.depth = 1;
+
+    // only follow frames upwards within this stack page,
+    // since s0 need not hold a frame pointer in assembly.
+    let bottom = pg_rounddown(fp);
+    let is_frame = |fp: usize| fp % 8 == 0 && fp >= bottom + 16 && fp <= bottom + PGSIZE;
+
+    // a frame holds the return address at fp-8 and the
+    // caller's frame pointer at fp-16.
+    let mut fp = unsafe { *((fp - 16) as *const usize) };
+    while (sample.depth as usize) < NPROFDEPTH && is_frame(fp) {
+        let (ra, prev) = unsafe { (*((fp - 8) as *const u64), *((fp - 16) as *const usize)) };
+        sample.pc[sample.depth as usize] = ra;
+        sample.depth += 1;
+
+        if prev <= fp {
+            break;
+        }
+        fp = prev;
+    }
+
+    record(sample);
+}
+
+// Copy out as many whole samples as fit in n bytes at addr.
+// Returns the number of bytes copied.
+fn read(addr: usize, n: usize) -> Result<usize, ()> {
+    let context = process::context().ok_or(())?;
+
+    // the buffers are locked while copying out.
+    context.populate(addr, n)?;
+
+    let size = core::mem::size_of::<Sample>();
+    let mut copied = 0;
+    for buffer in BUFFERS.iter() {
+        let buffer = buffer.lock();
+        let count = buffer.len().min((n - copied) / size);
+        unsafe { context.copy_out(addr + copied, &buffer[..count])? };
+        copied += count * size;
+    }
+
+    Ok(copied)
+}
+
+pub fn control(op: usize, addr: usize, n: usize) -> Result<usize, ()> {
+    match op {
+        START => {
+            for buffer in BUFFERS.iter() {
+                buffer.lock().clear();
+            }
+            ENABLED.store(true, Release);
+            Ok(0)
+        }
+        STOP => {
+            ENABLED.store(false, Release);
+            Ok(0)
+        }
+        READ => read(addr, n),
+        _ => Err(()),
+    }
+}
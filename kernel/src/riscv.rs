@@ -77,6 +77,12 @@ pub mod mie {
     pub const MSIE: u64 = 1u64 << 3;
 }
 
+// Machine Counter-Enable
+pub mod mcounteren {
+    // supervisor mode may read the time CSR.
+    pub const TM: u64 = 1u64 << 1;
+}
+
 pub mod satp {
     pub const SV39: u64 = 8u64 << 60;
 
@@ -98,6 +104,11 @@ pub unsafe fn disable_interrupt() {
     write_csr!(sstatus, read_csr!(sstatus) & !sstatus::SIE);
 }
 
+// stop the hart until an interrupt is pending
+pub unsafe fn wait_for_interrupt() {
+    asm!("wfi");
+}
+
 // are device interrupts enabled?
 pub unsafe fn is_interrupt_enabled() -> bool {
     read_csr!(sstatus) & sstatus::SIE != 0
@@ -23,6 +23,12 @@ pub const fn pg_rounddown(a: usize) -> usize {
 // that have the high bit set.
 pub const MAXVA: usize = 1usize << (9 + 9 + 9 + 12 - 1);
 
+// bytes mapped by a leaf PTE at level:
+// a page, a megapage or a gigapage.
+pub const fn level_size(level: usize) -> usize {
+    PGSIZE << (9 * level)
+}
+
 #[repr(transparent)]
 #[derive(Debug)]
 pub struct PTE(u64);
@@ -33,6 +39,7 @@ impl PTE {
     pub const W: u64 = 1u64 << 2;
     pub const X: u64 = 1u64 << 3;
     pub const U: u64 = 1u64 << 4; // 1 -> user can access
+    pub const COW: u64 = 1u64 << 8; // copy-on-write (RSW bit)
 
     const fn set_bit(&mut self, b: bool, mask: u64) {
         if b {
@@ -77,6 +84,10 @@ impl PTE {
         self.set_bit(b, Self::U);
     }
 
+    pub const fn set_copy_on_write(&mut self, b: bool) {
+        self.set_bit(b, Self::COW);
+    }
+
     pub const fn is_valid(&self) -> bool {
         self.0 & Self::V != 0
     }
@@ -97,6 +108,16 @@ impl PTE {
         self.0 & Self::U != 0
     }
 
+    // a leaf maps memory; other valid PTEs
+    // point to the next level of the table.
+    pub const fn is_leaf(&self) -> bool {
+        self.is_valid() && self.0 & (Self::R | Self::W | Self::X) != 0
+    }
+
+    pub const fn is_copy_on_write(&self) -> bool {
+        self.0 & Self::COW != 0
+    }
+
     pub const fn set_physical_addr(&mut self, pa: usize) {
         self.0 &= !(!0 << 10 >> 10 >> 10 << 10);
         self.0 |= (pa as u64) >> 12 << 10;
@@ -142,40 +163,76 @@ impl<A: Allocator + Copy> PageTable<A> {
         self.table.as_ptr().addr() as u64
     }
 
+    // Share the parent's memory with the child for fork.
+    // Writable pages become read-only copy-on-write pages in both
+    // page tables; the first store to one of them copies it.
     pub fn copy(&mut self, to: &mut Self, size: usize) -> Result<(), ()> {
         let allocator = self.allocator;
 
         for i in (0..size).step_by(PGSIZE) {
-            let pte = self.search_entry(i, false).unwrap();
-            assert!(pte.is_valid());
-
-            let page = match allocator.allocate(Self::PAGE_LAYOUT) {
-                Ok(mem) => mem,
-                Err(_) => {
-                    to.unmap(0, i / PGSIZE, true);
-                    return Err(());
-                }
+            // pages that have not been faulted in yet stay unmapped
+            // in the child as well.
+            let Ok(pte) = self.search_entry(i, false) else {
+                continue;
             };
+            if !pte.is_valid() {
+                continue;
+            }
+
+            if pte.is_writable() {
+                pte.set_writable(false);
+                pte.set_copy_on_write(true);
+            }
 
             let pa = pte.get_physical_addr();
             let flags = pte.get_flags();
 
+            crate::allocator::share_page(pa);
+
+            if let Err(_) = to.map(i, pa, PGSIZE, flags) {
+                let ptr = NonNull::new(core::ptr::from_exposed_addr_mut(pa)).unwrap();
+                unsafe { allocator.deallocate(ptr, Self::PAGE_LAYOUT) }
+                to.unmap(0, i / PGSIZE, true);
+                return Err(());
+            }
+        }
+
+        Ok(())
+    }
+
+    // Give va its own writable page if it is a copy-on-write page.
+    // The page is copied only if another page table still shares it.
+    pub fn copy_on_write(&mut self, va: usize) -> Result<(), ()> {
+        if va >= MAXVA {
+            return Err(());
+        }
+
+        let allocator = self.allocator;
+        let pte = self.search_entry(pg_rounddown(va), false)?;
+        if !pte.is_valid() || !pte.can_user_access() || !pte.is_copy_on_write() {
+            return Err(());
+        }
+
+        let pa = pte.get_physical_addr();
+        if crate::allocator::page_references(pa) > 1 {
+            let page = allocator.allocate(Self::PAGE_LAYOUT).map_err(|_| ())?;
+            let (ptr, _) = page.to_raw_parts();
+
             unsafe {
                 core::ptr::copy(
                     core::ptr::from_exposed_addr::<u8>(pa),
-                    page.as_ptr().cast(),
+                    ptr.as_ptr().cast(),
                     PGSIZE,
                 )
             };
+            pte.set_physical_addr(ptr.addr().get());
 
-            let (ptr, size) = page.to_raw_parts();
-            if let Err(_) = to.map(i, ptr.addr().get(), size, flags) {
-                unsafe { allocator.deallocate(ptr.cast(), Self::PAGE_LAYOUT) }
-                to.unmap(0, i / PGSIZE, true);
-                return Err(());
-            }
+            let old = NonNull::new(core::ptr::from_exposed_addr_mut(pa)).unwrap();
+            unsafe { allocator.deallocate(old, Self::PAGE_LAYOUT) }
         }
 
+        pte.set_copy_on_write(false);
+        pte.set_writable(true);
         Ok(())
     }
 
@@ -183,15 +240,27 @@ impl<A: Allocator + Copy> PageTable<A> {
     // physical addresses starting at pa. va and size might not
     // be page-aligned. Returns 0 on success, -1 if walk() couldn't
     // allocate a needed page-table page.
+    // Wherever va and pa are aligned to it and enough of the range
+    // is left, a single level-1 or level-2 leaf maps a 2MB megapage
+    // or a 1GB gigapage instead of a page-table page of 4KB leaves.
     pub fn map(&mut self, va: usize, pa: usize, size: usize, flags: u64) -> Result<(), ()> {
         assert!(size > 0);
 
         let mut pa = pa;
         let mut va = pg_rounddown(va);
-        let last = pg_rounddown(va + size - 1);
+        let end = pg_rounddown(va + size - 1) + PGSIZE;
+
+        while va < end {
+            let level = [2, 1]
+                .into_iter()
+                .find(|&level| {
+                    let span = level_size(level);
+                    va % span == 0 && pa % span == 0 && end - va >= span
+                })
+                .unwrap_or(0);
 
-        loop {
-            let pte = self.search_entry(va, true)?;
+            let table = self.search_table(va, level, true)?;
+            let pte = &mut table[PTE::index(level, va)];
 
             assert!(!pte.is_valid());
 
@@ -200,27 +269,28 @@ impl<A: Allocator + Copy> PageTable<A> {
             pte.set_flags(flags);
             pte.set_valid(true);
 
-            if va == last {
-                break;
-            }
-
-            va += PGSIZE;
-            pa += PGSIZE;
+            va += level_size(level);
+            pa += level_size(level);
         }
 
         Ok(())
     }
 
     // Remove npages of mappings starting from va. va must be
-    // page-aligned. The mappings must exist.
+    // page-aligned. Pages that were never mapped, such as
+    // lazily allocated ones, are skipped.
     // Optionally free the physical memory.
     pub fn unmap(&mut self, va: usize, npages: usize, free: bool) {
         assert!(va % PGSIZE == 0);
 
         let allocator = self.allocator;
         for va in (va..).step_by(PGSIZE).take(npages) {
-            let pte = self.search_entry(va, false).unwrap();
-            assert!(pte.is_valid());
+            let Ok(pte) = self.search_entry(va, false) else {
+                continue;
+            };
+            if !pte.is_valid() {
+                continue;
+            }
             assert!(pte.get_flags() != PTE::V);
 
             if free {
@@ -295,16 +365,27 @@ impl<A: Allocator + Copy> PageTable<A> {
     //   21..29 -- 9 bits of level-1 index.
     //   12..20 -- 9 bits of level-0 index.
     //    0..11 -- 12 bits of byte offset within the page.
-    pub fn search_entry(&mut self, va: usize, alloc: bool) -> Result<&mut PTE, ()> {
+    // Return the page-table page at level that maps va,
+    // creating the intermediate pages if alloc is set.
+    // Fails if va lies in a superpage above that level.
+    fn search_table(
+        &mut self,
+        va: usize,
+        level: usize,
+        alloc: bool,
+    ) -> Result<&mut [PTE; 512], ()> {
         assert!(va < MAXVA);
+        assert!(level <= 2);
 
         let mut table = &mut *self.table;
 
-        for level in [2, 1] {
+        for level in ((level + 1)..=2).rev() {
             let index = PTE::index(level, va);
             let pte = &mut table[index];
 
-            if pte.is_valid() {
+            if pte.is_leaf() {
+                return Err(());
+            } else if pte.is_valid() {
                 let nested_table_ptr = pte.get_physical_addr();
                 let nested_table_ptr = core::ptr::from_exposed_addr_mut(nested_table_ptr);
                 table = unsafe { &mut *nested_table_ptr };
@@ -323,15 +404,43 @@ impl<A: Allocator + Copy> PageTable<A> {
             }
         }
 
+        Ok(table)
+    }
+
+    pub fn search_entry(&mut self, va: usize, alloc: bool) -> Result<&mut PTE, ()> {
+        let table = self.search_table(va, 0, alloc)?;
         Ok(&mut table[PTE::index(0, va)])
     }
 
-    pub fn virtual_to_physical(&mut self, va: usize) -> Option<usize> {
+    // Like search_entry, without allocating, but reusing the leaf
+    // page-table page found by the previous call with the same
+    // cursor when va lies in the same region.
+    fn search_entry_at(&mut self, cursor: &mut Cursor, va: usize) -> Option<&mut PTE> {
         if va >= MAXVA {
             return None;
         }
 
-        let pte = self.search_entry(va, false).ok()?;
+        let region = va >> (PGSHIFT + 9);
+        let leaf = match cursor.leaf {
+            Some(leaf) if cursor.region == region => leaf,
+            _ => {
+                let leaf = NonNull::from(self.search_table(va, 0, false).ok()?);
+                cursor.region = region;
+                cursor.leaf = Some(leaf);
+                leaf
+            }
+        };
+
+        // page-table pages are only freed with the whole table.
+        Some(unsafe { &mut (*leaf.as_ptr())[PTE::index(0, va)] })
+    }
+
+    pub fn virtual_to_physical(&mut self, va: usize) -> Option<usize> {
+        self.virtual_to_physical_at(&mut Cursor::new(), va)
+    }
+
+    fn virtual_to_physical_at(&mut self, cursor: &mut Cursor, va: usize) -> Option<usize> {
+        let pte = self.search_entry_at(cursor, va)?;
 
         if !pte.is_valid() {
             return None;
@@ -345,14 +454,31 @@ impl<A: Allocator + Copy> PageTable<A> {
         Some(pte.get_physical_addr())
     }
 
+    // Like virtual_to_physical, but for a store by the kernel:
+    // the page must be writable, and copy-on-write pages are
+    // copied first.
+    fn virtual_to_physical_for_write(&mut self, cursor: &mut Cursor, va: usize) -> Option<usize> {
+        let pte = self.search_entry_at(cursor, va)?;
+        if pte.is_valid() && pte.can_user_access() && !pte.is_writable() {
+            self.copy_on_write(va).ok()?;
+        }
+
+        let pte = self.search_entry_at(cursor, va)?;
+        if !pte.is_writable() {
+            return None;
+        }
+        self.virtual_to_physical_at(cursor, va)
+    }
+
     pub unsafe fn write<T: ?Sized>(&mut self, mut dst_va: usize, src: &T) -> Result<(), usize> {
         let src_size = core::mem::size_of_val(src);
+        let mut cursor = Cursor::new();
 
         let mut copied = 0;
         while copied < src_size {
             let va0 = pg_rounddown(dst_va);
 
-            let Some(pa0) = self.virtual_to_physical(va0) else {
+            let Some(pa0) = self.virtual_to_physical_for_write(&mut cursor, va0) else {
                 return Err(copied);
             };
 
@@ -361,7 +487,7 @@ impl<A: Allocator + Copy> PageTable<A> {
             let bytes = (PGSIZE - offset).min(remain);
 
             unsafe {
-                core::ptr::copy(
+                core::ptr::copy_nonoverlapping(
                     <*const T>::cast::<u8>(src).add(copied),
                     core::ptr::from_exposed_addr_mut::<u8>(pa0 + offset),
                     bytes,
@@ -376,12 +502,13 @@ impl<A: Allocator + Copy> PageTable<A> {
 
     pub unsafe fn read<T: ?Sized>(&mut self, dst: &mut T, mut src_va: usize) -> Result<(), usize> {
         let dst_size = core::mem::size_of_val(dst);
+        let mut cursor = Cursor::new();
 
         let mut copied = 0;
         while copied < dst_size {
             let va0 = pg_rounddown(src_va);
 
-            let Some(pa0) = self.virtual_to_physical(va0) else {
+            let Some(pa0) = self.virtual_to_physical_at(&mut cursor, va0) else {
                 return Err(copied);
             };
 
@@ -389,7 +516,7 @@ impl<A: Allocator + Copy> PageTable<A> {
             let remain = dst_size - copied;
             let bytes = (PGSIZE - offset).min(remain);
 
-            core::ptr::copy(
+            core::ptr::copy_nonoverlapping(
                 core::ptr::from_exposed_addr::<u8>(pa0 + offset),
                 <*mut T>::cast::<u8>(dst).add(copied),
                 bytes,
@@ -401,34 +528,80 @@ impl<A: Allocator + Copy> PageTable<A> {
         Ok(())
     }
 
-    // Copy a null-terminated string
-    pub unsafe fn read_cstr(&mut self, dst: &mut [u8], src_va: usize) -> Result<usize, ()> {
+    // Copy a null-terminated string.
+    // On failure, returns how many bytes were read before an
+    // unmapped page, or dst.len() if the string is too long.
+    pub unsafe fn read_cstr(&mut self, dst: &mut [u8], src_va: usize) -> Result<usize, usize> {
+        let mut cursor = Cursor::new();
+
         let mut read = 0;
         let mut src_va = src_va;
         while read < dst.len() {
             let va0 = pg_rounddown(src_va);
-            let Some(pa0) = self.virtual_to_physical(va0) else {
-                return Err(());
+            let Some(pa0) = self.virtual_to_physical_at(&mut cursor, va0) else {
+                return Err(read);
             };
 
             let offset = src_va - va0;
             let n = (PGSIZE - offset).min(dst.len() - read);
 
             let src = core::ptr::from_exposed_addr::<u8>(pa0 + offset);
-            for i in 0..n {
-                let c = *src.add(i);
-                dst[read + i] = c;
-
-                if c == 0 {
-                    return Ok(read + i);
-                }
+            if let Some(len) = copy_until_nul(&mut dst[read..(read + n)], src) {
+                return Ok(read + len);
             }
 
             read += n;
             src_va = va0 + PGSIZE;
         }
-        Err(())
+        Err(read)
+    }
+}
+
+// Remembers the leaf page-table page of the last translation,
+// so that walking a contiguous range of virtual addresses only
+// goes down from the root once per 2MB region.
+struct Cursor {
+    region: usize, // va >> 21 of the region leaf maps
+    leaf: Option<NonNull<[PTE; 512]>>,
+}
+
+impl Cursor {
+    const fn new() -> Self {
+        Self {
+            region: 0,
+            leaf: None,
+        }
+    }
+}
+
+// Copy bytes from src to dst up to and including the first nul,
+// a word at a time where src is aligned.
+// Returns the length of the string, or None if dst filled up first.
+unsafe fn copy_until_nul(dst: &mut [u8], src: *const u8) -> Option<usize> {
+    const WORD: usize = core::mem::size_of::<u64>();
+    const ONES: u64 = u64::from_ne_bytes([0x01; WORD]);
+    const HIGHS: u64 = u64::from_ne_bytes([0x80; WORD]);
+
+    let mut i = 0;
+    while i < dst.len() {
+        if src.add(i).addr() % WORD == 0 && dst.len() - i >= WORD {
+            let word = src.add(i).cast::<u64>().read();
+            // a word has a zero byte iff this is non-zero.
+            if word.wrapping_sub(ONES) & !word & HIGHS == 0 {
+                dst[i..(i + WORD)].copy_from_slice(&word.to_ne_bytes());
+                i += WORD;
+                continue;
+            }
+        }
+
+        let c = *src.add(i);
+        dst[i] = c;
+        if c == 0 {
+            return Some(i);
+        }
+        i += 1;
     }
+    None
 }
 
 impl<A: Allocator + Copy> Drop for PageTable<A> {
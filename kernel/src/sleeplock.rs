@@ -37,6 +37,17 @@ impl<T> SleepLock<T> {
         SleepLockGuard::new(self)
     }
 
+    // acquire the lock only if nobody holds it.
+    pub fn try_lock(&'static self) -> Option<SleepLockGuard<T>> {
+        let mut inner = self.inner.lock();
+        if inner.locked {
+            return None;
+        }
+        inner.locked = true;
+
+        Some(SleepLockGuard::new(self))
+    }
+
     unsafe fn unlock(&'static self) {
         let mut inner = self.inner.lock();
         inner.locked = false;
@@ -1,31 +1,201 @@
 use core::{
     cell::UnsafeCell,
     ops::{Deref, DerefMut},
-    sync::atomic::{AtomicBool, AtomicUsize, Ordering::*},
+    ptr::null_mut,
+    sync::atomic::{AtomicBool, AtomicPtr, AtomicU64, AtomicUsize, Ordering::*},
 };
 
-use crate::{cpu, interrupt};
+#[cfg(feature = "ticket-lock")]
+use core::sync::atomic::AtomicU32;
+
+use crate::{config::NLOCKSTAT, cpu, interrupt, riscv};
+
+/// ロックの競合状況の統計
+///
+/// 名前を付けたロックについてだけ集計し、`procdump`で表示する。
+#[derive(Debug)]
+struct Statistics {
+    name: Option<&'static str>,
+    acquires: AtomicU64,
+    spins: AtomicU64,
+    max_hold: AtomicU64,
+    acquired_at: AtomicU64,
+    registered: AtomicBool,
+}
+
+impl Statistics {
+    const fn new(name: Option<&'static str>) -> Self {
+        Self {
+            name,
+            acquires: AtomicU64::new(0),
+            spins: AtomicU64::new(0),
+            max_hold: AtomicU64::new(0),
+            acquired_at: AtomicU64::new(0),
+            registered: AtomicBool::new(false),
+        }
+    }
+
+    /// ロックを取得したときに呼ぶ。`spins`は待っていた間の試行回数。
+    fn acquired(&'static self, spins: u64) {
+        self.acquires.fetch_add(1, Relaxed);
+        self.spins.fetch_add(spins, Relaxed);
+        self.acquired_at.store(now(), Relaxed);
+
+        if !self.registered.swap(true, Relaxed) {
+            register(self);
+        }
+    }
+
+    /// ロックを解放する直前に呼ぶ。
+    fn released(&self) {
+        let held = now().wrapping_sub(self.acquired_at.load(Relaxed));
+        self.max_hold.fetch_max(held, Relaxed);
+    }
+}
+
+fn now() -> u64 {
+    unsafe { riscv::read_csr!(time) }
+}
+
+static REGISTRY: [AtomicPtr<Statistics>; NLOCKSTAT] = [const { AtomicPtr::new(null_mut()) }; _];
+static REGISTERED: AtomicUsize = AtomicUsize::new(0);
+
+/// 統計を表示する対象に加える。入りきらないものは無視する。
+fn register(statistics: &'static Statistics) {
+    let index = REGISTERED.fetch_add(1, Relaxed);
+    if let Some(slot) = REGISTRY.get(index) {
+        slot.store(statistics as *const _ as *mut _, Release);
+    }
+}
+
+/// 名前付きのロックの統計を表示する。
+/// 時間は`time`CSRの単位で表す。
+pub fn dump() {
+    for slot in REGISTRY.iter() {
+        let Some(statistics) = (unsafe { slot.load(Acquire).as_ref() }) else {
+            continue;
+        };
+
+        crate::println!(
+            "lock {}: acquires={} spins={} max hold={}",
+            statistics.name.unwrap_or("?"),
+            statistics.acquires.load(Relaxed),
+            statistics.spins.load(Relaxed),
+            statistics.max_hold.load(Relaxed),
+        );
+    }
+}
 
 #[derive(Debug)]
 pub struct SpinLock<T> {
+    #[cfg(not(feature = "ticket-lock"))]
     locked: AtomicBool,
+
+    // a ticket lock hands the lock to waiters
+    // in the order they arrived.
+    #[cfg(feature = "ticket-lock")]
+    next: AtomicU32, // next ticket to give out
+    #[cfg(feature = "ticket-lock")]
+    serving: AtomicU32, // ticket of the holder
+
     value: UnsafeCell<T>,
     cpuid: AtomicUsize,
+    statistics: Statistics,
 }
 
 impl<T> SpinLock<T> {
     pub const fn new(value: T) -> Self {
+        Self::with_statistics(value, Statistics::new(None))
+    }
+
+    // A lock whose contention is counted and
+    // shown by procdump under name.
+    pub const fn named(name: &'static str, value: T) -> Self {
+        Self::with_statistics(value, Statistics::new(Some(name)))
+    }
+
+    const fn with_statistics(value: T, statistics: Statistics) -> Self {
         Self {
+            #[cfg(not(feature = "ticket-lock"))]
             locked: AtomicBool::new(false),
+            #[cfg(feature = "ticket-lock")]
+            next: AtomicU32::new(0),
+            #[cfg(feature = "ticket-lock")]
+            serving: AtomicU32::new(0),
             value: UnsafeCell::new(value),
             cpuid: AtomicUsize::new(usize::MAX),
+            statistics,
         }
     }
 
+    #[cfg(not(feature = "ticket-lock"))]
     pub fn is_locked(&self) -> bool {
         self.locked.load(Acquire)
     }
 
+    #[cfg(feature = "ticket-lock")]
+    pub fn is_locked(&self) -> bool {
+        self.next.load(Acquire) != self.serving.load(Acquire)
+    }
+
+    // Spin until the lock is ours.
+    // Returns how many times it had to wait.
+    #[cfg(not(feature = "ticket-lock"))]
+    fn acquire(&self) -> u64 {
+        let mut spins = 0;
+
+        // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
+        //   a5 = 1
+        //   s1 = &lk->locked
+        //   amoswap.w.aq a5, a5, (s1)
+        while self
+            .locked
+            .compare_exchange(false, true, Acquire, Relaxed)
+            .is_err()
+        {
+            // wait with plain loads until the lock looks free,
+            // so that waiters don't keep stealing the cache line.
+            while self.locked.load(Relaxed) {
+                spins += 1;
+                core::hint::spin_loop();
+            }
+        }
+
+        spins
+    }
+
+    #[cfg(feature = "ticket-lock")]
+    fn acquire(&self) -> u64 {
+        let mut spins = 0;
+
+        let ticket = self.next.fetch_add(1, Relaxed);
+        while self.serving.load(Acquire) != ticket {
+            spins += 1;
+            core::hint::spin_loop();
+        }
+
+        spins
+    }
+
+    #[cfg(not(feature = "ticket-lock"))]
+    fn release(&self) {
+        // Release the lock, equivalent to lk->locked = 0.
+        // This code doesn't use a C assignment, since the C standard
+        // implies that an assignment might be implemented with
+        // multiple store instructions.
+        // On RISC-V, sync_lock_release turns into an atomic swap:
+        //   s1 = &lk->locked
+        //   amoswap.w zero, zero, (s1)
+        self.locked.store(false, Release);
+    }
+
+    #[cfg(feature = "ticket-lock")]
+    fn release(&self) {
+        // only the holder changes serving.
+        let ticket = self.serving.load(Relaxed);
+        self.serving.store(ticket.wrapping_add(1), Release);
+    }
+
     pub fn is_held_by_current_cpu(&self) -> bool {
         assert!(!interrupt::is_enabled());
 
@@ -40,15 +210,7 @@ impl<T> SpinLock<T> {
         // 1つのCPUが2度ロックすることはできない
         assert!(!self.is_held_by_current_cpu());
 
-        // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
-        //   a5 = 1
-        //   s1 = &lk->locked
-        //   amoswap.w.aq a5, a5, (s1)
-        while self
-            .locked
-            .compare_exchange(false, true, Acquire, Relaxed)
-            .is_err()
-        {}
+        let spins = self.acquire();
 
         // Tell the Rust compiler and the processor to not move loads or stores
         // past this point, to ensure that the critical section's memory
@@ -60,6 +222,12 @@ impl<T> SpinLock<T> {
         // Record info about lock acquisition for holding() and debugging.
         self.cpuid.store(cpu::id(), Release);
 
+        if self.statistics.name.is_some() {
+            // named locks are statics.
+            let statistics = unsafe { &*core::ptr::addr_of!(self.statistics) };
+            statistics.acquired(spins);
+        }
+
         SpinLockGuard::new(self)
     }
 
@@ -67,6 +235,10 @@ impl<T> SpinLock<T> {
         // 同じCPUによってロックされているかチェック
         assert!(self.is_held_by_current_cpu());
 
+        if self.statistics.name.is_some() {
+            self.statistics.released();
+        }
+
         self.cpuid.store(usize::MAX, Release);
 
         // Tell the C compiler and the CPU to not move loads or stores
@@ -78,14 +250,7 @@ impl<T> SpinLock<T> {
         // TODO: Orderingは正しいのか?
         core::sync::atomic::fence(Release);
 
-        // Release the lock, equivalent to lk->locked = 0.
-        // This code doesn't use a C assignment, since the C standard
-        // implies that an assignment might be implemented with
-        // multiple store instructions.
-        // On RISC-V, sync_lock_release turns into an atomic swap:
-        //   s1 = &lk->locked
-        //   amoswap.w zero, zero, (s1)
-        self.locked.store(false, Release);
+        self.release();
 
         interrupt::pop_off();
     }
@@ -3,7 +3,7 @@ use core::arch::asm;
 use crate::{
     config::{ENTRY_STACKSIZE, NCPU},
     memory_layout::{clint_mtimecmp, symbol_addr, CLINT_MTIME},
-    riscv::{mie, mstatus, read_csr, sie, write_csr, write_reg},
+    riscv::{mcounteren, mie, mstatus, read_csr, sie, write_csr, write_reg},
 };
 
 #[repr(C, align(16))]
@@ -50,6 +50,9 @@ unsafe extern "C" fn start() {
     write_csr!(pmpaddr0, 0x3fffffffffffffu64);
     write_csr!(pmpcfg0, 0xf);
 
+    // let supervisor mode read the time counter.
+    write_csr!(mcounteren, read_csr!(mcounteren) | mcounteren::TM);
+
     // ask for clock interrupts.
     initialize_timer();
 
@@ -6,19 +6,21 @@ use arrayvec::ArrayVec;
 use crate::filesystem::inode::InodeKind;
 use crate::{
     allocator, clock,
-    config::{MAXARG, MAXPATH, NDEV},
+    config::{MAXARG, MAXIOV, MAXPATH, MAXPIPESIZE, NDEV, PIPESIZE},
     exec::execute,
     file::File,
     filesystem::log,
     fs::{self, InodeGuard},
+    memory_layout::TRAPFRAME,
     pipe::Pipe,
-    process,
-    riscv::paging::{PGSIZE, PTE},
+    process, profile,
+    riscv::paging::PGSIZE,
+    trace,
 };
 
 pub unsafe fn read_string_from_process_memory(addr: usize, buffer: &mut [u8]) -> Result<usize, ()> {
     let process = process::context().unwrap();
-    process.pagetable.read_cstr(buffer, addr)
+    process.copy_in_str(buffer, addr)
 }
 
 fn arg_raw<const N: usize>() -> u64 {
@@ -58,6 +60,26 @@ fn arg_fd<const N: usize>() -> Result<(usize, &'static Arc<File>), ()> {
     Ok((fd, f))
 }
 
+// an element of the buffer arrays of readv() and writev().
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct IoVec {
+    base: usize,
+    len: usize,
+}
+
+fn arg_iovec<const N: usize, const C: usize>() -> Result<ArrayVec<IoVec, MAXIOV>, ()> {
+    let addr = arg_usize::<N>();
+    let count = arg_usize::<C>();
+    if count > MAXIOV {
+        return Err(());
+    }
+
+    (0..count)
+        .map(|i| process::read_memory::<IoVec>(addr + i * core::mem::size_of::<IoVec>()).ok_or(()))
+        .collect()
+}
+
 fn fdalloc(f: Arc<File>) -> Result<usize, ()> {
     let context = process::context().ok_or(())?;
     for (fd, file) in context.ofile.iter_mut().enumerate() {
@@ -69,17 +91,52 @@ fn fdalloc(f: Arc<File>) -> Result<usize, ()> {
     Err(())
 }
 
+pub const NSYSCALL: usize = 31;
+
 #[inline(always)]
 pub unsafe fn syscall(index: usize) -> Result<u64, ()> {
-    static LOOKUP: [fn() -> Result<u64, ()>; 21] = [
-        sys_fork, sys_exit, sys_wait, sys_pipe, sys_read, sys_kill, sys_exec, sys_fstat, sys_chdir,
-        sys_dup, sys_getpid, sys_sbrk, sys_sleep, sys_uptime, sys_open, sys_write, sys_mknod,
-        sys_unlink, sys_link, sys_mkdir, sys_close,
+    static LOOKUP: [fn() -> Result<u64, ()>; NSYSCALL] = [
+        sys_fork,
+        sys_exit,
+        sys_wait,
+        sys_pipe,
+        sys_read,
+        sys_kill,
+        sys_exec,
+        sys_fstat,
+        sys_chdir,
+        sys_dup,
+        sys_getpid,
+        sys_sbrk,
+        sys_sleep,
+        sys_uptime,
+        sys_open,
+        sys_write,
+        sys_mknod,
+        sys_unlink,
+        sys_link,
+        sys_mkdir,
+        sys_close,
+        sys_pipesize,
+        sys_splice,
+        sys_uptimens,
+        sys_trace,
+        sys_profile,
+        sys_readv,
+        sys_writev,
+        sys_pread,
+        sys_pwrite,
+        sys_mount,
     ];
 
     match index {
         0 => Err(()),
-        i @ 1..=21 => LOOKUP[i - 1](),
+        i @ 1..=NSYSCALL => {
+            let start = trace::now();
+            let result = LOOKUP[i - 1]();
+            trace::syscall(i, start);
+            result
+        }
         _ => Err(()),
     }
 }
@@ -104,6 +161,13 @@ fn sys_wait() -> Result<u64, ()> {
         addr => Some(addr),
     };
 
+    // the status is written while holding locks,
+    // so fault its page in beforehand.
+    if let Some(addr) = addr {
+        let context = process::context().unwrap();
+        context.populate(addr, core::mem::size_of::<i32>())?;
+    }
+
     unsafe { process::wait(addr).map(|pid| pid as u64).ok_or(()) }
 }
 
@@ -114,8 +178,13 @@ fn sys_sbrk() -> Result<u64, ()> {
     let size_old = context.sz;
     let size_new = context.sz.wrapping_add_signed(n);
 
+    // only reserve the address space.
+    // pages are allocated when they are first touched.
     if n > 0 {
-        context.sz = context.pagetable.grow(size_old, size_new, PTE::W)?;
+        if size_new < size_old || size_new > TRAPFRAME {
+            return Err(());
+        }
+        context.sz = size_new;
     }
     if n < 0 {
         context.sz = context.pagetable.shrink(size_old, size_new)?;
@@ -141,6 +210,11 @@ fn sys_uptime() -> Result<u64, ()> {
     Ok(clock::get())
 }
 
+// nanoseconds since boot, finer than uptime()'s ticks.
+fn sys_uptimens() -> Result<u64, ()> {
+    Ok(clock::nanoseconds())
+}
+
 fn sys_dup() -> Result<u64, ()> {
     let (_, f) = arg_fd::<0>()?;
     let fd = fdalloc(f.clone())?;
@@ -151,6 +225,11 @@ fn sys_read() -> Result<u64, ()> {
     let (_, f) = arg_fd::<0>()?;
     let addr = arg_usize::<1>();
     let n = arg_usize::<2>();
+
+    // file and pipe reads copy out while holding locks,
+    // so fault the buffer in beforehand.
+    process::context().unwrap().populate(addr, n)?;
+
     let result = f.read(addr, n);
     result.map(|read| read as u64)
 }
@@ -160,10 +239,76 @@ fn sys_write() -> Result<u64, ()> {
 
     let addr = arg_usize::<1>();
     let n = arg_usize::<2>();
+
+    // likewise, writes copy in while holding locks.
+    process::context().unwrap().populate(addr, n)?;
+
     let result = f.write(addr, n);
     result.map(|wrote| wrote as u64)
 }
 
+// Move data for each buffer of a readv() or writev() in turn,
+// stopping at the first short transfer. An error after some
+// data has moved reports the amount moved so far.
+fn vectored(
+    iov: &[IoVec],
+    mut f: impl FnMut(usize, usize) -> Result<usize, ()>,
+) -> Result<u64, ()> {
+    let context = process::context().unwrap();
+    let mut total = 0;
+    for v in iov {
+        // like read and write, fault the buffer in beforehand.
+        let moved = context
+            .populate(v.base, v.len)
+            .and_then(|_| f(v.base, v.len));
+        let moved = match moved {
+            Ok(moved) => moved,
+            Err(_) if total > 0 => break,
+            Err(_) => return Err(()),
+        };
+
+        total += moved;
+        if moved < v.len {
+            break;
+        }
+    }
+    Ok(total as u64)
+}
+
+fn sys_readv() -> Result<u64, ()> {
+    let (_, f) = arg_fd::<0>()?;
+    let iov = arg_iovec::<1, 2>()?;
+    vectored(&iov, |addr, n| f.read(addr, n))
+}
+
+fn sys_writev() -> Result<u64, ()> {
+    let (_, f) = arg_fd::<0>()?;
+    let iov = arg_iovec::<1, 2>()?;
+    vectored(&iov, |addr, n| f.write(addr, n))
+}
+
+// Read at an explicit offset, leaving the file's offset alone.
+fn sys_pread() -> Result<u64, ()> {
+    let (_, f) = arg_fd::<0>()?;
+    let addr = arg_usize::<1>();
+    let n = arg_usize::<2>();
+    let offset = arg_usize::<3>();
+
+    process::context().unwrap().populate(addr, n)?;
+    f.read_at(addr, n, offset).map(|read| read as u64)
+}
+
+// Write at an explicit offset, leaving the file's offset alone.
+fn sys_pwrite() -> Result<u64, ()> {
+    let (_, f) = arg_fd::<0>()?;
+    let addr = arg_usize::<1>();
+    let n = arg_usize::<2>();
+    let offset = arg_usize::<3>();
+
+    process::context().unwrap().populate(addr, n)?;
+    f.write_at(addr, n, offset).map(|wrote| wrote as u64)
+}
+
 fn sys_close() -> Result<u64, ()> {
     let (fd, _) = arg_fd::<0>()?;
     let context = process::context().unwrap();
@@ -171,6 +316,15 @@ fn sys_close() -> Result<u64, ()> {
     Ok(0)
 }
 
+// Move up to n bytes from fd_in to fd_out inside the kernel.
+fn sys_splice() -> Result<u64, ()> {
+    let (_, from) = arg_fd::<0>()?;
+    let (_, to) = arg_fd::<1>()?;
+    let n = arg_usize::<2>();
+
+    from.splice(to, n).map(|moved| moved as u64)
+}
+
 fn sys_fstat() -> Result<u64, ()> {
     let (_, f) = arg_fd::<0>()?;
     let addr = arg_usize::<1>();
@@ -180,7 +334,7 @@ fn sys_fstat() -> Result<u64, ()> {
         return Err(())
     };
 
-    match unsafe { context.pagetable.write(addr, &stat) } {
+    match unsafe { context.copy_out(addr, &stat) } {
         Ok(_) => Ok(0),
         Err(_) => Err(()),
     }
@@ -270,6 +424,13 @@ fn sys_mknod() -> Result<u64, ()> {
     fs::make_special_file(path, major as u16, minor as u16).and(Ok(0))
 }
 
+fn sys_mount() -> Result<u64, ()> {
+    let device = arg_usize::<0>();
+    let mut path = [0u8; MAXPATH];
+    let path = arg_string::<1>(&mut path)?;
+    fs::mount(device, path).and(Ok(0))
+}
+
 fn sys_chdir() -> Result<u64, ()> {
     let mut path = [0u8; MAXPATH];
     let path = arg_string::<0>(&mut path)?;
@@ -311,17 +472,21 @@ fn sys_exec() -> Result<u64, ()> {
             break;
         }
 
-        let Some(mem) = allocator::get().lock().allocate_page() else {
+        let Some(mem) = allocator::allocate_page() else {
             return Err(());
         };
 
         let buffer = unsafe { core::slice::from_raw_parts_mut(mem.as_ptr(), PGSIZE) };
-        if unsafe { read_string_from_process_memory(addr, buffer).is_err() } {
-            allocator::get().lock().deallocate_page(mem);
+        let len = unsafe { read_string_from_process_memory(addr, buffer) };
+
+        // copy the argument out so that it is sized to the string, not the page.
+        let arg = len.map(|len| CString::new(&buffer[..len]).unwrap());
+        allocator::deallocate_page(mem);
+
+        let Ok(arg) = arg else {
             return Err(());
-        }
+        };
 
-        let arg = unsafe { CString::from_raw(buffer.as_mut_ptr().cast()) };
         if argv.try_push(arg).is_err() {
             return Err(());
         }
@@ -335,7 +500,7 @@ fn sys_pipe() -> Result<u64, ()> {
 
     let context = process::context().unwrap();
 
-    let Some((read, write)) = Pipe::allocate() else {
+    let Some((read, write)) = Pipe::allocate(PIPESIZE) else {
         return Err(());
     };
 
@@ -353,7 +518,7 @@ fn sys_pipe() -> Result<u64, ()> {
 
     let pair = [fd0 as u32, fd1 as u32];
 
-    if unsafe { context.pagetable.write(fdarray, &pair).is_err() } {
+    if unsafe { context.copy_out(fdarray, &pair).is_err() } {
         context.ofile[fd0] = None;
         context.ofile[fd1] = None;
         return Err(());
@@ -361,3 +526,40 @@ fn sys_pipe() -> Result<u64, ()> {
 
     Ok(0)
 }
+
+// Change the capacity of a pipe to n bytes.
+// Either end of the pipe may be passed.
+fn sys_pipesize() -> Result<u64, ()> {
+    let (_, f) = arg_fd::<0>()?;
+    let n = arg_usize::<1>();
+
+    if n == 0 || n > MAXPIPESIZE {
+        return Err(());
+    }
+
+    let File::Pipe { pipe } = &**f else {
+        return Err(());
+    };
+    pipe.resize(n)?;
+
+    Ok(n as u64)
+}
+
+// Copy kernel trace data of the given kind to addr,
+// up to n bytes. Returns the number of bytes copied.
+fn sys_trace() -> Result<u64, ()> {
+    let what = arg_usize::<0>();
+    let addr = arg_usize::<1>();
+    let n = arg_usize::<2>();
+
+    trace::copy_out(what, addr, n).map(|copied| copied as u64)
+}
+
+// Start or stop the sampling profiler, or read its samples.
+fn sys_profile() -> Result<u64, ()> {
+    let op = arg_usize::<0>();
+    let addr = arg_usize::<1>();
+    let n = arg_usize::<2>();
+
+    profile::control(op, addr, n).map(|copied| copied as u64)
+}
@@ -0,0 +1,247 @@
+// kernel tracing.
+//
+// each CPU logs events into its own ring of NTRACE records.
+// only that CPU writes its ring, with interrupts off, so
+// logging takes no locks. a reader copies a record and then
+// checks that its sequence number did not change meanwhile,
+// which skips records that were overwritten under it.
+//
+// system calls and disk requests also feed latency histograms,
+// with a bucket per power of two of time CSR ticks, and traps
+// are counted by cause. the trace() system call reads it all.
+
+use core::sync::atomic::{fence, AtomicU64, Ordering::*};
+
+use crate::{
+    config::{NCPU, NTRACE},
+    cpu, interrupt, process, riscv,
+    syscall::NSYSCALL,
+};
+
+// kinds of events.
+pub const SYSCALL: u64 = 1; // a0 = system call number, a1 = latency
+pub const SWITCH: u64 = 2; // a0 = pid of the process switched to
+pub const DISK: u64 = 3; // a0 = block, a1 = latency
+
+// what trace() reads out.
+pub const EVENTS: usize = 0; // recent Events of every CPU
+pub const SYSCALLS: usize = 1; // a Summary per system call number
+pub const DISK_LATENCY: usize = 2; // a Summary of disk requests
+pub const TRAPS: usize = 3; // trap counts by cause, kernel then user
+
+pub const NBUCKET: usize = 32;
+
+// exception codes, then interrupt codes.
+pub const NCAUSE: usize = 32;
+
+// an event as trace() copies it out.
+// times are in ticks of the time CSR.
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub struct Event {
+    pub time: u64,
+    pub cpu: u64,
+    pub kind: u64,
+    pub a0: u64,
+    pub a1: u64,
+}
+
+struct Record {
+    sequence: AtomicU64, // 0 while being written
+    time: AtomicU64,
+    kind: AtomicU64,
+    a0: AtomicU64,
+    a1: AtomicU64,
+}
+
+impl Record {
+    const fn new() -> Self {
+        Self {
+            sequence: AtomicU64::new(0),
+            time: AtomicU64::new(0),
+            kind: AtomicU64::new(0),
+            a0: AtomicU64::new(0),
+            a1: AtomicU64::new(0),
+        }
+    }
+}
+
+struct Ring {
+    head: AtomicU64, // number of records ever written
+    records: [Record; NTRACE],
+}
+
+static RINGS: [Ring; NCPU] = [const {
+    Ring {
+        head: AtomicU64::new(0),
+        records: [const { Record::new() }; _],
+    }
+}; _];
+
+// a histogram as trace() copies it out.
+// bucket i counts values below 2^i and not below 2^(i-1).
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub struct Summary {
+    pub count: u64,
+    pub total: u64,
+    pub buckets: [u64; NBUCKET],
+}
+
+struct Histogram {
+    count: AtomicU64,
+    total: AtomicU64,
+    buckets: [AtomicU64; NBUCKET],
+}
+
+impl Histogram {
+    const fn new() -> Self {
+        Self {
+            count: AtomicU64::new(0),
+            total: AtomicU64::new(0),
+            buckets: [const { AtomicU64::new(0) }; _],
+        }
+    }
+
+    fn add(&self, value: u64) {
+        let bucket = ((u64::BITS - value.leading_zeros()) as usize).min(NBUCKET - 1);
+        self.count.fetch_add(1, Relaxed);
+        self.total.fetch_add(value, Relaxed);
+        self.buckets[bucket].fetch_add(1, Relaxed);
+    }
+
+    fn summary(&self) -> Summary {
+        Summary {
+            count: self.count.load(Relaxed),
+            total: self.total.load(Relaxed),
+            buckets: core::array::from_fn(|i| self.buckets[i].load(Relaxed)),
+        }
+    }
+}
+
+static SYSCALLS_LATENCY: [Histogram; NSYSCALL + 1] = [const { Histogram::new() }; _];
+static DISK_HISTOGRAM: Histogram = Histogram::new();
+static TRAP_COUNTS: [[AtomicU64; NCAUSE]; 2] = [const { [const { AtomicU64::new(0) }; _] }; _];
+
+pub fn now() -> u64 {
+    unsafe { riscv::read_csr!(time) }
+}
+
+fn log(kind: u64, a0: u64, a1: u64) {
+    interrupt::off(|| {
+        let ring = &RINGS[cpu::id()];
+        let n = ring.head.load(Relaxed);
+        let record = &ring.records[n as usize % NTRACE];
+
+        record.sequence.store(0, Relaxed);
+        fence(Release);
+        record.time.store(now(), Relaxed);
+        record.kind.store(kind, Relaxed);
+        record.a0.store(a0, Relaxed);
+        record.a1.store(a1, Relaxed);
+        record.sequence.store(n + 1, Release);
+
+        ring.head.store(n + 1, Release);
+    });
+}
+
+// A system call that started at start has returned.
+pub fn syscall(number: usize, start: u64) {
+    let latency = now().wrapping_sub(start);
+    if let Some(histogram) = SYSCALLS_LATENCY.get(number) {
+        histogram.add(latency);
+    }
+    log(SYSCALL, number as u64, latency);
+}
+
+// The scheduler is about to run pid.
+pub fn switch(pid: usize) {
+    log(SWITCH, pid as u64, 0);
+}
+
+// A disk request for block, submitted at start, has finished.
+pub fn disk(block: usize, start: u64) {
+    let latency = now().wrapping_sub(start);
+    DISK_HISTOGRAM.add(latency);
+    log(DISK, block as u64, latency);
+}
+
+// Count a trap by its scause.
+pub fn trap(scause: u64, user: bool) {
+    let code = (scause & 0xf) as usize;
+    let cause = if scause >> 63 != 0 { 16 + code } else { code };
+    TRAP_COUNTS[user as usize][cause].fetch_add(1, Relaxed);
+}
+
+// Call f with each event still in the rings, oldest first for
+// each CPU, until it returns false.
+fn events(mut f: impl FnMut(&Event) -> bool) {
+    for (cpu, ring) in RINGS.iter().enumerate() {
+        let head = ring.head.load(Acquire);
+        for n in head.saturating_sub(NTRACE as u64)..head {
+            let record = &ring.records[n as usize % NTRACE];
+
+            let sequence = record.sequence.load(Acquire);
+            let event = Event {
+                time: record.time.load(Relaxed),
+                cpu: cpu as u64,
+                kind: record.kind.load(Relaxed),
+                a0: record.a0.load(Relaxed),
+                a1: record.a1.load(Relaxed),
+            };
+            fence(Acquire);
+            if sequence != n + 1 || record.sequence.load(Relaxed) != sequence {
+                continue;
+            }
+
+            if !f(&event) {
+                return;
+            }
+        }
+    }
+}
+
+// Copy out what as an array of T to user address addr,
+// as many whole elements as fit in n bytes.
+// Returns the number of bytes copied.
+pub fn copy_out(what: usize, addr: usize, n: usize) -> Result<usize, ()> {
+    let context = process::context().ok_or(())?;
+    let mut copied = 0;
+    let mut copy = |value: &[u8]| {
+        if copied + value.len() > n {
+            return false;
+        }
+        if unsafe { context.copy_out(addr + copied, value) }.is_err() {
+            return false;
+        }
+        copied += value.len();
+        true
+    };
+
+    fn bytes<T>(value: &T) -> &[u8] {
+        unsafe {
+            core::slice::from_raw_parts(value as *const T as *const u8, core::mem::size_of::<T>())
+        }
+    }
+
+    match what {
+        EVENTS => events(|event| copy(bytes(event))),
+        SYSCALLS => {
+            let _ = SYSCALLS_LATENCY
+                .iter()
+                .all(|histogram| copy(bytes(&histogram.summary())));
+        }
+        DISK_LATENCY => {
+            copy(bytes(&DISK_HISTOGRAM.summary()));
+        }
+        TRAPS => {
+            let _ = TRAP_COUNTS
+                .iter()
+                .flatten()
+                .all(|count| copy(bytes(&count.load(Relaxed))));
+        }
+        _ => return Err(()),
+    }
+
+    Ok(copied)
+}
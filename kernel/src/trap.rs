@@ -1,10 +1,11 @@
 use crate::{
     clock, cpu,
-    memory_layout::{symbol_addr, TRAMPOLINE, UART0_IRQ, VIRTIO0_IRQ},
+    memory_layout::{symbol_addr, NVIRTIO, TRAMPOLINE, UART0_IRQ, VIRTIO0_IRQ},
     plic::{plic_claim, plic_complete},
-    println, process,
+    println, process, profile,
     riscv::{self, paging::PGSIZE, read_csr, read_reg, satp::make_satp, sstatus, write_csr},
     syscall::syscall,
+    trace,
     uart::uartintr,
     virtio,
 };
@@ -36,6 +37,7 @@ extern "C" fn usertrap() {
     let mut which_device = 0;
 
     let cause = unsafe { read_csr!(scause) };
+    trace::trap(cause as u64, true);
     if cause == 8 {
         // system call
 
@@ -53,6 +55,27 @@ extern "C" fn usertrap() {
 
         let index = context.trapframe.a7 as usize;
         context.trapframe.a0 = unsafe { syscall(index).unwrap_or(u64::MAX) };
+    } else if cause == 12 || cause == 13 || cause == 15 {
+        // page fault.
+        // a store may hit a shared copy-on-write page; otherwise
+        // the page may not have been faulted in yet.
+        let va = unsafe { read_csr!(stval) };
+
+        // reading the page from the executable may sleep.
+        unsafe { riscv::enable_interrupt() };
+
+        let resolved = (cause == 15 && context.pagetable.copy_on_write(va).is_ok())
+            || context.handle_page_fault(va).is_ok();
+
+        if !resolved {
+            println!(
+                "Trap(user): page fault scause {:x} pid={} stval={:x}",
+                cause,
+                process::id().unwrap(),
+                va
+            );
+            process::set_killed().unwrap();
+        }
     } else {
         which_device = device_interrupt_handler();
 
@@ -78,6 +101,7 @@ extern "C" fn usertrap() {
     }
 
     if which_device == 2 {
+        profile::sample_user(context.trapframe.epc as usize);
         process::pause()
     }
 
@@ -126,8 +150,11 @@ pub fn usertrapret() {
 
 #[no_mangle]
 fn kerneltrap() {
+    let fp = unsafe { read_reg!(s0) };
+
     assert!(unsafe { read_csr!(sstatus) & sstatus::SPP != 0 });
     assert!(unsafe { !riscv::is_interrupt_enabled() });
+    trace::trap(unsafe { read_csr!(scause) } as u64, false);
 
     let which_device = device_interrupt_handler();
     if which_device == 0 {
@@ -141,6 +168,10 @@ fn kerneltrap() {
     let sepc = unsafe { read_csr!(sepc) };
     let sstatus = unsafe { read_csr!(sstatus) };
 
+    if which_device == 2 {
+        profile::sample_kernel(sepc as usize, fp as usize);
+    }
+
     if which_device == 2 && process::is_running() {
         process::pause();
     }
@@ -167,8 +198,8 @@ fn device_interrupt_handler() -> usize {
         let irq = unsafe { plic_claim() as usize };
         if irq == UART0_IRQ {
             unsafe { uartintr() };
-        } else if irq == VIRTIO0_IRQ {
-            unsafe { virtio::disk::interrupt_handler() };
+        } else if (VIRTIO0_IRQ..VIRTIO0_IRQ + NVIRTIO).contains(&irq) {
+            unsafe { virtio::disk::interrupt_handler(irq - VIRTIO0_IRQ) };
         } else if irq != 0 {
             println!("unexpected interrupt irq={}", irq);
         }
@@ -5,9 +5,16 @@ use core::sync::atomic::{AtomicBool, Ordering::*};
 use crate::{
     console::consoleintr,
     interrupt, process,
+    riscv::paging::PGSIZE,
     spinlock::{SpinLock, SpinLockGuard},
 };
 
+// bytes of output waiting for the uart.
+const TX_BUF_SIZE: usize = PGSIZE;
+
+// bytes the transmit FIFO takes once it's empty.
+const TX_FIFO_SIZE: usize = 16;
+
 mod reg {
     use core::ptr::NonNull;
 
@@ -35,7 +42,7 @@ mod reg {
     pub const LCR_BAUD_LATCH: u8 = 1 << 7; // special mode to set baud rate
 
     pub const LSR_RX_READY: u8 = 1 << 0; // input is waiting to be read from RHR
-    pub const LSR_TX_IDLE: u8 = 1 << 5; // THR can accept another character to send
+    pub const LSR_TX_IDLE: u8 = 1 << 5; // THR and the transmit FIFO are empty
 
     // the UART control registers are memory-mapped
     // at address UART0. this macro returns the
@@ -81,9 +88,15 @@ impl<const SIZE: usize> TransmitBuffer<SIZE> {
         self.write_at == self.read_at + SIZE
     }
 
-    pub const fn queue(&mut self, value: u8) {
-        self.buffer[self.write_at % SIZE] = value;
-        self.write_at += 1; // TODO: Overflow?
+    // queue as much of bytes as there is room for,
+    // and return how many that was.
+    pub fn queue(&mut self, bytes: &[u8]) -> usize {
+        let n = bytes.len().min(SIZE - (self.write_at - self.read_at));
+        for &value in &bytes[..n] {
+            self.buffer[self.write_at % SIZE] = value;
+            self.write_at += 1; // TODO: Overflow?
+        }
+        n
     }
 
     pub const fn dequeue(&mut self) -> u8 {
@@ -94,7 +107,7 @@ impl<const SIZE: usize> TransmitBuffer<SIZE> {
 }
 
 pub struct UART {
-    tx: SpinLock<TransmitBuffer<32>>,
+    tx: SpinLock<TransmitBuffer<TX_BUF_SIZE>>,
     panicked: AtomicBool,
 }
 
@@ -110,24 +123,29 @@ impl UART {
         self.panicked.load(Relaxed)
     }
 
-    unsafe fn send(mut tx: SpinLockGuard<'static, TransmitBuffer<32>>) {
+    // if the UART is idle, and output is waiting,
+    // fill the transmit FIFO from the buffer.
+    // caller must hold the tx lock.
+    unsafe fn send(tx: &mut SpinLockGuard<'static, TransmitBuffer<TX_BUF_SIZE>>) {
         use reg::*;
 
-        while !tx.is_empty() {
-            if reg::read(LSR) & LSR_TX_IDLE == 0 {
-                // the UART transmit holding register is full,
-                // so we cannot give it another byte.
-                // it will interrupt when it's ready for a new byte.
+        if tx.is_empty() || reg::read(LSR) & LSR_TX_IDLE == 0 {
+            // nothing to send, or the FIFO still holds
+            // bytes; it will interrupt once it's empty.
+            return;
+        }
+
+        // the FIFO is empty, so it takes a whole FIFO's
+        // worth of bytes without looking at LSR again.
+        for _ in 0..TX_FIFO_SIZE {
+            if tx.is_empty() {
                 break;
             }
-
-            let ch = tx.dequeue();
-
-            // maybe uartputc() is waiting for space in the buffer.
-            process::wakeup(&*tx as *const _ as usize);
-
-            reg::write(THR, ch);
+            reg::write(THR, tx.dequeue());
         }
+
+        // maybe write() is waiting for space in the buffer.
+        process::wakeup(&**tx as *const _ as usize);
     }
 
     pub unsafe fn init(&self) {
@@ -156,27 +174,34 @@ impl UART {
         reg::write(IER, IER_TX_ENABLE | IER_RX_ENABLE);
     }
 
-    // add a character to the output buffer and tell the
+    // add bytes to the output buffer and tell the
     // UART to start sending if it isn't already.
-    // blocks if the output buffer is full.
+    // blocks while the output buffer is full.
     // because it may block, it can't be called
     // from interrupts; it's only suitable for use
     // by write().
-    pub fn putc(&'static self, c: u8) {
+    pub fn write(&'static self, mut bytes: &[u8]) {
         let mut tx = self.tx.lock();
 
         if self.is_panicked() {
             crate::halt();
         }
 
-        while tx.is_full() {
-            // buffer is full.
-            // wait for uartstart() to open up space in the buffer.
-            process::sleep(&*tx as *const _ as usize, &mut tx);
+        while !bytes.is_empty() {
+            while tx.is_full() {
+                // buffer is full.
+                // wait for send() to open up space in the buffer.
+                process::sleep(&*tx as *const _ as usize, &mut tx);
+            }
+
+            let n = tx.queue(bytes);
+            bytes = &bytes[n..];
+            unsafe { Self::send(&mut tx) };
         }
+    }
 
-        tx.queue(c);
-        unsafe { Self::send(tx) };
+    pub fn putc(&'static self, c: u8) {
+        self.write(&[c]);
     }
 
     // alternate version of uartputc() that doesn't
@@ -220,7 +245,7 @@ impl UART {
         }
 
         // send buffered characters.
-        unsafe { Self::send(self.tx.lock()) };
+        unsafe { Self::send(&mut self.tx.lock()) };
     }
 }
 
@@ -8,11 +8,12 @@
 //! [https://docs.oasis-open.org/virtio/virtio/v1.1/virtio-v1.1.pdf]
 //!
 
-use crate::memory_layout::VIRTIO0;
+use crate::memory_layout::virtio;
 
 pub mod disk;
 
-// virtio mmio control registers, mapped starting at 0x10001000.
+// virtio mmio control registers, mapped starting at 0x10001000
+// for the first slot.
 // from qemu virtio_mmio.h
 mod mmio_reg {
     pub const MAGIC_VALUE: usize = 0x000; // 0x74726976
@@ -35,6 +36,7 @@ mod mmio_reg {
     pub const DRIVER_DESC_HIGH: usize = 0x094;
     pub const DEVICE_DESC_LOW: usize = 0x0a0; // physical address for used ring, write-only
     pub const DEVICE_DESC_HIGH: usize = 0x0a4;
+    pub const CONFIG: usize = 0x100; // device-specific configuration
 }
 
 // status register bits, from qemu virtio_config.h
@@ -57,9 +59,9 @@ mod feature {
 }
 
 mod descriptor {
-    // this many virtio descriptors.
+    // this many virtio descriptors per queue.
     // must be a power of two.
-    pub const DESCRIPTOR_NUM: usize = 8;
+    pub const DESCRIPTOR_NUM: usize = 128;
 
     // a single descriptor, from the spec.
     #[repr(C)]
@@ -83,6 +85,7 @@ mod descriptor {
 
     pub const VRING_DESC_F_NEXT: u16 = 1; // chained with another descriptor
     pub const VRING_DESC_F_WRITE: u16 = 2; // device writes (vs read)
+    pub const VRING_DESC_F_INDIRECT: u16 = 4; // addr points at a table of descriptors
 
     // the (entire) avail ring, from the spec.
     #[repr(C)]
@@ -143,6 +146,10 @@ mod descriptor {
         Write = 1,
     }
 
+    // offset in the device configuration of the number of
+    // queues, if BLK_MQ was negotiated.
+    pub const BLK_CONFIG_NUM_QUEUES: usize = 34;
+
     // the format of the first descriptor in a disk request.
     // to be followed by two more descriptors containing
     // the block, and a one-byte status.
@@ -154,7 +161,7 @@ mod descriptor {
     }
 }
 
-// the address of virtio mmio register r.
-pub fn mmio_register(reg: usize) -> *mut u32 {
-    core::ptr::from_exposed_addr_mut(VIRTIO0 + reg)
+// the address of virtio mmio register r of a slot.
+pub fn mmio_register(slot: usize, reg: usize) -> *mut u32 {
+    core::ptr::from_exposed_addr_mut(virtio(slot) + reg)
 }
@@ -1,37 +1,69 @@
+// driver for qemu's virtio disks.
+//
+// every mmio slot is probed at boot, and each virtio disk
+// found becomes a device, numbered from ROOTDEV in slot order.
+// with BLK_MQ a disk gets up to one queue per hart, so harts
+// can submit requests without contending for one lock, and with
+// indirect descriptors each request takes one ring descriptor
+// however many buffers it moves.
+//
+// qemu ... -drive file=fs.img,if=none,format=raw,id=x0 \
+//   -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0,num-queues=4
+
 use core::mem::MaybeUninit;
 
 use alloc::boxed::Box;
+use arrayvec::ArrayVec;
 
 use crate::{
     bitmap::Bitmap,
-    memory_layout::VIRTIO0,
+    config::{NCPU, NDISK, ROOTDEV},
+    cpu, interrupt,
+    memory_layout::{virtio, NVIRTIO},
     process,
     spinlock::SpinLock,
-    virtio::{feature, status},
+    trace,
+    virtio::{feature, mmio_register, status},
 };
 
 use super::{
     descriptor::{
-        Avail, BlockRequest, BlockRequestType, Descriptor, Used, DESCRIPTOR_NUM, VRING_DESC_F_NEXT,
-        VRING_DESC_F_WRITE,
+        Avail, BlockRequest, BlockRequestType, Descriptor, Used, BLK_CONFIG_NUM_QUEUES,
+        DESCRIPTOR_NUM, VRING_DESC_F_INDIRECT, VRING_DESC_F_NEXT, VRING_DESC_F_WRITE,
     },
     mmio_reg,
 };
 
+// the most data buffers in one request.
+pub const MAX_SEGMENTS: usize = 16;
+
 struct Info {
     addr: usize,
     in_use: bool,
     status: u8,
+    sequence: u64, // which submission is using this chain
+    block: usize,
+    started: u64, // trace::now() at submission
 }
 
-pub struct Disk {
+struct Queue {
+    slot: usize,    // mmio slot of the device
+    number: u32,    // queue number on the device
+    indirect: bool, // requests use indirect descriptor tables
+
     // a set (not a ring) of DMA descriptors, with which the
     // driver tells the device where to read and write individual
     // disk operations. there are NUM descriptors.
-    // most commands consist of a "chain" (a linked list) of a couple of
-    // these descriptors.
+    // a command is a "chain" (a linked list) of a header, the
+    // data buffers and a status byte in these descriptors, or
+    // a single descriptor pointing to such a chain in tables[]
+    // if indirect descriptors are in use.
     descriptor: Box<[Descriptor; DESCRIPTOR_NUM]>,
 
+    // indirect chains, indexed by the ring descriptor
+    // that points to them.
+    tables: Box<[[Descriptor; MAX_SEGMENTS + 2]; DESCRIPTOR_NUM]>,
+
     // a ring in which the driver writes descriptor numbers
     // that the driver would like the device to process.  it only
     // includes the head descriptor of each chain. the ring has
@@ -50,155 +82,308 @@ pub struct Disk {
     // track info about in-flight operations,
     // for use when completion interrupt arrives.
     // indexed by first descriptor index of chain.
-    info: [MaybeUninit<Info>; DESCRIPTOR_NUM],
+    info: Box<[MaybeUninit<Info>; DESCRIPTOR_NUM]>,
 
     // disk command headers.
     // one-for-one with descriptors, for convenience.
-    ops: [MaybeUninit<BlockRequest>; DESCRIPTOR_NUM],
-}
+    ops: Box<[MaybeUninit<BlockRequest>; DESCRIPTOR_NUM]>,
 
-unsafe fn read_reg(r: usize) -> u32 {
-    core::ptr::from_exposed_addr::<u32>(VIRTIO0 + r).read_volatile()
+    submitted: u64,   // number of requests ever submitted.
+    unnotified: bool, // requests in avail ring the device hasn't been told about.
 }
 
-unsafe fn write_reg(r: usize, val: u32) {
-    core::ptr::from_exposed_addr_mut::<u32>(VIRTIO0 + r).write_volatile(val);
+pub struct Disk {
+    slot: usize,
+    queues: ArrayVec<SpinLock<Queue>, NCPU>,
 }
 
-impl Disk {
-    unsafe fn init() -> Self {
-        assert!(read_reg(mmio_reg::MAGIC_VALUE) == 0x74726976);
-        assert!(read_reg(mmio_reg::VERSION) == 2);
-        assert!(read_reg(mmio_reg::DEVICE_ID) == 2);
-        assert!(read_reg(mmio_reg::VENDOR_ID) == 0x554d4551);
-
-        let mut s = 0;
-        write_reg(mmio_reg::STATUS, s);
-
-        s |= status::ACKNOWLEDGE;
-        write_reg(mmio_reg::STATUS, s);
-
-        s |= status::DRIVER;
-        write_reg(mmio_reg::STATUS, s);
-
-        let mut features = read_reg(mmio_reg::DEVICE_FEATURES);
-        features &= !(1 << feature::BLK_RO);
-        features &= !(1 << feature::BLK_SCSI);
-        features &= !(1 << feature::BLK_CONFIG_WCE);
-        features &= !(1 << feature::BLK_MQ);
-        features &= !(1 << feature::ANY_LAYOUT);
-        features &= !(1 << feature::RING_EVENT_IDX);
-        features &= !(1 << feature::RING_INDIRECT_DESC);
-        write_reg(mmio_reg::DRIVER_FEATURES, features);
-
-        s |= status::FEATURES_OK;
-        write_reg(mmio_reg::STATUS, s);
+unsafe fn read_reg(slot: usize, r: usize) -> u32 {
+    mmio_register(slot, r).read_volatile()
+}
 
-        // re-read status to ensure FEATURES_OK is set.
-        s = read_reg(mmio_reg::STATUS);
-        assert!(s & status::FEATURES_OK != 0);
+unsafe fn write_reg(slot: usize, r: usize, val: u32) {
+    mmio_register(slot, r).write_volatile(val);
+}
 
-        write_reg(mmio_reg::QUEUE_SEL, 0);
+impl Queue {
+    // set up queue number of the device in slot.
+    unsafe fn init(slot: usize, number: u32, indirect: bool) -> Self {
+        write_reg(slot, mmio_reg::QUEUE_SEL, number);
 
-        // ensure queue 0 is not in use.
-        assert!(read_reg(mmio_reg::QUEUE_READY) == 0);
+        // ensure the queue is not in use.
+        assert!(read_reg(slot, mmio_reg::QUEUE_READY) == 0);
 
-        let max = read_reg(mmio_reg::QUEUE_NUM_MAX);
+        let max = read_reg(slot, mmio_reg::QUEUE_NUM_MAX);
         assert!(max != 0);
         assert!(max >= DESCRIPTOR_NUM as u32);
 
-        let descriptor = Box::new([const { Descriptor::zeroed() }; _]);
-        let avail = Box::new(Avail::zeroed());
-        let used = Box::new(Used::zeroed());
+        // the rings are too big for the boot stack, so they are
+        // allocated in place rather than moved into boxes.
+        let descriptor: Box<[Descriptor; DESCRIPTOR_NUM]> = Box::new_zeroed().assume_init();
+        let tables: Box<[[Descriptor; MAX_SEGMENTS + 2]; DESCRIPTOR_NUM]> =
+            Box::new_zeroed().assume_init();
+        let avail: Box<Avail> = Box::new_zeroed().assume_init();
+        let used: Box<Used> = Box::new_zeroed().assume_init();
 
-        write_reg(mmio_reg::QUEUE_NUM, DESCRIPTOR_NUM as u32);
+        write_reg(slot, mmio_reg::QUEUE_NUM, DESCRIPTOR_NUM as u32);
 
         // write physical addresses.
-        write_reg(
-            mmio_reg::QUEUE_DESC_LOW,
-            core::ptr::addr_of!(*descriptor).addr() as u32,
-        );
-        write_reg(
-            mmio_reg::QUEUE_DESC_HIGH,
-            (core::ptr::addr_of!(*descriptor).addr() >> 32) as u32,
-        );
-        write_reg(
-            mmio_reg::DRIVER_DESC_LOW,
-            core::ptr::addr_of!(*avail).addr() as u32,
-        );
-        write_reg(
-            mmio_reg::DRIVER_DESC_HIGH,
-            (core::ptr::addr_of!(*avail).addr() >> 32) as u32,
-        );
-        write_reg(
-            mmio_reg::DEVICE_DESC_LOW,
-            core::ptr::addr_of!(*used).addr() as u32,
-        );
-        write_reg(
-            mmio_reg::DEVICE_DESC_HIGH,
-            (core::ptr::addr_of!(*used).addr() >> 32) as u32,
-        );
+        let desc = core::ptr::addr_of!(*descriptor).addr();
+        let driver = core::ptr::addr_of!(*avail).addr();
+        let device = core::ptr::addr_of!(*used).addr();
+        write_reg(slot, mmio_reg::QUEUE_DESC_LOW, desc as u32);
+        write_reg(slot, mmio_reg::QUEUE_DESC_HIGH, (desc >> 32) as u32);
+        write_reg(slot, mmio_reg::DRIVER_DESC_LOW, driver as u32);
+        write_reg(slot, mmio_reg::DRIVER_DESC_HIGH, (driver >> 32) as u32);
+        write_reg(slot, mmio_reg::DEVICE_DESC_LOW, device as u32);
+        write_reg(slot, mmio_reg::DEVICE_DESC_HIGH, (device >> 32) as u32);
 
         // queue is ready.
-        write_reg(mmio_reg::QUEUE_READY, 0x1);
-
-        // tell device we're completely ready.
-        s |= status::DRIVER_OK;
-        write_reg(mmio_reg::STATUS, s);
+        write_reg(slot, mmio_reg::QUEUE_READY, 0x1);
 
         Self {
+            slot,
+            number,
+            indirect,
             descriptor,
+            tables,
             avail,
             used,
             free: Bitmap::new(),
             used_index: 0,
-            info: MaybeUninit::uninit_array(),
-            ops: MaybeUninit::uninit_array(),
+            info: Box::new_uninit().assume_init(),
+            ops: Box::new_uninit().assume_init(),
+            submitted: 0,
+            unnotified: false,
         }
     }
 
-    fn allocate_descriptor(&mut self) -> Option<usize> {
-        self.free.allocate()
+    // allocate n descriptors, or none at all, so that
+    // requests waiting for descriptors can't starve each other.
+    fn allocate_chain(&mut self, n: usize) -> Option<ArrayVec<usize, { MAX_SEGMENTS + 2 }>> {
+        let mut idx = ArrayVec::new();
+        while idx.len() < n {
+            match self.free.allocate() {
+                Some(index) => idx.push(index),
+                None => {
+                    for index in idx {
+                        self.free.deallocate(index).unwrap();
+                    }
+                    return None;
+                }
+            }
+        }
+        Some(idx)
     }
 
     unsafe fn deallocate_descriptor(&mut self, index: usize) {
         self.free.deallocate(index).unwrap();
         process::wakeup(&*self as *const _ as usize);
     }
+
+    // free a chain of descriptors.
+    unsafe fn deallocate_chain(&mut self, head: usize) {
+        let mut index = head;
+        loop {
+            let Descriptor { flags, next, .. } = self.descriptor[index];
+            self.deallocate_descriptor(index);
+
+            if flags & VRING_DESC_F_NEXT == 0 {
+                break;
+            }
+            index = next as usize;
+        }
+    }
+
+    // tell the device about requests added to the avail ring.
+    unsafe fn notify(&mut self) {
+        if self.unnotified {
+            write_reg(self.slot, mmio_reg::QUEUE_NOTIFY, self.number); // value is queue number
+            self.unnotified = false;
+        }
+    }
+
+    // look at the requests the device has finished.
+    unsafe fn complete(&mut self) {
+        core::sync::atomic::fence(core::sync::atomic::Ordering::SeqCst);
+
+        while self.used_index != self.used.idx {
+            core::sync::atomic::fence(core::sync::atomic::Ordering::SeqCst);
+
+            let id = self.used.ring[self.used_index as usize % DESCRIPTOR_NUM].id as usize;
+            let Info {
+                addr,
+                in_use,
+                status,
+                block,
+                started,
+                ..
+            } = self.info[id].assume_init_mut();
+
+            assert!(*status == 0);
+            *in_use = false;
+            trace::disk(*block, *started);
+            process::wakeup(*addr);
+
+            // the waiter only looks at info[], so the chain
+            // can be reused right away.
+            self.deallocate_chain(id);
+
+            self.used_index = self.used_index.wrapping_add(1);
+        }
+    }
+}
+
+impl Disk {
+    // set up the virtio disk in slot, if there is one.
+    unsafe fn init(slot: usize) -> Option<Self> {
+        if read_reg(slot, mmio_reg::MAGIC_VALUE) != 0x74726976
+            || read_reg(slot, mmio_reg::VERSION) != 2
+            || read_reg(slot, mmio_reg::DEVICE_ID) != 2
+            || read_reg(slot, mmio_reg::VENDOR_ID) != 0x554d4551
+        {
+            return None;
+        }
+
+        let mut s = 0;
+        write_reg(slot, mmio_reg::STATUS, s);
+
+        s |= status::ACKNOWLEDGE;
+        write_reg(slot, mmio_reg::STATUS, s);
+
+        s |= status::DRIVER;
+        write_reg(slot, mmio_reg::STATUS, s);
+
+        // negotiate features. keep BLK_MQ and RING_INDIRECT_DESC
+        // if the device offers them.
+        let mut features = read_reg(slot, mmio_reg::DEVICE_FEATURES);
+        features &= !(1 << feature::BLK_RO);
+        features &= !(1 << feature::BLK_SCSI);
+        features &= !(1 << feature::BLK_CONFIG_WCE);
+        features &= !(1 << feature::ANY_LAYOUT);
+        features &= !(1 << feature::RING_EVENT_IDX);
+        write_reg(slot, mmio_reg::DRIVER_FEATURES, features);
+
+        s |= status::FEATURES_OK;
+        write_reg(slot, mmio_reg::STATUS, s);
+
+        // re-read status to ensure FEATURES_OK is set.
+        s = read_reg(slot, mmio_reg::STATUS);
+        assert!(s & status::FEATURES_OK != 0);
+
+        let count = if features & (1 << feature::BLK_MQ) != 0 {
+            let config = virtio(slot) + mmio_reg::CONFIG + BLK_CONFIG_NUM_QUEUES;
+            core::ptr::from_exposed_addr::<u16>(config).read_volatile() as usize
+        } else {
+            1
+        };
+        let indirect = features & (1 << feature::RING_INDIRECT_DESC) != 0;
+
+        let mut queues = ArrayVec::new();
+        for number in 0..count.clamp(1, NCPU) {
+            let queue = Queue::init(slot, number as u32, indirect);
+            queues.push(SpinLock::named("disk", queue));
+        }
+
+        // tell device we're completely ready.
+        s |= status::DRIVER_OK;
+        write_reg(slot, mmio_reg::STATUS, s);
+
+        Some(Self { slot, queues })
+    }
+}
+
+// disks in the order they were found; disk i is device ROOTDEV + i.
+static mut DISKS: ArrayVec<Disk, NDISK> = ArrayVec::new_const();
+
+fn disks() -> &'static ArrayVec<Disk, NDISK> {
+    unsafe { &*core::ptr::addr_of!(DISKS) }
+}
+
+fn disk(device: usize) -> &'static Disk {
+    match device.checked_sub(ROOTDEV).and_then(|i| disks().get(i)) {
+        Some(disk) => disk,
+        None => panic!("virtio disk {}", device),
+    }
 }
 
-fn disk() -> &'static SpinLock<Disk> {
-    // the virtio driver and device mostly communicate through a set of
-    // structures in RAM. pages[] allocates that memory. pages[] is a
-    // global (instead of calls to kalloc()) because it must consist of
-    // two contiguous pages of page-aligned physical memory.
-    static mut DISK: MaybeUninit<SpinLock<Disk>> = MaybeUninit::uninit();
-    static INIT: SpinLock<bool> = SpinLock::new(false);
-
-    let mut is_initialized = INIT.lock();
-    if !*is_initialized {
-        let disk = unsafe { Disk::init() };
-        unsafe { DISK.write(SpinLock::new(disk)) };
-        *is_initialized = true;
+// Probe the mmio slots for disks.
+// Call once, before the other harts start.
+pub unsafe fn initialize() {
+    let disks = &mut *core::ptr::addr_of_mut!(DISKS);
+    for slot in 0..NVIRTIO {
+        if disks.is_full() {
+            break;
+        }
+        if let Some(disk) = Disk::init(slot) {
+            disks.push(disk);
+        }
     }
+    assert!(!disks.is_empty(), "no virtio disk");
+}
 
-    unsafe { DISK.assume_init_ref() }
+// Is there a disk for device?
+pub fn exists(device: usize) -> bool {
+    device
+        .checked_sub(ROOTDEV)
+        .is_some_and(|i| i < disks().len())
 }
 
-unsafe fn rw(addr: usize, block: usize, size: usize, write: bool) {
-    let sector = block * (size / 512);
+// a request queued with submit(), to be passed to wait().
+// every buffer of a request may hold a copy.
+#[must_use]
+#[derive(Clone)]
+pub struct Ticket {
+    device: usize,
+    queue: usize,
+    head: usize,
+    sequence: u64,
+}
 
-    let mut disk = disk().lock();
+// queue a request for consecutive blocks, starting at block,
+// of size bytes each, without waiting for it to finish. the
+// blocks are gathered from, or scattered to, the buffers at
+// addrs, at most MAX_SEGMENTS of them.
+// the device is not told about it until notify() or wait(),
+// so that a batch of requests costs a single notification.
+// the memory at addrs must stay valid until the request completes.
+pub unsafe fn submit(
+    device: usize,
+    addrs: &[usize],
+    block: usize,
+    size: usize,
+    write: bool,
+) -> Ticket {
+    assert!(!addrs.is_empty() && addrs.len() <= MAX_SEGMENTS);
+    let sector = block * (size / 512);
 
-    let must_allocate_descriptor = |_| loop {
-        match disk.allocate_descriptor() {
-            Some(desc) => return desc,
-            None => process::sleep(&*disk as *const _ as usize, &mut disk),
+    // use this hart's queue.
+    let disk = disk(device);
+    let queue = interrupt::off(cpu::id) % disk.queues.len();
+    let mut q = disk.queues[queue].lock();
+
+    // a request is a header, the data buffers, and a status
+    // byte, either in an indirect table or straight in the ring.
+    let indirect = q.indirect;
+    let n = addrs.len() + 2;
+    let idx = loop {
+        match q.allocate_chain(if indirect { 1 } else { n }) {
+            Some(idx) => break idx,
+            None => {
+                // the ring is full of requests, some of which the
+                // device may not have heard about yet.
+                q.notify();
+                process::sleep(&*q as *const _ as usize, &mut q)
+            }
         }
     };
+    let head = idx[0];
+    let next = |i: usize| match indirect {
+        true => i as u16 + 1, // within tables[head]
+        false => idx[i + 1] as u16,
+    };
 
-    let idx = [0; 3].map(must_allocate_descriptor);
-    let buf0 = disk.ops[idx[0]].write(BlockRequest {
+    let buf0 = q.ops[head].write(BlockRequest {
         ty: match write {
             true => BlockRequestType::Write, // write the disk
             false => BlockRequestType::Read, // read the disk
@@ -206,98 +391,140 @@ unsafe fn rw(addr: usize, block: usize, size: usize, write: bool) {
         reserved: 0,
         sector: sector as u64,
     });
+    let buf0 = buf0 as *const BlockRequest;
 
-    disk.descriptor[idx[0]] = Descriptor {
-        addr: buf0 as *const _ as _,
-        len: core::mem::size_of_val(buf0) as u32,
-        flags: VRING_DESC_F_NEXT,
-        next: idx[1] as u16,
-    };
-
-    disk.descriptor[idx[1]] = Descriptor {
-        addr: addr as u64,
-        len: size as u32,
-        flags: VRING_DESC_F_NEXT
-            | match write {
-                true => 0,                   // device reads b->data
-                false => VRING_DESC_F_WRITE, // device writes b->data
-            },
-        next: idx[2] as u16,
-    };
+    q.submitted += 1;
+    let sequence = q.submitted;
 
-    let info = disk.info[idx[0]].write(Info {
-        addr,
+    let info = q.info[head].write(Info {
+        addr: addrs[0],
         in_use: true,
         status: 0,
+        sequence,
+        block,
+        started: trace::now(),
     });
+    let status = &mut info.status as *mut u8;
 
-    let in_use = core::ptr::addr_of!(info.in_use);
-
-    disk.descriptor[idx[2]] = Descriptor {
-        addr: &mut info.status as *mut _ as u64,
+    let mut chain = ArrayVec::<Descriptor, { MAX_SEGMENTS + 2 }>::new();
+    chain.push(Descriptor {
+        addr: buf0 as u64,
+        len: core::mem::size_of::<BlockRequest>() as u32,
+        flags: VRING_DESC_F_NEXT,
+        next: next(0),
+    });
+    for (i, &addr) in addrs.iter().enumerate() {
+        chain.push(Descriptor {
+            addr: addr as u64,
+            len: size as u32,
+            flags: VRING_DESC_F_NEXT
+                | match write {
+                    true => 0,                   // device reads b->data
+                    false => VRING_DESC_F_WRITE, // device writes b->data
+                },
+            next: next(i + 1),
+        });
+    }
+    chain.push(Descriptor {
+        addr: status as u64,
         len: 1,
         flags: VRING_DESC_F_WRITE,
         next: 0,
-    };
+    });
 
-    let ring_index = disk.avail.idx as usize % DESCRIPTOR_NUM;
-    disk.avail.ring[ring_index] = idx[0] as u16;
+    if indirect {
+        for (slot, descriptor) in q.tables[head].iter_mut().zip(chain) {
+            *slot = descriptor;
+        }
+        q.descriptor[head] = Descriptor {
+            addr: q.tables[head].as_ptr().addr() as u64,
+            len: (n * core::mem::size_of::<Descriptor>()) as u32,
+            flags: VRING_DESC_F_INDIRECT,
+            next: 0,
+        };
+    } else {
+        for (&index, descriptor) in idx.iter().zip(chain) {
+            q.descriptor[index] = descriptor;
+        }
+    }
+
+    let ring_index = q.avail.idx as usize % DESCRIPTOR_NUM;
+    q.avail.ring[ring_index] = head as u16;
 
     core::sync::atomic::fence(core::sync::atomic::Ordering::SeqCst);
     {
-        let index = &mut disk.avail.idx;
+        let index = &mut q.avail.idx;
         *index = index.wrapping_add(1);
     }
     core::sync::atomic::fence(core::sync::atomic::Ordering::SeqCst);
 
-    write_reg(mmio_reg::QUEUE_NOTIFY, 0); // value is queue number
+    q.unnotified = true;
+
+    Ticket {
+        device,
+        queue,
+        head,
+        sequence,
+    }
+}
+
+// tell device about every request submitted to it so far.
+pub unsafe fn notify(device: usize) {
+    for queue in disk(device).queues.iter() {
+        queue.lock().notify();
+    }
+}
 
-    // Wait for virtio_disk_intr() to say request has finished.
-    while in_use.read_volatile() {
-        process::sleep(addr, &mut disk);
+// wait for a submitted request to finish.
+pub unsafe fn wait(ticket: Ticket) {
+    let mut q = disk(ticket.device).queues[ticket.queue].lock();
+    q.notify();
+
+    // the interrupt handler frees the chain when the request
+    // finishes, after which the chain may be reused by a later
+    // submission with a different sequence number.
+    loop {
+        let info = q.info[ticket.head].assume_init_ref();
+        if info.sequence != ticket.sequence || !info.in_use {
+            break;
+        }
+
+        let addr = info.addr;
+        process::sleep(addr, &mut q);
     }
+}
 
-    idx.map(|i| disk.deallocate_descriptor(i));
+unsafe fn rw(device: usize, addr: usize, block: usize, size: usize, write: bool) {
+    wait(submit(device, &[addr], block, size, write));
 }
 
-pub unsafe fn read(addr: usize, block: usize, size: usize) {
-    rw(addr, block, size, false);
+pub unsafe fn read(device: usize, addr: usize, block: usize, size: usize) {
+    rw(device, addr, block, size, false);
 }
 
-pub unsafe fn write(addr: usize, block: usize, size: usize) {
-    rw(addr, block, size, true);
+pub unsafe fn write(device: usize, addr: usize, block: usize, size: usize) {
+    rw(device, addr, block, size, true);
 }
 
-pub unsafe fn interrupt_handler() {
-    let mut disk = disk().lock();
+pub unsafe fn interrupt_handler(slot: usize) {
+    let Some(disk) = disks().iter().find(|disk| disk.slot == slot) else {
+        return;
+    };
 
     // the device won't raise another interrupt until we tell it
     // we've seen this interrupt, which the following line does.
     // this may race with the device writing new entries to
-    // the "used" ring, in which case we may process the new
+    // the "used" rings, in which case we may process the new
     // completion entries in this interrupt, and have nothing to do
     // in the next interrupt, which is harmless.
     write_reg(
+        slot,
         mmio_reg::INTERRUPT_ACK,
-        read_reg(mmio_reg::INTERRUPT_STATUS) & 0x3,
+        read_reg(slot, mmio_reg::INTERRUPT_STATUS) & 0x3,
     );
 
-    core::sync::atomic::fence(core::sync::atomic::Ordering::SeqCst);
-
-    while disk.used_index != disk.used.idx {
-        core::sync::atomic::fence(core::sync::atomic::Ordering::SeqCst);
-
-        let id = disk.used.ring[disk.used_index as usize % DESCRIPTOR_NUM].id;
-        let Info {
-            addr,
-            in_use,
-            status,
-        } = disk.info[id as usize].assume_init_mut();
-
-        assert!(*status == 0);
-        core::ptr::addr_of_mut!(*in_use).write_volatile(false);
-        process::wakeup(*addr);
-
-        disk.used_index = disk.used_index.wrapping_add(1);
+    // the device has one interrupt for all its queues.
+    for queue in disk.queues.iter() {
+        queue.lock().complete();
     }
 }
@@ -5,7 +5,7 @@ use core::arch::riscv64::sfence_vma;
 use crate::allocator::{self, KernelAllocator};
 use crate::spinlock::SpinLock;
 use crate::{
-    memory_layout::{symbol_addr, KERNBASE, PHYSTOP, PLIC, TRAMPOLINE, UART0, VIRTIO0},
+    memory_layout::{symbol_addr, KERNBASE, NVIRTIO, PHYSTOP, PLIC, TRAMPOLINE, UART0, VIRTIO0},
     process,
     riscv::{
         paging::{PGSIZE, PTE},
@@ -33,9 +33,9 @@ pub unsafe fn initialize() {
         )
         .unwrap();
 
-    // virtio mmio disk interface
+    // virtio mmio disk interfaces
     pagetable
-        .map(VIRTIO0, VIRTIO0, PGSIZE, PTE::R | PTE::W)
+        .map(VIRTIO0, VIRTIO0, NVIRTIO * PGSIZE, PTE::R | PTE::W)
         .unwrap();
 
     // PLIC
@@ -49,6 +49,8 @@ pub unsafe fn initialize() {
         .unwrap();
 
     // map kernel data and the physical RAM we'll make use of.
+    // map() uses megapages from the first 2MB boundary on,
+    // so this takes a handful of page-table pages.
     pagetable
         .map(etext, etext, PHYSTOP - etext, PTE::R | PTE::W)
         .unwrap();
@@ -2,12 +2,17 @@
 #define NCPU 8                    // maximum number of CPUs
 #define NOFILE 16                 // open files per process
 #define NFILE 100                 // open files per system
-#define NINODE 50                 // maximum number of active i-nodes
+#define NINODE 512                // maximum number of active i-nodes
 #define NDEV 10                   // maximum major device number
 #define ROOTDEV 1                 // device number of file system root disk
+#define NDISK 4                   // maximum number of disks, numbered from ROOTDEV
 #define MAXARG 32                 // max exec arguments
 #define MAXOPBLOCKS 10            // max # of blocks any FS op writes
-#define LOGSIZE (MAXOPBLOCKS * 3) // max data blocks in on-disk log
+#define LOGSIZE 128               // blocks in on-disk log, header included (mkfs -l)
 #define NBUF (MAXOPBLOCKS * 3)    // size of disk block cache
-#define FSSIZE 2000               // size of file system in blocks
+#define FSSIZE 200000             // size of file system in blocks (mkfs -s)
+#define FSINODES 1024             // on-disk inodes, more than NINODE (mkfs -i)
+#define NTRACE 256                // trace events kept per CPU
+#define NPROF 512                 // profiler samples kept per CPU
+#define NPROFDEPTH 8              // pcs in each profiler sample
 #define MAXPATH 128               // maximum file path name
@@ -0,0 +1,11 @@
+// operations of profile()
+#define PROF_START 0  // discard old samples and start sampling
+#define PROF_STOP  1  // stop sampling
+#define PROF_READ  2  // copy out the samples
+
+struct sample {
+  uint64 pid;              // 0 if no process was running
+  uint64 user;             // 1 if pc[0] is a user address
+  uint64 depth;            // valid entries of pc
+  uint64 pc[NPROFDEPTH];   // interrupted pc, then return addresses
+};
@@ -20,3 +20,13 @@
 #define SYS_link 19
 #define SYS_mkdir 20
 #define SYS_close 21
+#define SYS_pipesize 22
+#define SYS_splice 23
+#define SYS_uptimens 24
+#define SYS_trace 25
+#define SYS_profile 26
+#define SYS_readv 27
+#define SYS_writev 28
+#define SYS_pread 29
+#define SYS_pwrite 30
+#define SYS_mount 31
@@ -0,0 +1,31 @@
+// what trace() reads out
+#define TRACE_EVENTS   0  // recent struct events of every CPU
+#define TRACE_SYSCALLS 1  // a struct histogram per system call number
+#define TRACE_DISK     2  // a struct histogram of disk requests
+#define TRACE_TRAPS    3  // uint64 counts[2][NCAUSE], kernel then user
+
+// kinds of events
+#define EV_SYSCALL 1  // a0 = system call number, a1 = latency
+#define EV_SWITCH  2  // a0 = pid of the process switched to
+#define EV_DISK    3  // a0 = block, a1 = latency
+
+#define NBUCKET 32
+#define NCAUSE 32     // exception codes, then 16 + interrupt codes
+
+#define TIMEBASE 10000000  // ticks of the time CSR per second
+
+// times are in ticks of the time CSR.
+struct event {
+  uint64 time;
+  uint64 cpu;
+  uint64 kind;
+  uint64 a0;
+  uint64 a1;
+};
+
+// bucket i counts values below 2^i and not below 2^(i-1).
+struct histogram {
+  uint64 count;
+  uint64 total;
+  uint64 buckets[NBUCKET];
+};
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <sys/mman.h>
 
 #define stat xv6_stat  // avoid clash with host struct stat
 #include "kernel/types.h"
@@ -15,20 +16,22 @@
 #define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
 #endif
 
-#define NINODES 200
-
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
-
-int nbitmap = FSSIZE/(BSIZE*8) + 1;
-int ninodeblocks = NINODES / IPB + 1;
+//
+// The image is built in memory, mapped from the output file,
+// so blocks that stay zero are never written.
+
+int fssize = FSSIZE;
+int ninodes = FSINODES;
+int nbitmap;
+int ninodeblocks;
 int nlog = LOGSIZE;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
-int fsfd;
+char *img;
 struct superblock sb;
-char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
 
@@ -38,8 +41,14 @@ void wsect(uint, void*);
 void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
+char *block(uint);
+struct dinode *dinode(uint);
+uint bnew(void);
 uint ialloc(ushort type);
+uint ientry(uint *table, uint i);
 void iappend(uint inum, void *p, int n);
+int number(const char *, const char *);
+void usage(void);
 void die(const char *);
 
 // convert to riscv byte order
@@ -68,7 +77,7 @@ xint(uint x)
 int
 main(int argc, char *argv[])
 {
-  int i, cc, fd;
+  int i, cc, fd, fsfd, opt;
   uint rootino, inum, off;
   struct dirent de;
   char buf[BSIZE];
@@ -77,39 +86,71 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
-    exit(1);
+  while((opt = getopt(argc, argv, "s:l:i:")) != -1){
+    switch(opt){
+    case 's':
+      fssize = number(optarg, "size");
+      break;
+    case 'l':
+      nlog = number(optarg, "log size");
+      break;
+    case 'i':
+      ninodes = number(optarg, "inodes");
+      break;
+    default:
+      usage();
+    }
   }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if(argc < 2)
+    usage();
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
 
-  fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
-  if(fsfd < 0)
-    die(argv[1]);
+  // the log header block names at most BSIZE/4 - 1 blocks,
+  // and the log must hold the biggest FS operation.
+  if(nlog < MAXOPBLOCKS + 1 || nlog > BSIZE / sizeof(uint)){
+    fprintf(stderr, "mkfs: log size must be %d to %d blocks\n",
+            MAXOPBLOCKS + 1, (int)(BSIZE / sizeof(uint)));
+    exit(1);
+  }
 
   // 1 fs block = 1 disk sector
+  nbitmap = fssize/BPB + 1;
+  ninodeblocks = ninodes / IPB + 1;
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  nblocks = fssize - nmeta;
+  if(nblocks < 2 || (uint)ninodes > 0xffff){
+    fprintf(stderr, "mkfs: %d blocks are too few, or %d inodes too many\n",
+            fssize, ninodes);
+    exit(1);
+  }
+
+  fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
+  if(fsfd < 0)
+    die(argv[1]);
+  if(ftruncate(fsfd, (off_t)fssize * BSIZE) < 0)
+    die("ftruncate");
+  img = mmap(0, (size_t)fssize * BSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fsfd, 0);
+  if(img == MAP_FAILED)
+    die("mmap");
 
   sb.magic = FSMAGIC;
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
-  sb.ninodes = xint(NINODES);
+  sb.ninodes = xint(ninodes);
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, fssize);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
-
   memset(buf, 0, sizeof(buf));
   memmove(buf, &sb, sizeof(sb));
   wsect(1, buf);
@@ -169,52 +210,62 @@ main(int argc, char *argv[])
 
   balloc(freeblock);
 
+  if(munmap(img, (size_t)fssize * BSIZE) < 0)
+    die("munmap");
+  if(close(fsfd) < 0)
+    die(argv[1]);
   exit(0);
 }
 
+// the block of the image in memory.
+char*
+block(uint sec)
+{
+  assert(sec < fssize);
+  return img + (size_t)sec * BSIZE;
+}
+
 void
 wsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE)
-    die("lseek");
-  if(write(fsfd, buf, BSIZE) != BSIZE)
-    die("write");
+  memmove(block(sec), buf, BSIZE);
+}
+
+void
+rsect(uint sec, void *buf)
+{
+  memmove(buf, block(sec), BSIZE);
+}
+
+// the on-disk inode inum, in place.
+struct dinode*
+dinode(uint inum)
+{
+  assert(inum < ninodes);
+  return (struct dinode*)block(IBLOCK(inum, sb)) + (inum % IPB);
 }
 
 void
 winode(uint inum, struct dinode *ip)
 {
-  char buf[BSIZE];
-  uint bn;
-  struct dinode *dip;
-
-  bn = IBLOCK(inum, sb);
-  rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
-  *dip = *ip;
-  wsect(bn, buf);
+  *dinode(inum) = *ip;
 }
 
 void
 rinode(uint inum, struct dinode *ip)
 {
-  char buf[BSIZE];
-  uint bn;
-  struct dinode *dip;
-
-  bn = IBLOCK(inum, sb);
-  rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
-  *ip = *dip;
+  *ip = *dinode(inum);
 }
 
-void
-rsect(uint sec, void *buf)
+// allocate a data block.
+uint
+bnew(void)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE)
-    die("lseek");
-  if(read(fsfd, buf, BSIZE) != BSIZE)
-    die("read");
+  if(freeblock >= fssize){
+    fprintf(stderr, "mkfs: out of blocks; use a bigger -s\n");
+    exit(1);
+  }
+  return freeblock++;
 }
 
 uint
@@ -223,6 +274,10 @@ ialloc(ushort type)
   uint inum = freeinode++;
   struct dinode din;
 
+  if(inum >= ninodes){
+    fprintf(stderr, "mkfs: out of inodes; use a bigger -i\n");
+    exit(1);
+  }
   bzero(&din, sizeof(din));
   din.type = xshort(type);
   din.nlink = xshort(1);
@@ -234,63 +289,92 @@ ialloc(ushort type)
 void
 balloc(int used)
 {
-  uchar buf[BSIZE];
+  uchar *buf;
   int i;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE*8);
-  bzero(buf, BSIZE);
+  assert(used <= fssize);
   for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    buf = (uchar*)block(BBLOCK(i, sb));
+    buf[i%BPB/8] = buf[i%BPB/8] | (0x1 << (i%8));
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
+  printf("balloc: write bitmap blocks at sector %d\n", sb.bmapstart);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return entry i of the indirect block *table,
+// allocating the table and the entry if needed.
+uint
+ientry(uint *table, uint i)
+{
+  uint *indirect;
+
+  if(xint(*table) == 0){
+    *table = xint(bnew());
+  }
+  indirect = (uint*)block(xint(*table));
+  if(indirect[i] == 0){
+    indirect[i] = xint(bnew());
+  }
+  return xint(indirect[i]);
+}
+
+// append to the inode in place in the image.
 void
 iappend(uint inum, void *xp, int n)
 {
   char *p = (char*)xp;
   uint fbn, off, n1;
-  struct dinode din;
-  char buf[BSIZE];
-  uint indirect[NINDIRECT];
+  struct dinode *din;
   uint x;
 
-  rinode(inum, &din);
-  off = xint(din.size);
+  din = dinode(inum);
+  off = xint(din->size);
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
     if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
+      if(xint(din->addrs[fbn]) == 0){
+        din->addrs[fbn] = xint(bnew());
       }
-      x = xint(din.addrs[fbn]);
+      x = xint(din->addrs[fbn]);
+    } else if(fbn < NDIRECT + NINDIRECT){
+      x = ientry(&din->addrs[NDIRECT], fbn - NDIRECT);
     } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
+      x = ientry(&din->addrs[NDIRECT+1], (fbn - NDIRECT - NINDIRECT) / NINDIRECT);
+      x = xint(x);
+      x = ientry(&x, (fbn - NDIRECT - NINDIRECT) % NINDIRECT);
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
-    rsect(x, buf);
-    bcopy(p, buf + off - (fbn * BSIZE), n1);
-    wsect(x, buf);
+    bcopy(p, block(x) + off - (fbn * BSIZE), n1);
     n -= n1;
     off += n1;
     p += n1;
   }
-  din.size = xint(off);
-  winode(inum, &din);
+  din->size = xint(off);
+}
+
+int
+number(const char *s, const char *what)
+{
+  char *end;
+  long n;
+
+  n = strtol(s, &end, 10);
+  if(*s == 0 || *end != 0 || n <= 0 || n > 0x7fffffff){
+    fprintf(stderr, "mkfs: bad %s %s\n", what, s);
+    exit(1);
+  }
+  return n;
+}
+
+void
+usage(void)
+{
+  fprintf(stderr, "Usage: mkfs [-s blocks] [-l logblocks] [-i inodes] fs.img files...\n");
+  exit(1);
 }
 
 void
@@ -0,0 +1,270 @@
+// micro and macro benchmarks of the kernel.
+//
+// bench [workload...]
+//
+// runs every workload, or just the named ones, and prints
+// one line per measurement, separated by tabs:
+//
+//   bench <workload> <param> <ops> <bytes> <ns>
+//
+// ops is the number of operations timed, bytes how much data
+// they moved (0 if none), and ns the elapsed time. workloads
+// use fixed sizes and a fixed random seed, so that runs are
+// comparable across kernels and numbers of CPUs.
+
+#include "kernel/types.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define FILESIZE (4 * 1024 * 1024)
+#define NCREATE 200
+
+static char buf[8192];
+static uint64 seed = 1;
+
+static uint
+rand(void)
+{
+  seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return seed >> 33;
+}
+
+static void
+report(char *workload, int param, int ops, uint64 bytes, uint64 ns)
+{
+  printf("bench\t%s\t%d\t%d\t%l\t%l\n", workload, param, ops, bytes, ns);
+}
+
+static void
+fail(char *workload, char *what)
+{
+  fprintf(2, "bench: %s: %s failed\n", workload, what);
+  exit(1);
+}
+
+// a system call that does nothing.
+static void
+null(void)
+{
+  int i, n = 10000;
+  uint64 start;
+
+  start = uptimens();
+  for(i = 0; i < n; i++)
+    getpid();
+  report("null", 0, n, 0, uptimens() - start);
+}
+
+// fork a child that execs a program that exits at once.
+static void
+forkexec(void)
+{
+  char *argv[] = { "bench", "-exit", 0 };
+  int i, pid, n = 100;
+  uint64 start;
+
+  start = uptimens();
+  for(i = 0; i < n; i++){
+    pid = fork();
+    if(pid < 0)
+      fail("forkexec", "fork");
+    if(pid == 0){
+      exec("bench", argv);
+      exit(1);
+    }
+    wait(0);
+  }
+  report("forkexec", 0, n, 0, uptimens() - start);
+}
+
+// push data through a pipe in writes of size bytes,
+// at most FILESIZE bytes or 16384 writes.
+static void
+pipes(int size)
+{
+  int fds[2], i, n, got;
+  uint64 start;
+
+  if(pipe(fds) < 0)
+    fail("pipe", "pipe");
+  n = FILESIZE / size;
+  if(n > 16384)
+    n = 16384;
+
+  start = uptimens();
+  if(fork() == 0){
+    close(fds[0]);
+    for(i = 0; i < n; i++)
+      if(write(fds[1], buf, size) != size)
+        exit(1);
+    exit(0);
+  }
+  close(fds[1]);
+  got = 0;
+  while((i = read(fds[0], buf + 4096, 4096)) > 0)
+    got += i;
+  wait(0);
+  close(fds[0]);
+
+  if(got != n * size)
+    fail("pipe", "read");
+  report("pipe", size, n, got, uptimens() - start);
+}
+
+static void
+seqwrite(int size)
+{
+  int fd, i, n = FILESIZE / size;
+  uint64 start;
+
+  start = uptimens();
+  if((fd = open("bench.seq", O_CREATE | O_TRUNC | O_WRONLY)) < 0)
+    fail("seqwrite", "open");
+  for(i = 0; i < n; i++)
+    if(write(fd, buf, size) != size)
+      fail("seqwrite", "write");
+  close(fd);
+  report("seqwrite", size, n, FILESIZE, uptimens() - start);
+}
+
+static void
+seqread(int size)
+{
+  int fd, i, n = 0;
+  uint64 start, bytes = 0;
+
+  start = uptimens();
+  if((fd = open("bench.seq", O_RDONLY)) < 0)
+    fail("seqread", "open");
+  while((i = read(fd, buf, size)) > 0){
+    bytes += i;
+    n++;
+  }
+  close(fd);
+  if(bytes != FILESIZE)
+    fail("seqread", "read");
+  report("seqread", size, n, bytes, uptimens() - start);
+  unlink("bench.seq");
+}
+
+// write and read blocks at random offsets of one file
+// with pwrite and pread, which scatters the accesses over it.
+static void
+randrw(int size)
+{
+  int fd, i, n = 256, nblock = FILESIZE / size;
+  uint64 start;
+
+  if((fd = open("bench.rand", O_CREATE | O_TRUNC | O_RDWR)) < 0)
+    fail("randwrite", "create");
+  for(i = 0; i < nblock; i++)
+    if(write(fd, buf, size) != size)
+      fail("randwrite", "write");
+
+  start = uptimens();
+  for(i = 0; i < n; i++)
+    if(pwrite(fd, buf, size, (rand() % nblock) * size) != size)
+      fail("randwrite", "pwrite");
+  report("randwrite", size, n, (uint64)n * size, uptimens() - start);
+
+  start = uptimens();
+  for(i = 0; i < n; i++)
+    if(pread(fd, buf, size, (rand() % nblock) * size) != size)
+      fail("randread", "pread");
+  report("randread", size, n, (uint64)n * size, uptimens() - start);
+
+  close(fd);
+  unlink("bench.rand");
+}
+
+static void
+createunlink(void)
+{
+  char name[] = "bench.cXXX";
+  int fd, i;
+  uint64 start;
+
+  start = uptimens();
+  for(i = 0; i < NCREATE; i++){
+    name[7] = '0' + i / 100;
+    name[8] = '0' + i / 10 % 10;
+    name[9] = '0' + i % 10;
+    if((fd = open(name, O_CREATE | O_WRONLY)) < 0)
+      fail("create", "open");
+    close(fd);
+  }
+  report("create", 0, NCREATE, 0, uptimens() - start);
+
+  start = uptimens();
+  for(i = 0; i < NCREATE; i++){
+    name[7] = '0' + i / 100;
+    name[8] = '0' + i / 10 % 10;
+    name[9] = '0' + i % 10;
+    if(unlink(name) < 0)
+      fail("unlink", "unlink");
+  }
+  report("unlink", 0, NCREATE, 0, uptimens() - start);
+}
+
+// grow the heap a page at a time, touching each page.
+static void
+grow(void)
+{
+  int i, n = 1024;
+  uint64 start;
+  char *p;
+
+  start = uptimens();
+  for(i = 0; i < n; i++){
+    p = sbrk(4096);
+    if(p == (char*)-1)
+      fail("sbrk", "sbrk");
+    *p = 1;
+  }
+  report("sbrk", 4096, n, (uint64)n * 4096, uptimens() - start);
+  sbrk(-n * 4096);
+}
+
+static void
+run(char *workload)
+{
+  static int sizes[] = { 1, 64, 512, 4096 };
+  int i, all = workload == 0;
+
+  if(all || strcmp(workload, "null") == 0)
+    null();
+  if(all || strcmp(workload, "forkexec") == 0)
+    forkexec();
+  if(all || strcmp(workload, "pipe") == 0)
+    for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+      pipes(sizes[i]);
+  if(all || strcmp(workload, "seq") == 0){
+    for(i = 2; i < sizeof(sizes) / sizeof(sizes[0]); i++){
+      seqwrite(sizes[i]);
+      seqread(sizes[i]);
+    }
+  }
+  if(all || strcmp(workload, "rand") == 0)
+    randrw(1024);
+  if(all || strcmp(workload, "create") == 0)
+    createunlink();
+  if(all || strcmp(workload, "sbrk") == 0)
+    grow();
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i;
+
+  if(argc > 1 && strcmp(argv[1], "-exit") == 0)
+    exit(0);
+
+  memset(buf, 'b', sizeof(buf));
+  if(argc == 1)
+    run(0);
+  for(i = 1; i < argc; i++)
+    run(argv[i]);
+  printf("bench done\n");
+  exit(0);
+}
@@ -0,0 +1,131 @@
+// print the kernel's trace statistics.
+//
+// ktrace       system call and disk latency, and trap counts
+// ktrace -e    the recent events of every CPU
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/syscall.h"
+#include "kernel/trace.h"
+#include "user/user.h"
+
+static char *syscalls[] = {
+[SYS_fork]     "fork",
+[SYS_exit]     "exit",
+[SYS_wait]     "wait",
+[SYS_pipe]     "pipe",
+[SYS_read]     "read",
+[SYS_kill]     "kill",
+[SYS_exec]     "exec",
+[SYS_fstat]    "fstat",
+[SYS_chdir]    "chdir",
+[SYS_dup]      "dup",
+[SYS_getpid]   "getpid",
+[SYS_sbrk]     "sbrk",
+[SYS_sleep]    "sleep",
+[SYS_uptime]   "uptime",
+[SYS_open]     "open",
+[SYS_write]    "write",
+[SYS_mknod]    "mknod",
+[SYS_unlink]   "unlink",
+[SYS_link]     "link",
+[SYS_mkdir]    "mkdir",
+[SYS_close]    "close",
+[SYS_pipesize] "pipesize",
+[SYS_splice]   "splice",
+[SYS_uptimens] "uptimens",
+[SYS_trace]    "trace",
+[SYS_profile]  "profile",
+[SYS_readv]    "readv",
+[SYS_writev]   "writev",
+[SYS_pread]    "pread",
+[SYS_pwrite]   "pwrite",
+[SYS_mount]    "mount",
+};
+
+#define NSYSCALL (sizeof(syscalls) / sizeof(syscalls[0]))
+
+static struct histogram stats[NSYSCALL];
+static struct event events[NCPU * NTRACE];
+static uint64 traps[2][NCAUSE];
+
+// microseconds in t ticks of the time CSR.
+static uint64
+us(uint64 t)
+{
+  return t * 1000000 / TIMEBASE;
+}
+
+// print the count, mean, and the highest non-empty bucket.
+static void
+summary(char *name, struct histogram *h)
+{
+  int i, top;
+
+  if(h->count == 0)
+    return;
+  top = 0;
+  for(i = 0; i < NBUCKET; i++)
+    if(h->buckets[i])
+      top = i;
+  printf("%s\t%l\t%l us mean\t< %l us max\n", name, h->count,
+         us(h->total / h->count), us(1L << top));
+}
+
+static void
+dumpevents(void)
+{
+  int i, n;
+
+  n = trace(TRACE_EVENTS, events, sizeof(events));
+  if(n < 0){
+    fprintf(2, "ktrace: cannot read events\n");
+    exit(1);
+  }
+  for(i = 0; i < n / sizeof(struct event); i++){
+    struct event *e = &events[i];
+    switch(e->kind){
+    case EV_SYSCALL:
+      printf("%d %l syscall %s %l us\n", (int)e->cpu, e->time,
+             e->a0 < NSYSCALL && syscalls[e->a0] ? syscalls[e->a0] : "?", us(e->a1));
+      break;
+    case EV_SWITCH:
+      printf("%d %l switch pid %l\n", (int)e->cpu, e->time, e->a0);
+      break;
+    case EV_DISK:
+      printf("%d %l disk block %l %l us\n", (int)e->cpu, e->time, e->a0, us(e->a1));
+      break;
+    }
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct histogram disk;
+  int i, n;
+
+  if(argc > 1 && strcmp(argv[1], "-e") == 0){
+    dumpevents();
+    exit(0);
+  }
+
+  n = trace(TRACE_SYSCALLS, stats, sizeof(stats));
+  if(n < 0 || trace(TRACE_DISK, &disk, sizeof(disk)) < 0 ||
+     trace(TRACE_TRAPS, traps, sizeof(traps)) < 0){
+    fprintf(2, "ktrace: cannot read statistics\n");
+    exit(1);
+  }
+
+  for(i = 1; i < n / sizeof(struct histogram); i++)
+    if(syscalls[i])
+      summary(syscalls[i], &stats[i]);
+  summary("disk", &disk);
+
+  for(i = 0; i < NCAUSE; i++){
+    if(traps[0][i] || traps[1][i])
+      printf("%s %d\tkernel %l\tuser %l\n", i < 16 ? "exception" : "interrupt",
+             i % 16, traps[0][i], traps[1][i]);
+  }
+  exit(0);
+}
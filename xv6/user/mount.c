@@ -0,0 +1,24 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// mount dev dir
+//
+// mount the file system of disk dev, such as 2 for the
+// second virtio disk, on the directory dir.
+
+int
+main(int argc, char *argv[])
+{
+  if(argc != 3){
+    fprintf(2, "Usage: mount dev dir\n");
+    exit(1);
+  }
+
+  if(mount(atoi(argv[1]), argv[2]) < 0){
+    fprintf(2, "mount: cannot mount disk %s on %s\n", argv[1], argv[2]);
+    exit(1);
+  }
+
+  exit(0);
+}
@@ -0,0 +1,365 @@
+// run a command under the kernel's sampling profiler,
+// and print where the samples landed, by function.
+//
+// prof [-k kernel] command [args...]
+//
+// kernel samples are looked up in the kernel's symbols,
+// /kernel.sym by default, and user samples of the command
+// in the command's own executable. "self" counts samples
+// taken in a function, "total" samples with the function
+// anywhere in the kernel backtrace.
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/profile.h"
+#include "user/user.h"
+
+// the parts of ELF that hold the symbol table.
+struct elfhdr {
+  uint magic;
+  uchar elf[12];
+  ushort type;
+  ushort machine;
+  uint version;
+  uint64 entry;
+  uint64 phoff;
+  uint64 shoff;
+  uint flags;
+  ushort ehsize;
+  ushort phentsize;
+  ushort phnum;
+  ushort shentsize;
+  ushort shnum;
+  ushort shstrndx;
+};
+
+struct secthdr {
+  uint name;
+  uint type;
+  uint64 flags;
+  uint64 addr;
+  uint64 off;
+  uint64 size;
+  uint link;
+  uint info;
+  uint64 addralign;
+  uint64 entsize;
+};
+
+struct elfsym {
+  uint name;
+  uchar info;
+  uchar other;
+  ushort shndx;
+  uint64 value;
+  uint64 size;
+};
+
+#define ELF_MAGIC 0x464C457FU
+#define SHT_SYMTAB 2
+#define STT_FUNC 2
+
+struct func {
+  uint64 addr;
+  uint64 size;
+  char *name;
+  int self;
+  int total;
+};
+
+struct symtab {
+  struct func *funcs;
+  int n;
+  int self;   // samples in no known function
+};
+
+static struct sample samples[NCPU * NPROF];
+
+// read exactly n bytes at offset off of the file,
+// which has been read up to *pos. there's no lseek.
+static int
+readat(int fd, uint64 *pos, uint64 off, void *dst, uint64 n)
+{
+  char skip[512];
+  int m;
+
+  if(off < *pos)
+    return -1;
+  while(*pos < off){
+    m = off - *pos < sizeof(skip) ? off - *pos : sizeof(skip);
+    if(read(fd, skip, m) != m)
+      return -1;
+    *pos += m;
+  }
+  while(n > 0){
+    m = n < 4096 ? n : 4096;
+    if(read(fd, dst, m) != m)
+      return -1;
+    dst = (char*)dst + m;
+    *pos += m;
+    n -= m;
+  }
+  return 0;
+}
+
+// read the section sh of the file into memory.
+static char*
+section(char *path, struct secthdr *sh)
+{
+  uint64 pos = 0;
+  char *p;
+  int fd;
+
+  if((fd = open(path, 0)) < 0)
+    return 0;
+  p = malloc(sh->size + 1);
+  if(p == 0 || readat(fd, &pos, sh->off, p, sh->size) < 0){
+    close(fd);
+    free(p);
+    return 0;
+  }
+  p[sh->size] = 0;
+  close(fd);
+  return p;
+}
+
+// turn a legacy Rust symbol like _ZN6kernel2fs6lookup17h0123456789abcdefE
+// into kernel::fs::lookup. other names are left alone.
+static char*
+demangle(char *s)
+{
+  char *p, *q, *name;
+  int n;
+
+  if(strlen(s) < 4 || s[0] != '_' || s[1] != 'Z' || s[2] != 'N')
+    return s;
+  // each length prefix of at least one digit becomes "::".
+  if((name = malloc(2 * strlen(s))) == 0)
+    return s;
+  p = s + 3;
+  q = name;
+  while(*p >= '0' && *p <= '9'){
+    n = atoi(p);
+    while(*p >= '0' && *p <= '9')
+      p++;
+    if(n == 17 && p[0] == 'h' && p[n] == 'E')
+      break;   // the hash at the end
+    if(q != name){
+      *q++ = ':';
+      *q++ = ':';
+    }
+    memmove(q, p, n);
+    q += n;
+    p += n;
+  }
+  *q = 0;
+  return name;
+}
+
+static void
+sortfuncs(struct func *f, int n)
+{
+  struct func t;
+  int gap, i, j;
+
+  for(gap = n / 2; gap > 0; gap /= 2){
+    for(i = gap; i < n; i++){
+      t = f[i];
+      for(j = i; j >= gap && f[j - gap].addr > t.addr; j -= gap)
+        f[j] = f[j - gap];
+      f[j] = t;
+    }
+  }
+}
+
+// load the functions of an ELF file.
+static int
+loadsyms(char *path, struct symtab *tab)
+{
+  struct elfhdr elf;
+  struct secthdr *sh;
+  struct elfsym *syms;
+  char *strs;
+  uint64 pos = 0;
+  int fd, i, nsym;
+
+  tab->n = 0;
+  tab->self = 0;
+  if((fd = open(path, 0)) < 0)
+    return -1;
+  if(readat(fd, &pos, 0, &elf, sizeof(elf)) < 0 || elf.magic != ELF_MAGIC ||
+     elf.shentsize != sizeof(struct secthdr)){
+    close(fd);
+    return -1;
+  }
+  sh = malloc(elf.shnum * sizeof(*sh));
+  if(readat(fd, &pos, elf.shoff, sh, elf.shnum * sizeof(*sh)) < 0){
+    close(fd);
+    free(sh);
+    return -1;
+  }
+  close(fd);
+
+  for(i = 0; i < elf.shnum; i++)
+    if(sh[i].type == SHT_SYMTAB)
+      break;
+  if(i == elf.shnum || sh[i].link >= elf.shnum){
+    free(sh);
+    return -1;
+  }
+  syms = (struct elfsym*)section(path, &sh[i]);
+  strs = section(path, &sh[sh[i].link]);
+  nsym = sh[i].size / sizeof(struct elfsym);
+  free(sh);
+  if(syms == 0 || strs == 0)
+    return -1;
+
+  tab->funcs = malloc(nsym * sizeof(struct func));
+  for(i = 0; i < nsym; i++){
+    if((syms[i].info & 0xf) != STT_FUNC || syms[i].size == 0)
+      continue;
+    tab->funcs[tab->n].addr = syms[i].value;
+    tab->funcs[tab->n].size = syms[i].size;
+    tab->funcs[tab->n].name = demangle(strs + syms[i].name);
+    tab->funcs[tab->n].self = 0;
+    tab->funcs[tab->n].total = 0;
+    tab->n++;
+  }
+  free(syms);
+  sortfuncs(tab->funcs, tab->n);
+  return 0;
+}
+
+static struct func*
+lookup(struct symtab *tab, uint64 pc)
+{
+  int lo, hi, mid;
+
+  lo = 0;
+  hi = tab->n;
+  while(lo < hi){
+    mid = (lo + hi) / 2;
+    if(tab->funcs[mid].addr <= pc)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if(lo == 0 || pc >= tab->funcs[lo - 1].addr + tab->funcs[lo - 1].size)
+    return 0;
+  return &tab->funcs[lo - 1];
+}
+
+static void
+count(struct symtab *tab, struct sample *s)
+{
+  struct func *f, *seen[NPROFDEPTH];
+  int i, j;
+
+  for(i = 0; i < s->depth; i++){
+    // return addresses point after the call.
+    f = lookup(tab, i == 0 ? s->pc[i] : s->pc[i] - 1);
+    if(i == 0){
+      if(f)
+        f->self++;
+      else
+        tab->self++;
+    }
+    seen[i] = f;
+    for(j = 0; j < i; j++)
+      if(seen[j] == f)
+        break;
+    if(f && j == i)
+      f->total++;
+  }
+}
+
+static void
+report(char *title, struct symtab *tab)
+{
+  struct func *f;
+  int i, j, best;
+
+  printf("%s\nself\ttotal\n", title);
+  // print the functions in order of self, then total, samples.
+  for(i = 0; i < tab->n; i++){
+    best = i;
+    for(j = i + 1; j < tab->n; j++){
+      f = &tab->funcs[j];
+      if(f->self > tab->funcs[best].self ||
+         (f->self == tab->funcs[best].self && f->total > tab->funcs[best].total))
+        best = j;
+    }
+    if(tab->funcs[best].total == 0)
+      break;
+    struct func t = tab->funcs[i];
+    tab->funcs[i] = tab->funcs[best];
+    tab->funcs[best] = t;
+    printf("%d\t%d\t%s\n", tab->funcs[i].self, tab->funcs[i].total, tab->funcs[i].name);
+  }
+  if(tab->self)
+    printf("%d\t-\t?\n", tab->self);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct symtab ktab, utab;
+  char *kernel = "/kernel.sym";
+  int i, n, pid, other;
+
+  i = 1;
+  if(argc > 2 && strcmp(argv[1], "-k") == 0){
+    kernel = argv[2];
+    i = 3;
+  }
+  if(i >= argc){
+    fprintf(2, "usage: prof [-k kernel] command [args...]\n");
+    exit(1);
+  }
+
+  if(profile(PROF_START, 0, 0) < 0){
+    fprintf(2, "prof: cannot start the profiler\n");
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    fprintf(2, "prof: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    exec(argv[i], &argv[i]);
+    fprintf(2, "prof: exec %s failed\n", argv[i]);
+    exit(1);
+  }
+  wait(0);
+  profile(PROF_STOP, 0, 0);
+
+  n = profile(PROF_READ, samples, sizeof(samples));
+  if(n < 0){
+    fprintf(2, "prof: cannot read samples\n");
+    exit(1);
+  }
+  n /= sizeof(struct sample);
+
+  if(loadsyms(kernel, &ktab) < 0)
+    fprintf(2, "prof: no symbols in %s\n", kernel);
+  if(loadsyms(argv[i], &utab) < 0)
+    fprintf(2, "prof: no symbols in %s\n", argv[i]);
+
+  other = 0;
+  for(int j = 0; j < n; j++){
+    if(!samples[j].user)
+      count(&ktab, &samples[j]);
+    else if(samples[j].pid == pid)
+      count(&utab, &samples[j]);
+    else
+      other++;
+  }
+
+  printf("%d samples\n", n);
+  report("kernel:", &ktab);
+  report(argv[i], &utab);
+  if(other)
+    printf("%d samples in other processes\n", other);
+  exit(0);
+}
@@ -0,0 +1,262 @@
+// buffered streams over file descriptors.
+//
+// each fd has at most one stream, made the first time it is
+// used. output to the console is flushed at each newline,
+// output to fd 2 is not buffered at all, and output to files
+// and pipes is flushed when the buffer fills. input is read
+// a block at a time. fork, exec, exit and close flush the
+// buffers first (see ulib.c), so nothing is printed twice
+// or lost.
+//
+// a stream holds either input or output; don't mix reading
+// and writing one fd through it.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "kernel/fs.h"
+#include "user/user.h"
+
+#define UNBUFFERED 1
+#define LINE 2
+#define FULL 3
+
+struct stream {
+  int fd;
+  int mode;     // 0 until first used
+  char *buf;    // BSIZE bytes, or 0 if unbuffered
+  int w;        // bytes of output in buf
+  int r, n;     // next and end of input in buf
+};
+
+static struct stream streams[NOFILE];
+
+static void flushhook(int, int);
+
+FILE*
+fdopen(int fd)
+{
+  struct stream *f;
+  struct stat st;
+
+  if(fd < 0 || fd >= NOFILE)
+    return 0;
+  f = &streams[fd];
+  if(f->mode)
+    return f;
+
+  f->fd = fd;
+  f->w = f->r = f->n = 0;
+  if(fd == 2)
+    f->mode = UNBUFFERED;
+  else if(fstat(fd, &st) == 0 && st.type == T_DEVICE)
+    f->mode = LINE;
+  else
+    f->mode = FULL;
+  if(f->mode != UNBUFFERED && f->buf == 0 && (f->buf = malloc(BSIZE)) == 0)
+    f->mode = UNBUFFERED;
+  _flushhook = flushhook;
+  return f;
+}
+
+FILE*
+fopen(const char *path, int omode)
+{
+  FILE *f;
+  int fd;
+
+  if((fd = open(path, omode)) < 0)
+    return 0;
+  if((f = fdopen(fd)) == 0)
+    close(fd);
+  return f;
+}
+
+int
+fflush(FILE *f)
+{
+  int i, n;
+
+  if(f == 0){
+    for(i = 0; i < NOFILE; i++)
+      if(streams[i].mode && fflush(&streams[i]) < 0)
+        return -1;
+    return 0;
+  }
+
+  for(i = 0; i < f->w; i += n)
+    if((n = write(f->fd, f->buf + i, f->w - i)) <= 0)
+      break;
+  n = i < f->w ? -1 : 0;
+  f->w = 0;
+  return n;
+}
+
+int
+fclose(FILE *f)
+{
+  return close(f->fd);
+}
+
+// called through _flushhook: flush the stream of fd, or all
+// of them if fd is -1, and forget it if the fd is closing.
+static void
+flushhook(int fd, int closing)
+{
+  struct stream *f;
+
+  if(fd < 0){
+    fflush(0);
+    return;
+  }
+  if(fd >= NOFILE)
+    return;
+  f = &streams[fd];
+  if(f->mode == 0)
+    return;
+  fflush(f);
+  if(closing){
+    // keep the buffer for the next stream on this fd.
+    f->mode = 0;
+    f->r = f->n = 0;
+  }
+}
+
+int
+fwrite(const void *p, int n, FILE *f)
+{
+  const char *s = p;
+  int i, m;
+
+  if(f == 0)
+    return -1;
+  if(f->mode == UNBUFFERED)
+    return write(f->fd, p, n);
+
+  f->r = f->n = 0;
+  for(i = 0; i < n; i += m){
+    if(f->w == BSIZE && fflush(f) < 0)
+      return i > 0 ? i : -1;
+    if(f->w == 0 && n - i >= BSIZE){
+      // write big pieces directly.
+      if((m = write(f->fd, s + i, n - i)) <= 0)
+        return i > 0 ? i : -1;
+      continue;
+    }
+    m = n - i < BSIZE - f->w ? n - i : BSIZE - f->w;
+    memmove(f->buf + f->w, s + i, m);
+    f->w += m;
+  }
+  if(f->mode == LINE)
+    for(i = 0; i < n; i++)
+      if(s[i] == '\n')
+        return fflush(f) < 0 ? -1 : n;
+  return n;
+}
+
+int
+fputc(int c, FILE *f)
+{
+  char ch = c;
+
+  if(f == 0)
+    return -1;
+  if(f->mode != UNBUFFERED && f->w < BSIZE - 1 && c != '\n'){
+    f->r = f->n = 0;
+    f->buf[f->w++] = ch;
+    return (uchar)ch;
+  }
+  return fwrite(&ch, 1, f) == 1 ? (uchar)ch : -1;
+}
+
+int
+fputs(const char *s, FILE *f)
+{
+  return fwrite(s, strlen(s), f);
+}
+
+// make sure some input is buffered.
+// returns 0 at end of file or on error.
+static int
+fill(FILE *f)
+{
+  int n;
+
+  if(f->r < f->n)
+    return 1;
+  if(f->w > 0 && fflush(f) < 0)
+    return 0;
+  if((n = read(f->fd, f->buf, BSIZE)) <= 0)
+    return 0;
+  f->r = 0;
+  f->n = n;
+  return 1;
+}
+
+int
+fread(void *p, int n, FILE *f)
+{
+  char *d = p;
+  int i, m;
+
+  if(f == 0)
+    return -1;
+  if(f->mode == UNBUFFERED)
+    return read(f->fd, p, n);
+
+  for(i = 0; i < n; i += m){
+    if(f->r == f->n && n - i >= BSIZE){
+      // read big pieces directly.
+      if((m = read(f->fd, d + i, n - i)) <= 0)
+        break;
+      continue;
+    }
+    if(!fill(f))
+      break;
+    m = n - i < f->n - f->r ? n - i : f->n - f->r;
+    memmove(d + i, f->buf + f->r, m);
+    f->r += m;
+  }
+  return i;
+}
+
+int
+fgetc(FILE *f)
+{
+  uchar c;
+
+  if(f == 0)
+    return -1;
+  if(f->mode != UNBUFFERED){
+    if(!fill(f))
+      return -1;
+    return (uchar)f->buf[f->r++];
+  }
+  return read(f->fd, &c, 1) == 1 ? c : -1;
+}
+
+// read a line of at most max-1 characters, ending with
+// a newline or a carriage return unless the input ended.
+// returns 0 at end of input.
+char*
+fgets(char *buf, int max, FILE *f)
+{
+  int i, c;
+
+  for(i = 0; i + 1 < max; ){
+    if((c = fgetc(f)) < 0)
+      break;
+    buf[i++] = c;
+    if(c == '\n' || c == '\r')
+      break;
+  }
+  buf[i] = '\0';
+  return i > 0 ? buf : 0;
+}
+
+char*
+gets(char *buf, int max)
+{
+  fgets(buf, max, fdopen(0));
+  return buf;
+}
@@ -14,6 +14,46 @@ _main()
   exit(0);
 }
 
+//
+// stdio.c points this at a function that flushes the stream
+// of an fd, or every stream for fd -1, and forgets the stream
+// if the fd is being closed. programs that never use stdio
+// don't link it.
+//
+void (*_flushhook)(int, int);
+
+int
+fork(void)
+{
+  if(_flushhook)
+    _flushhook(-1, 0);
+  return _fork();
+}
+
+int
+exec(char *path, char **argv)
+{
+  if(_flushhook)
+    _flushhook(-1, 0);
+  return _exec(path, argv);
+}
+
+int
+exit(int status)
+{
+  if(_flushhook)
+    _flushhook(-1, 0);
+  _exit(status);
+}
+
+int
+close(int fd)
+{
+  if(_flushhook)
+    _flushhook(fd, 1);
+  return _close(fd);
+}
+
 char*
 strcpy(char *s, const char *t)
 {
@@ -63,24 +103,6 @@ strchr(const char *s, char c)
   return 0;
 }
 
-char*
-gets(char *buf, int max)
-{
-  int i, cc;
-  char c;
-
-  for(i=0; i+1 < max; ){
-    cc = read(0, &c, 1);
-    if(cc < 1)
-      break;
-    buf[i++] = c;
-    if(c == '\n' || c == '\r')
-      break;
-  }
-  buf[i] = '\0';
-  return buf;
-}
-
 int
 stat(const char *n, struct stat *st)
 {
@@ -3,8 +3,19 @@
 #include "user/user.h"
 #include "kernel/param.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Memory allocator with size classes.
+//
+// Small blocks, of at most 2 KB with their header, come in
+// power-of-two sizes, each with its own free list, so malloc
+// and free of them take constant time. They are carved out of
+// runs taken from the large allocator, and stay in their class
+// once freed.
+//
+// Larger blocks, and the runs, come from the allocator by
+// Kernighan and Ritchie, The C programming Language, 2nd ed.
+// Section 8.7: an address-ordered free list that coalesces
+// neighbouring free blocks. It grows the heap with sbrk in
+// batches of at least NALLOC units.
 
 typedef long Align;
 
@@ -18,15 +29,21 @@ union header {
 
 typedef union header Header;
 
+#define NCLASS 7                       // classes of 2, 4, ..., 128 units
+#define MAXSMALL (2 << (NCLASS - 1))   // units of the largest class
+#define RUN 256                        // units carved at a time
+#define NALLOC 4096                    // least units from sbrk
+
 static Header base;
 static Header *freep;
+static Header *classes[NCLASS];
 
-void
-free(void *ap)
+// free a block of the large allocator.
+static void
+freelarge(Header *bp)
 {
-  Header *bp, *p;
+  Header *p;
 
-  bp = (Header*)ap - 1;
   for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
     if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
       break;
@@ -43,30 +60,51 @@ free(void *ap)
   freep = p;
 }
 
+void
+free(void *ap)
+{
+  Header *bp;
+  int c;
+
+  if(ap == 0)
+    return;
+  bp = (Header*)ap - 1;
+  if(bp->s.size > MAXSMALL){
+    freelarge(bp);
+    return;
+  }
+  for(c = 0; (2 << c) < bp->s.size; c++)
+    ;
+  bp->s.ptr = classes[c];
+  classes[c] = bp;
+}
+
 static Header*
 morecore(uint nu)
 {
   char *p;
   Header *hp;
 
-  if(nu < 4096)
-    nu = 4096;
-  p = sbrk(nu * sizeof(Header));
+  // ask for a batch, but settle for what's needed.
+  p = (char*)-1;
+  if(nu < NALLOC && (p = sbrk(NALLOC * sizeof(Header))) != (char*)-1)
+    nu = NALLOC;
+  if(p == (char*)-1)
+    p = sbrk(nu * sizeof(Header));
   if(p == (char*)-1)
     return 0;
   hp = (Header*)p;
   hp->s.size = nu;
-  free((void*)(hp + 1));
+  freelarge(hp);
   return freep;
 }
 
-void*
-malloc(uint nbytes)
+// allocate nunits from the large allocator.
+static Header*
+alloclarge(uint nunits)
 {
   Header *p, *prevp;
-  uint nunits;
 
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
   if((prevp = freep) == 0){
     base.s.ptr = freep = prevp = &base;
     base.s.size = 0;
@@ -81,10 +119,50 @@ malloc(uint nbytes)
         p->s.size = nunits;
       }
       freep = prevp;
-      return (void*)(p + 1);
+      return p;
     }
     if(p == freep)
       if((p = morecore(nunits)) == 0)
         return 0;
   }
 }
+
+// fill class c with blocks cut from a new run.
+static int
+carve(int c)
+{
+  Header *run, *p;
+  uint units = 2 << c;
+
+  if((run = alloclarge(RUN)) == 0)
+    return -1;
+  for(p = run; p + units <= run + RUN; p += units){
+    p->s.size = units;
+    p->s.ptr = classes[c];
+    classes[c] = p;
+  }
+  return 0;
+}
+
+void*
+malloc(uint nbytes)
+{
+  Header *p;
+  uint nunits;
+  int c;
+
+  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
+  if(nunits > MAXSMALL){
+    if((p = alloclarge(nunits)) == 0)
+      return 0;
+    return (void*)(p + 1);
+  }
+
+  for(c = 0; (2 << c) < nunits; c++)
+    ;
+  if(classes[c] == 0 && carve(c) < 0)
+    return 0;
+  p = classes[c];
+  classes[c] = p->s.ptr;
+  return (void*)(p + 1);
+}
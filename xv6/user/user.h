@@ -1,6 +1,12 @@
 struct stat;
 struct rtcdate;
 
+// a buffer of readv() and writev().
+struct iovec {
+  void *iov_base;
+  uint64 iov_len;
+};
+
 // system calls
 int fork(void);
 int exit(int) __attribute__((noreturn));
@@ -23,6 +29,16 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int pipesize(int, int);
+int splice(int, int, int);
+uint64 uptimens(void);
+int trace(int, void*, int);
+int profile(int, void*, int);
+int readv(int, const struct iovec*, int);
+int writev(int, const struct iovec*, int);
+int pread(int, void*, int, uint);
+int pwrite(int, const void*, int, uint);
+int mount(int, const char*);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -32,7 +48,6 @@ char* strchr(const char*, char c);
 int strcmp(const char*, const char*);
 void fprintf(int, const char*, ...);
 void printf(const char*, ...);
-char* gets(char*, int max);
 uint strlen(const char*);
 void* memset(void*, int, uint);
 void* malloc(uint);
@@ -40,3 +55,24 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+extern void (*_flushhook)(int, int);
+
+// usys.S, wrapped by ulib.c
+int _fork(void);
+int _exec(char*, char**);
+int _exit(int) __attribute__((noreturn));
+int _close(int);
+
+// stdio.c
+typedef struct stream FILE;
+FILE* fdopen(int);
+FILE* fopen(const char*, int);
+int fclose(FILE*);
+int fflush(FILE*);
+int fwrite(const void*, int, FILE*);
+int fputc(int, FILE*);
+int fputs(const char*, FILE*);
+int fread(void*, int, FILE*);
+int fgetc(FILE*);
+char* fgets(char*, int, FILE*);
+char* gets(char*, int max);